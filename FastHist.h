@@ -0,0 +1,577 @@
+////////////////////////////////////////
+// Lightweight histograms for the event loop
+////////////////////////////////////////
+
+// Histograms which are filled in the event loop without going through ROOT: the bin contents and
+// sums of squared weights are kept in contiguous arrays, the bin is found with an inlined
+// computation, and there is no virtual dispatch.  The ROOT histogram of the given type (TH1F,
+// TH1I, TH2I, TProfile2D, ...) is only created when Write() is called, with the same name, title
+// and binning, the accumulated contents and errors, and the same statistics and number of entries
+// as if it had been filled directly.  Bins are numbered as in ROOT, with the underflow in bin 0 and
+// the overflow in bin nbins+1, and the statistics only include the in-range fills.
+//
+// Arrays of values can also be filled with FillN(), which bins them in blocks: the bins of a block
+// are computed in one loop and then added to the cells in a second loop.  The result is identical to
+// filling one at a time, but it is not faster: the bin loop is not vectorised (the clamping is
+// compiled to branches) and the scatter-add to the cells dominates, so FillN() costs about the same
+// as Fill() (see fastHistBench).  It is meant for values which are already in arrays, such as the
+// columns of EventColumns.h.
+//
+// The histograms are not thread-safe: each thread should fill its own copy, and the copies are
+// merged with Add() before writing.
+
+#ifndef FASTHIST_H
+#define FASTHIST_H
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+
+#include "TH1.h"
+#include "TArrayD.h"
+
+
+// Fixed or variable binning along one axis, with the same bin search as TAxis::FindFixBin
+class FastAxis
+{
+    public:
+        FastAxis(const int nbins, const double min, const double max)
+            : m_nbins(nbins)
+            , m_min(min)
+            , m_max(max)
+        { }
+
+        FastAxis(const int nbins, const double* edges)
+            : m_nbins(nbins)
+            , m_min(edges[0])
+            , m_max(edges[nbins])
+            , m_edges(edges,edges+nbins+1)
+        { }
+
+        inline int findBin(const double x) const
+        {
+            if (x < m_min)
+                return 0;
+            if (!(x < m_max))
+                return m_nbins+1;
+            if (m_edges.empty())
+                return 1 + static_cast<int>(m_nbins*(x-m_min)/(m_max-m_min));
+            return std::upper_bound(m_edges.begin(),m_edges.end(),x) - m_edges.begin();
+        }
+
+        // Bins of n values, the same as findBin
+        void findBins(const int n, const double* x, int* bins) const
+        {
+            if (!m_edges.empty())
+            {
+                for (int i = 0; i < n; ++i)
+                    bins[i] = findBin(x[i]);
+                return;
+            }
+            const double nbins = m_nbins;
+            for (int i = 0; i < n; ++i)
+            {
+                // Clamp before the conversion, so that far out-of-range and NaN values are well defined
+                const int bin = 1 + static_cast<int>(std::max(-1.,std::min(nbins,nbins*(x[i]-m_min)/(m_max-m_min))));
+                bins[i] = x[i] < m_min ? 0 : (x[i] < m_max ? bin : m_nbins+1);
+            }
+        }
+
+        int nbins() const { return m_nbins; }
+        double min() const { return m_min; }
+        double max() const { return m_max; }
+        const std::vector<double>& edges() const { return m_edges; }
+        bool operator==(const FastAxis& other) const { return m_nbins == other.m_nbins && m_min == other.m_min && m_max == other.m_max && m_edges == other.m_edges; }
+
+    private:
+        int m_nbins;
+        double m_min;
+        double m_max;
+        std::vector<double> m_edges;
+};
+
+
+// Contents shared by all histogram types: per-bin sums and the global statistics
+class FastHistBase
+{
+    public:
+        const char* GetName() const { return m_name.c_str(); }
+        const char* GetTitle() const { return m_title.c_str(); }
+        double GetEntries() const { return m_entries; }
+        double GetBinContent(const int bin) const { return m_sumw.at(bin); }
+        double GetBinError(const int bin) const { return std::sqrt(m_sumw2.at(bin)); }
+
+        void Reset()
+        {
+            std::fill(m_sumw.begin(),m_sumw.end(),0.);
+            std::fill(m_sumw2.begin(),m_sumw2.end(),0.);
+            std::fill(m_stats.begin(),m_stats.end(),0.);
+            m_entries  = 0;
+            m_weighted = false;
+        }
+
+        // Number of values binned per block by FillN()
+        enum { kBlockSize = 256 };
+
+    protected:
+        FastHistBase(const char* name, const char* title, const size_t numCells, const size_t numStats)
+            : m_name(name)
+            , m_title(title)
+            , m_sumw(numCells,0.)
+            , m_sumw2(numCells,0.)
+            , m_stats(numStats,0.)
+            , m_entries(0)
+            , m_weighted(false)
+        { }
+
+        inline void addCell(const int cell, const double w)
+        {
+            ++m_entries;
+            if (w != 1)
+                m_weighted = true;
+            m_sumw[cell]  += w;
+            m_sumw2[cell] += w*w;
+        }
+
+        // Scatter-add of a block of weights to their cells
+        void addCells(const int num, const int* cells, const double* w)
+        {
+            bool weighted = false;
+            for (int i = 0; i < num; ++i)
+            {
+                m_sumw[cells[i]]  += w[i];
+                m_sumw2[cells[i]] += w[i]*w[i];
+                weighted = weighted || w[i] != 1;
+            }
+            m_entries += num;
+            m_weighted = m_weighted || weighted;
+        }
+
+        void addBase(const FastHistBase& other)
+        {
+            for (size_t iCell = 0; iCell < m_sumw.size(); ++iCell)
+            {
+                m_sumw[iCell]  += other.m_sumw[iCell];
+                m_sumw2[iCell] += other.m_sumw2[iCell];
+            }
+            for (size_t iStat = 0; iStat < m_stats.size(); ++iStat)
+                m_stats[iStat] += other.m_stats[iStat];
+            m_entries  += other.m_entries;
+            m_weighted  = m_weighted || other.m_weighted;
+        }
+
+        // Contents, errors (if there were weighted fills), statistics and entries of a histogram
+        template <typename RootHist>
+        void fillRoot(RootHist& hist) const
+        {
+            if (m_weighted)
+                hist.Sumw2();
+            for (size_t iCell = 0; iCell < m_sumw.size(); ++iCell)
+                hist.SetBinContent(iCell,m_sumw[iCell]);
+            if (m_weighted)
+                std::copy(m_sumw2.begin(),m_sumw2.end(),hist.GetSumw2()->fArray);
+            putStats(hist);
+        }
+
+        template <typename RootHist>
+        void putStats(RootHist& hist) const
+        {
+            std::vector<double> stats(m_stats);
+            hist.PutStats(stats.data());
+            hist.SetEntries(m_entries);
+        }
+
+        std::string m_name;
+        std::string m_title;
+        std::vector<double> m_sumw;
+        std::vector<double> m_sumw2;
+        std::vector<double> m_stats;
+        double m_entries;
+        bool m_weighted;
+};
+
+
+// One-dimensional histogram, statistics as in TH1: sumw, sumw2, sumwx, sumwx2
+template <typename RootHist>
+class FastHist1D : public FastHistBase
+{
+    public:
+        FastHist1D(const char* name, const char* title, const int nbins, const double min, const double max)
+            : FastHistBase(name,title,nbins+2,4)
+            , m_axis(nbins,min,max)
+        { }
+
+        FastHist1D(const char* name, const char* title, const int nbins, const double* edges)
+            : FastHistBase(name,title,nbins+2,4)
+            , m_axis(nbins,edges)
+        { }
+
+        inline void Fill(const double x, const double w = 1)
+        {
+            const int bin = m_axis.findBin(x);
+            addCell(bin,w);
+            if (bin == 0 || bin > m_axis.nbins())
+                return;
+            m_stats[0] += w;
+            m_stats[1] += w*w;
+            m_stats[2] += w*x;
+            m_stats[3] += w*x*x;
+        }
+
+        void FillN(const int n, const double* x, const double* w)
+        {
+            int bins[kBlockSize];
+            double stats[4];
+            std::copy(m_stats.begin(),m_stats.end(),stats);
+            for (int start = 0; start < n; start += kBlockSize)
+            {
+                const int num = std::min<int>(kBlockSize,n-start);
+                m_axis.findBins(num,x+start,bins);
+                addCells(num,bins,w+start);
+                for (int i = 0; i < num; ++i)
+                {
+                    const double xi = x[start+i];
+                    const double wi = w[start+i];
+                    const bool inRange = bins[i] > 0 && bins[i] <= m_axis.nbins();
+                    stats[0] += inRange ? wi : 0.;
+                    stats[1] += inRange ? wi*wi : 0.;
+                    stats[2] += inRange ? wi*xi : 0.;
+                    stats[3] += inRange ? wi*xi*xi : 0.;
+                }
+            }
+            std::copy(stats,stats+4,m_stats.begin());
+        }
+
+        double GetMean() const { return m_stats[0] ? m_stats[2]/m_stats[0] : 0; }
+        double GetRMS() const
+        {
+            if (!m_stats[0])
+                return 0;
+            const double mean = GetMean();
+            return std::sqrt(std::fabs(m_stats[3]/m_stats[0] - mean*mean));
+        }
+
+        void Add(const FastHist1D& other) { addBase(other); }
+
+        int Write() const
+        {
+            std::unique_ptr<RootHist> hist(m_axis.edges().empty() ? new RootHist(GetName(),GetTitle(),m_axis.nbins(),m_axis.min(),m_axis.max())
+                                                                  : new RootHist(GetName(),GetTitle(),m_axis.nbins(),m_axis.edges().data()));
+            fillRoot(*hist);
+            return hist->Write();
+        }
+
+    private:
+        FastAxis m_axis;
+};
+
+
+// Two-dimensional histogram, statistics as in TH2: sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2, sumwxy
+template <typename RootHist>
+class FastHist2D : public FastHistBase
+{
+    public:
+        FastHist2D(const char* name, const char* title, const int nbinsx, const double xmin, const double xmax, const int nbinsy, const double ymin, const double ymax)
+            : FastHistBase(name,title,(nbinsx+2)*(nbinsy+2),7)
+            , m_xaxis(nbinsx,xmin,xmax)
+            , m_yaxis(nbinsy,ymin,ymax)
+        { }
+
+        FastHist2D(const char* name, const char* title, const int nbinsx, const double* xedges, const int nbinsy, const double ymin, const double ymax)
+            : FastHistBase(name,title,(nbinsx+2)*(nbinsy+2),7)
+            , m_xaxis(nbinsx,xedges)
+            , m_yaxis(nbinsy,ymin,ymax)
+        { }
+
+        inline void Fill(const double x, const double y, const double w = 1)
+        {
+            const int binx = m_xaxis.findBin(x);
+            const int biny = m_yaxis.findBin(y);
+            addCell(binx + (m_xaxis.nbins()+2)*biny,w);
+            if (binx == 0 || binx > m_xaxis.nbins() || biny == 0 || biny > m_yaxis.nbins())
+                return;
+            m_stats[0] += w;
+            m_stats[1] += w*w;
+            m_stats[2] += w*x;
+            m_stats[3] += w*x*x;
+            m_stats[4] += w*y;
+            m_stats[5] += w*y*y;
+            m_stats[6] += w*x*y;
+        }
+
+        int GetBin(const int binx, const int biny) const { return binx + (m_xaxis.nbins()+2)*biny; }
+
+        void FillN(const int n, const double* x, const double* y, const double* w)
+        {
+            int binsx[kBlockSize];
+            int binsy[kBlockSize];
+            int cells[kBlockSize];
+            double stats[7];
+            std::copy(m_stats.begin(),m_stats.end(),stats);
+            for (int start = 0; start < n; start += kBlockSize)
+            {
+                const int num = std::min<int>(kBlockSize,n-start);
+                m_xaxis.findBins(num,x+start,binsx);
+                m_yaxis.findBins(num,y+start,binsy);
+                for (int i = 0; i < num; ++i)
+                    cells[i] = binsx[i] + (m_xaxis.nbins()+2)*binsy[i];
+                addCells(num,cells,w+start);
+                for (int i = 0; i < num; ++i)
+                {
+                    const double xi = x[start+i];
+                    const double yi = y[start+i];
+                    const double wi = w[start+i];
+                    const bool inRange = binsx[i] > 0 && binsx[i] <= m_xaxis.nbins() && binsy[i] > 0 && binsy[i] <= m_yaxis.nbins();
+                    stats[0] += inRange ? wi : 0.;
+                    stats[1] += inRange ? wi*wi : 0.;
+                    stats[2] += inRange ? wi*xi : 0.;
+                    stats[3] += inRange ? wi*xi*xi : 0.;
+                    stats[4] += inRange ? wi*yi : 0.;
+                    stats[5] += inRange ? wi*yi*yi : 0.;
+                    stats[6] += inRange ? wi*xi*yi : 0.;
+                }
+            }
+            std::copy(stats,stats+7,m_stats.begin());
+        }
+
+        void Add(const FastHist2D& other) { addBase(other); }
+
+        int Write() const
+        {
+            std::unique_ptr<RootHist> hist(m_xaxis.edges().empty() ? new RootHist(GetName(),GetTitle(),m_xaxis.nbins(),m_xaxis.min(),m_xaxis.max(),m_yaxis.nbins(),m_yaxis.min(),m_yaxis.max())
+                                                                   : new RootHist(GetName(),GetTitle(),m_xaxis.nbins(),m_xaxis.edges().data(),m_yaxis.nbins(),m_yaxis.min(),m_yaxis.max()));
+            fillRoot(*hist);
+            return hist->Write();
+        }
+
+    private:
+        FastAxis m_xaxis;
+        FastAxis m_yaxis;
+};
+
+
+// Profiles keep the sum of w*v and w*v^2 per bin (v is the profiled value) in addition to the
+// sums of w and w^2, which become the bin entries and bin sums of squared weights
+class FastProfileBase : public FastHistBase
+{
+    public:
+        // Mean of the profiled value and sum of weights of a bin, as TProfile::GetBinContent and GetBinEntries
+        double GetBinContent(const int bin) const { return m_sumw.at(bin) ? m_sumwv.at(bin)/m_sumw.at(bin) : 0; }
+        double GetBinEntries(const int bin) const { return m_sumw.at(bin); }
+
+        void Reset()
+        {
+            FastHistBase::Reset();
+            std::fill(m_sumwv.begin(),m_sumwv.end(),0.);
+            std::fill(m_sumwv2.begin(),m_sumwv2.end(),0.);
+        }
+
+    protected:
+        FastProfileBase(const char* name, const char* title, const size_t numCells, const size_t numStats)
+            : FastHistBase(name,title,numCells,numStats)
+            , m_sumwv(numCells,0.)
+            , m_sumwv2(numCells,0.)
+        { }
+
+        inline void addProfileCell(const int cell, const double v, const double w)
+        {
+            addCell(cell,w);
+            m_sumwv[cell]  += w*v;
+            m_sumwv2[cell] += w*v*v;
+        }
+
+        void addProfileCells(const int num, const int* cells, const double* v, const double* w)
+        {
+            addCells(num,cells,w);
+            for (int i = 0; i < num; ++i)
+            {
+                m_sumwv[cells[i]]  += w[i]*v[i];
+                m_sumwv2[cells[i]] += w[i]*v[i]*v[i];
+            }
+        }
+
+        void addProfile(const FastProfileBase& other)
+        {
+            addBase(other);
+            for (size_t iCell = 0; iCell < m_sumwv.size(); ++iCell)
+            {
+                m_sumwv[iCell]  += other.m_sumwv[iCell];
+                m_sumwv2[iCell] += other.m_sumwv2[iCell];
+            }
+        }
+
+        template <typename RootProfile>
+        void fillRootProfile(RootProfile& profile) const
+        {
+            if (m_weighted)
+                profile.Sumw2();
+            for (size_t iCell = 0; iCell < m_sumw.size(); ++iCell)
+            {
+                profile.SetBinContent(iCell,m_sumwv[iCell]);
+                profile.SetBinEntries(iCell,m_sumw[iCell]);
+            }
+            std::copy(m_sumwv2.begin(),m_sumwv2.end(),profile.GetSumw2()->fArray);
+            if (m_weighted)
+                std::copy(m_sumw2.begin(),m_sumw2.end(),profile.GetBinSumw2()->fArray);
+            putStats(profile);
+        }
+
+        std::vector<double> m_sumwv;
+        std::vector<double> m_sumwv2;
+};
+
+
+// Profile along one axis, statistics as in TProfile: sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2
+template <typename RootProfile>
+class FastProfile1D : public FastProfileBase
+{
+    public:
+        FastProfile1D(const char* name, const char* title, const int nbins, const double min, const double max)
+            : FastProfileBase(name,title,nbins+2,6)
+            , m_axis(nbins,min,max)
+        { }
+
+        FastProfile1D(const char* name, const char* title, const int nbins, const double* edges)
+            : FastProfileBase(name,title,nbins+2,6)
+            , m_axis(nbins,edges)
+        { }
+
+        inline void Fill(const double x, const double y, const double w = 1)
+        {
+            const int bin = m_axis.findBin(x);
+            addProfileCell(bin,y,w);
+            if (bin == 0 || bin > m_axis.nbins())
+                return;
+            m_stats[0] += w;
+            m_stats[1] += w*w;
+            m_stats[2] += w*x;
+            m_stats[3] += w*x*x;
+            m_stats[4] += w*y;
+            m_stats[5] += w*y*y;
+        }
+
+        void FillN(const int n, const double* x, const double* y, const double* w)
+        {
+            int bins[kBlockSize];
+            double stats[6];
+            std::copy(m_stats.begin(),m_stats.end(),stats);
+            for (int start = 0; start < n; start += kBlockSize)
+            {
+                const int num = std::min<int>(kBlockSize,n-start);
+                m_axis.findBins(num,x+start,bins);
+                addProfileCells(num,bins,y+start,w+start);
+                for (int i = 0; i < num; ++i)
+                {
+                    const double xi = x[start+i];
+                    const double yi = y[start+i];
+                    const double wi = w[start+i];
+                    const bool inRange = bins[i] > 0 && bins[i] <= m_axis.nbins();
+                    stats[0] += inRange ? wi : 0.;
+                    stats[1] += inRange ? wi*wi : 0.;
+                    stats[2] += inRange ? wi*xi : 0.;
+                    stats[3] += inRange ? wi*xi*xi : 0.;
+                    stats[4] += inRange ? wi*yi : 0.;
+                    stats[5] += inRange ? wi*yi*yi : 0.;
+                }
+            }
+            std::copy(stats,stats+6,m_stats.begin());
+        }
+
+        void Add(const FastProfile1D& other) { addProfile(other); }
+
+        int Write() const
+        {
+            std::unique_ptr<RootProfile> profile(m_axis.edges().empty() ? new RootProfile(GetName(),GetTitle(),m_axis.nbins(),m_axis.min(),m_axis.max())
+                                                                        : new RootProfile(GetName(),GetTitle(),m_axis.nbins(),m_axis.edges().data()));
+            fillRootProfile(*profile);
+            return profile->Write();
+        }
+
+    private:
+        FastAxis m_axis;
+};
+
+
+// Profile along two axes, statistics as in TProfile2D: sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2,
+// sumwxy, sumwz, sumwz2
+template <typename RootProfile>
+class FastProfile2D : public FastProfileBase
+{
+    public:
+        FastProfile2D(const char* name, const char* title, const int nbinsx, const double xmin, const double xmax, const int nbinsy, const double ymin, const double ymax)
+            : FastProfileBase(name,title,(nbinsx+2)*(nbinsy+2),9)
+            , m_xaxis(nbinsx,xmin,xmax)
+            , m_yaxis(nbinsy,ymin,ymax)
+        { }
+
+        inline void Fill(const double x, const double y, const double z, const double w = 1)
+        {
+            const int binx = m_xaxis.findBin(x);
+            const int biny = m_yaxis.findBin(y);
+            addProfileCell(binx + (m_xaxis.nbins()+2)*biny,z,w);
+            if (binx == 0 || binx > m_xaxis.nbins() || biny == 0 || biny > m_yaxis.nbins())
+                return;
+            m_stats[0] += w;
+            m_stats[1] += w*w;
+            m_stats[2] += w*x;
+            m_stats[3] += w*x*x;
+            m_stats[4] += w*y;
+            m_stats[5] += w*y*y;
+            m_stats[6] += w*x*y;
+            m_stats[7] += w*z;
+            m_stats[8] += w*z*z;
+        }
+
+        void FillN(const int n, const double* x, const double* y, const double* z, const double* w)
+        {
+            int binsx[kBlockSize];
+            int binsy[kBlockSize];
+            int cells[kBlockSize];
+            double stats[9];
+            std::copy(m_stats.begin(),m_stats.end(),stats);
+            for (int start = 0; start < n; start += kBlockSize)
+            {
+                const int num = std::min<int>(kBlockSize,n-start);
+                m_xaxis.findBins(num,x+start,binsx);
+                m_yaxis.findBins(num,y+start,binsy);
+                for (int i = 0; i < num; ++i)
+                    cells[i] = binsx[i] + (m_xaxis.nbins()+2)*binsy[i];
+                addProfileCells(num,cells,z+start,w+start);
+                for (int i = 0; i < num; ++i)
+                {
+                    const double xi = x[start+i];
+                    const double yi = y[start+i];
+                    const double zi = z[start+i];
+                    const double wi = w[start+i];
+                    const bool inRange = binsx[i] > 0 && binsx[i] <= m_xaxis.nbins() && binsy[i] > 0 && binsy[i] <= m_yaxis.nbins();
+                    stats[0] += inRange ? wi : 0.;
+                    stats[1] += inRange ? wi*wi : 0.;
+                    stats[2] += inRange ? wi*xi : 0.;
+                    stats[3] += inRange ? wi*xi*xi : 0.;
+                    stats[4] += inRange ? wi*yi : 0.;
+                    stats[5] += inRange ? wi*yi*yi : 0.;
+                    stats[6] += inRange ? wi*xi*yi : 0.;
+                    stats[7] += inRange ? wi*zi : 0.;
+                    stats[8] += inRange ? wi*zi*zi : 0.;
+                }
+            }
+            std::copy(stats,stats+9,m_stats.begin());
+        }
+
+        void Add(const FastProfile2D& other) { addProfile(other); }
+
+        int Write() const
+        {
+            RootProfile profile(GetName(),GetTitle(),m_xaxis.nbins(),m_xaxis.min(),m_xaxis.max(),m_yaxis.nbins(),m_yaxis.min(),m_yaxis.max());
+            fillRootProfile(profile);
+            return profile.Write();
+        }
+
+    private:
+        FastAxis m_xaxis;
+        FastAxis m_yaxis;
+};
+
+#endif
@@ -0,0 +1,88 @@
+////////////////////////////////////////
+// Registry of the histograms of each step
+////////////////////////////////////////
+
+// Each histogram is declared once with the step it belongs to, its name, title and binning, and
+// optionally a fill expression which is run for every event.  Histograms of steps which are not
+// enabled are never allocated: book() returns nullptr for them.  The registry then fills and writes
+// all the booked histograms, in the order in which they were booked.
+//
+// Fill expressions usually capture the per-event quantities by reference.  Histograms booked
+// without a fill expression are filled by hand through the returned pointer.
+
+#ifndef HISTREGISTRY_H
+#define HISTREGISTRY_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "FastHist.h"
+
+
+class HistRegistry
+{
+    public:
+        HistRegistry(const int stepNum)
+            : m_stepNum(stepNum)
+        { }
+
+        bool stepEnabled(const int step) const { return !m_stepNum || m_stepNum >= step; }
+        size_t size() const { return m_entries.size(); }
+
+        // Book a histogram of the given type (FastHist1D<TH1F>, FastProfile2D<TProfile2D>, ...),
+        // constructed from the name, title and binning, with an optional fill expression
+        template <typename Hist, typename... Binning>
+        Hist* book(const int step, std::function<void(Hist&)> fill, const char* name, const char* title, const Binning... binning)
+        {
+            if (!stepEnabled(step))
+                return nullptr;
+            Hist* hist = new Hist(name,title,binning...);
+            m_entries.emplace_back(new Entry<Hist>(hist,fill));
+            return hist;
+        }
+
+        // Run the fill expressions of all booked histograms for the current event
+        void fill()
+        {
+            for (std::unique_ptr<EntryBase>& entry : m_entries)
+                entry->runFill();
+        }
+
+        // Convert the histograms to ROOT and write them to the current directory
+        void write() const
+        {
+            for (const std::unique_ptr<EntryBase>& entry : m_entries)
+                entry->write();
+        }
+
+    private:
+        class EntryBase
+        {
+            public:
+                virtual ~EntryBase() { }
+                virtual void runFill() = 0;
+                virtual void write() const = 0;
+        };
+
+        template <typename Hist>
+        class Entry : public EntryBase
+        {
+            public:
+                Entry(Hist* hist, std::function<void(Hist&)> fillExpr)
+                    : hist(hist)
+                    , fill(fillExpr)
+                { }
+
+                void runFill() { if (fill) fill(*hist); }
+                void write() const { hist->Write(); }
+
+                std::unique_ptr<Hist> hist;
+                std::function<void(Hist&)> fill;
+        };
+
+        int m_stepNum;
+        std::vector< std::unique_ptr<EntryBase> > m_entries;
+};
+
+#endif
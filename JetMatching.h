@@ -0,0 +1,307 @@
+////////////////////////////////////////
+// Jet matching
+////////////////////////////////////////
+
+// Matching of truth jets to reconstructed jets in eta-phi.  The reconstructed jets are indexed in
+// a regular eta-phi grid, so that only the grid cells within the matching distance of a truth jet
+// are searched, instead of all pairs of jets.  Coordinates are given as flat arrays.
+//
+// The matching is either greedy, or an optimal assignment which minimises the sum of the squared
+// distances of the matched pairs, each unmatched truth jet counting as maxDeltaR^2.  Jets can also
+// be required to be isolated: no other jet of the same collection within a given distance.
+
+#ifndef JETMATCHING_H
+#define JETMATCHING_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+
+// Eta-phi grid of a set of points, with cells at least as large as the given size
+class EtaPhiGrid
+{
+    public:
+        EtaPhiGrid(const double cellSize)
+            : m_cellSize(cellSize)
+            , m_numPhi(std::max(1,static_cast<int>(2*M_PI/cellSize)))
+            , m_cellPhi(2*M_PI/m_numPhi)
+            , m_etaMin(0)
+            , m_numEta(0)
+        { }
+
+        void fill(const std::vector<double>& eta, const std::vector<double>& phi)
+        {
+            m_eta = &eta;
+            m_phi = &phi;
+            m_cellStart.clear();
+            m_cellEntries.clear();
+            if (eta.empty())
+            {
+                m_numEta = 0;
+                return;
+            }
+
+            m_etaMin = *std::min_element(eta.begin(),eta.end());
+            m_numEta = static_cast<int>((*std::max_element(eta.begin(),eta.end()) - m_etaMin)/m_cellSize) + 1;
+
+            // Counting sort of the points by cell
+            std::vector<int> cells(eta.size());
+            m_cellStart.assign(m_numEta*m_numPhi+1,0);
+            for (size_t iPoint = 0; iPoint < eta.size(); ++iPoint)
+            {
+                cells[iPoint] = cellEta(eta[iPoint])*m_numPhi + cellPhi(phi[iPoint]);
+                ++m_cellStart[cells[iPoint]+1];
+            }
+            for (size_t iCell = 1; iCell < m_cellStart.size(); ++iCell)
+                m_cellStart[iCell] += m_cellStart[iCell-1];
+            std::vector<int> fill(m_cellStart.begin(),m_cellStart.end()-1);
+            m_cellEntries.resize(eta.size());
+            for (size_t iPoint = 0; iPoint < eta.size(); ++iPoint)
+                m_cellEntries[fill[cells[iPoint]]++] = iPoint;
+        }
+
+        // Call f(index,deltaR2) for every point within maxDeltaR of (eta,phi)
+        template <typename Function>
+        void forEachNear(const double eta, const double phi, const double maxDeltaR, Function f) const
+        {
+            if (!m_numEta)
+                return;
+            const int reachEta = static_cast<int>(std::ceil(maxDeltaR/m_cellSize));
+            const int reachPhi = static_cast<int>(std::ceil(maxDeltaR/m_cellPhi));
+            const int centreEta = static_cast<int>(std::floor((eta-m_etaMin)/m_cellSize));
+            const int centrePhi = cellPhi(phi);
+
+            // When the reach wraps around, every phi cell is searched once
+            const bool allPhi  = 2*reachPhi+1 >= m_numPhi;
+            const int firstPhi = allPhi ? 0 : centrePhi-reachPhi;
+            const int lastPhi  = allPhi ? m_numPhi-1 : centrePhi+reachPhi;
+            for (int iEta = std::max(0,centreEta-reachEta); iEta <= std::min(m_numEta-1,centreEta+reachEta); ++iEta)
+                for (int iPhi = firstPhi; iPhi <= lastPhi; ++iPhi)
+                {
+                    const int cell = iEta*m_numPhi + (iPhi%m_numPhi + m_numPhi)%m_numPhi;
+                    for (int iEntry = m_cellStart[cell]; iEntry < m_cellStart[cell+1]; ++iEntry)
+                    {
+                        const int index = m_cellEntries[iEntry];
+                        const double deltaR2 = deltaR2Of(eta,phi,(*m_eta)[index],(*m_phi)[index]);
+                        if (deltaR2 < maxDeltaR*maxDeltaR)
+                            f(index,deltaR2);
+                    }
+                }
+        }
+
+        static double deltaR2Of(const double eta1, const double phi1, const double eta2, const double phi2)
+        {
+            const double deltaEta = eta1-eta2;
+            double deltaPhi = std::fabs(phi1-phi2);
+            if (deltaPhi > M_PI)
+                deltaPhi = 2*M_PI - deltaPhi;
+            return deltaEta*deltaEta + deltaPhi*deltaPhi;
+        }
+
+    private:
+        int cellEta(const double eta) const { return std::min(m_numEta-1,static_cast<int>((eta-m_etaMin)/m_cellSize)); }
+        int cellPhi(double phi) const
+        {
+            phi = std::fmod(phi,2*M_PI);
+            if (phi < 0)
+                phi += 2*M_PI;
+            return std::min(m_numPhi-1,static_cast<int>(phi/m_cellPhi));
+        }
+
+        double m_cellSize;
+        int m_numPhi;
+        double m_cellPhi;
+        double m_etaMin;
+        int m_numEta;
+        const std::vector<double>* m_eta = nullptr;
+        const std::vector<double>* m_phi = nullptr;
+        std::vector<int> m_cellStart;
+        std::vector<int> m_cellEntries;
+};
+
+
+// Greedy matching: the truth jets are taken in the given order (usually decreasing pT), and each is
+// matched to the closest reconstructed jet within maxDeltaR which is not matched yet
+// Optimal matching: Hungarian algorithm on the truth jets and the reconstructed jets plus one
+// "unmatched" column per truth jet, with the pairs further apart than maxDeltaR excluded
+// Returns the index of the matched reconstructed jet for each truth jet, or -1
+enum MatchingMode { GreedyMatching, OptimalMatching };
+
+class JetMatcher
+{
+    public:
+        JetMatcher(const double maxDeltaR, const MatchingMode mode = GreedyMatching)
+            : m_maxDeltaR(maxDeltaR)
+            , m_mode(mode)
+            , m_grid(maxDeltaR)
+            , m_truthIsolationDR(0)
+            , m_recoIsolationDR(0)
+            , m_truthIsolationGrid(1)
+            , m_recoIsolationGrid(1)
+        { }
+
+        // Only match truth (reco) jets with no other truth (reco) jet within the given distance (0 = no requirement)
+        void setIsolation(const double truthIsolationDR, const double recoIsolationDR)
+        {
+            m_truthIsolationDR   = truthIsolationDR;
+            m_recoIsolationDR    = recoIsolationDR;
+            m_truthIsolationGrid = EtaPhiGrid(truthIsolationDR > 0 ? truthIsolationDR : 1);
+            m_recoIsolationGrid  = EtaPhiGrid(recoIsolationDR > 0 ? recoIsolationDR : 1);
+        }
+
+        const std::vector<int>& match(const std::vector<double>& truthEta, const std::vector<double>& truthPhi,
+                                      const std::vector<double>& recoEta,  const std::vector<double>& recoPhi)
+        {
+            findIsolated(m_truthIsolationGrid,m_truthIsolationDR,truthEta,truthPhi,m_truthIsolated);
+            findIsolated(m_recoIsolationGrid,m_recoIsolationDR,recoEta,recoPhi,m_recoIsolated);
+            m_grid.fill(recoEta,recoPhi);
+            m_matches.assign(truthEta.size(),-1);
+            if (m_mode == OptimalMatching)
+                matchOptimal(truthEta,truthPhi,recoEta.size());
+            else
+                matchGreedy(truthEta,truthPhi,recoEta.size());
+            return m_matches;
+        }
+
+    private:
+        static void findIsolated(EtaPhiGrid& grid, const double isolationDR, const std::vector<double>& eta, const std::vector<double>& phi, std::vector<char>& isolated)
+        {
+            isolated.assign(eta.size(),true);
+            if (isolationDR <= 0)
+                return;
+            grid.fill(eta,phi);
+            for (size_t iJet = 0; iJet < eta.size(); ++iJet)
+                grid.forEachNear(eta[iJet],phi[iJet],isolationDR,[&](const int index, const double)
+                {
+                    if (index != static_cast<int>(iJet))
+                        isolated[iJet] = false;
+                });
+        }
+
+        void matchGreedy(const std::vector<double>& truthEta, const std::vector<double>& truthPhi, const size_t numReco)
+        {
+            m_used.assign(numReco,false);
+            for (size_t iTruth = 0; iTruth < truthEta.size(); ++iTruth)
+            {
+                if (!m_truthIsolated[iTruth])
+                    continue;
+                int best = -1;
+                double bestDeltaR2 = 0;
+                m_grid.forEachNear(truthEta[iTruth],truthPhi[iTruth],m_maxDeltaR,[&](const int index, const double deltaR2)
+                {
+                    if (!m_used[index] && m_recoIsolated[index] && (best < 0 || deltaR2 < bestDeltaR2))
+                    {
+                        best = index;
+                        bestDeltaR2 = deltaR2;
+                    }
+                });
+                if (best >= 0)
+                {
+                    m_used[best] = true;
+                    m_matches[iTruth] = best;
+                }
+            }
+        }
+
+        // Any cost above the one of an unmatched column can never be part of the optimal assignment,
+        // as a free unmatched column is always left for the row, so the excluded pairs cost just more
+        void matchOptimal(const std::vector<double>& truthEta, const std::vector<double>& truthPhi, const size_t numReco)
+        {
+            const int numRows = truthEta.size();
+            const int numCols = numReco + numRows;
+            if (!numRows)
+                return;
+            const double unmatchedCost = m_maxDeltaR*m_maxDeltaR;
+            const double excludedCost  = unmatchedCost+1;
+            m_cost.assign(numRows*numCols,excludedCost);
+            for (int iTruth = 0; iTruth < numRows; ++iTruth)
+            {
+                std::fill(m_cost.begin()+iTruth*numCols+numReco,m_cost.begin()+(iTruth+1)*numCols,unmatchedCost);
+                if (m_truthIsolated[iTruth])
+                    m_grid.forEachNear(truthEta[iTruth],truthPhi[iTruth],m_maxDeltaR,[&](const int index, const double deltaR2)
+                    {
+                        if (m_recoIsolated[index])
+                            m_cost[iTruth*numCols+index] = deltaR2;
+                    });
+            }
+
+            // Shortest augmenting paths with row and column potentials, rows and columns numbered from 1
+            m_rowPotential.assign(numRows+1,0.);
+            m_colPotential.assign(numCols+1,0.);
+            m_colRow.assign(numCols+1,0);
+            m_colWay.assign(numCols+1,0);
+            for (int iRow = 1; iRow <= numRows; ++iRow)
+            {
+                m_colRow[0] = iRow;
+                int col = 0;
+                m_minReduced.assign(numCols+1,std::numeric_limits<double>::max());
+                m_colUsed.assign(numCols+1,false);
+                do
+                {
+                    m_colUsed[col] = true;
+                    const int row = m_colRow[col];
+                    double delta = std::numeric_limits<double>::max();
+                    int nextCol = 0;
+                    for (int iCol = 1; iCol <= numCols; ++iCol)
+                        if (!m_colUsed[iCol])
+                        {
+                            const double reduced = m_cost[(row-1)*numCols+iCol-1] - m_rowPotential[row] - m_colPotential[iCol];
+                            if (reduced < m_minReduced[iCol])
+                            {
+                                m_minReduced[iCol] = reduced;
+                                m_colWay[iCol] = col;
+                            }
+                            if (m_minReduced[iCol] < delta)
+                            {
+                                delta = m_minReduced[iCol];
+                                nextCol = iCol;
+                            }
+                        }
+                    for (int iCol = 0; iCol <= numCols; ++iCol)
+                        if (m_colUsed[iCol])
+                        {
+                            m_rowPotential[m_colRow[iCol]] += delta;
+                            m_colPotential[iCol] -= delta;
+                        }
+                        else
+                            m_minReduced[iCol] -= delta;
+                    col = nextCol;
+                } while (m_colRow[col]);
+                do
+                {
+                    const int prevCol = m_colWay[col];
+                    m_colRow[col] = m_colRow[prevCol];
+                    col = prevCol;
+                } while (col);
+            }
+
+            for (int iCol = 1; iCol <= static_cast<int>(numReco); ++iCol)
+                if (m_colRow[iCol] && m_cost[(m_colRow[iCol]-1)*numCols+iCol-1] < unmatchedCost)
+                    m_matches[m_colRow[iCol]-1] = iCol-1;
+        }
+
+        double m_maxDeltaR;
+        MatchingMode m_mode;
+        EtaPhiGrid m_grid;
+        double m_truthIsolationDR;
+        double m_recoIsolationDR;
+        EtaPhiGrid m_truthIsolationGrid;
+        EtaPhiGrid m_recoIsolationGrid;
+        std::vector<char> m_truthIsolated;
+        std::vector<char> m_recoIsolated;
+        std::vector<bool> m_used;
+        std::vector<int> m_matches;
+
+        // Work arrays of the optimal assignment
+        std::vector<double> m_cost;
+        std::vector<double> m_rowPotential;
+        std::vector<double> m_colPotential;
+        std::vector<double> m_minReduced;
+        std::vector<int> m_colRow;
+        std::vector<int> m_colWay;
+        std::vector<bool> m_colUsed;
+};
+
+#endif
@@ -0,0 +1,87 @@
+////////////////////////////////////////
+// Primary Lund-plane declustering
+////////////////////////////////////////
+
+// Lund-plane coordinates of the primary declusterings of a jet: the jet is reclustered with the
+// Cambridge/Aachen algorithm, and the clustering history is followed back from the jet along the
+// harder branch.  Each step gives an emission at (ln 1/DeltaR, ln kt), with kt = pT(softer)*DeltaR
+// converted from MeV to GeV.  The walk only reads the history and jets of the cluster sequence, so
+// no PseudoJets are created per step, and the emissions are stored in a buffer reused for every jet.
+// Jets which already come from a C/A clustering with the E-scheme, such as the output of the
+// SoftDrop groomers, are declustered directly from their own cluster sequence without reclustering.
+
+#ifndef LUNDPLANE_H
+#define LUNDPLANE_H
+
+#include <vector>
+#include <cmath>
+
+#include "fastjet/ClusterSequence.hh"
+
+
+struct LundEmission
+{
+    double lnInvDeltaR;
+    double lnKt;
+};
+
+class LundPlane
+{
+    public:
+        LundPlane()
+            : m_caDef(fastjet::cambridge_algorithm,fastjet::JetDefinition::max_allowable_R)
+            , m_numReclustered(0)
+            , m_numReused(0)
+        { }
+
+        // Primary emissions of the jet, from the first (widest) declustering inwards
+        const std::vector<LundEmission>& operator()(const fastjet::PseudoJet& jet)
+        {
+            m_emissions.clear();
+            if (jet.has_valid_cluster_sequence() && jet.validated_cs()->jet_def().jet_algorithm() == fastjet::cambridge_algorithm
+                    && jet.validated_cs()->jet_def().recombination_scheme() == fastjet::E_scheme)
+            {
+                ++m_numReused;
+                walk(*jet.validated_cs(),jet.cluster_hist_index());
+            }
+            else if (jet.has_constituents())
+            {
+                ++m_numReclustered;
+                fastjet::ClusterSequence cs(jet.constituents(),m_caDef);
+                const std::vector<fastjet::PseudoJet> jets = cs.inclusive_jets();
+                if (jets.size() == 1)
+                    walk(cs,jets.front().cluster_hist_index());
+            }
+            return m_emissions;
+        }
+
+        long long numReclustered() const { return m_numReclustered; }
+        long long numReused() const { return m_numReused; }
+
+    private:
+        void walk(const fastjet::ClusterSequence& cs, int histIndex)
+        {
+            const std::vector<fastjet::ClusterSequence::history_element>& history = cs.history();
+            const std::vector<fastjet::PseudoJet>& jets = cs.jets();
+            while (history.at(histIndex).parent1 >= 0 && history.at(histIndex).parent2 >= 0)
+            {
+                const int parent1 = history.at(histIndex).parent1;
+                const int parent2 = history.at(histIndex).parent2;
+                const fastjet::PseudoJet& jet1 = jets.at(history.at(parent1).jetp_index);
+                const fastjet::PseudoJet& jet2 = jets.at(history.at(parent2).jetp_index);
+                const bool firstHarder = jet1.pt2() >= jet2.pt2();
+                const double deltaR = jet1.delta_R(jet2);
+                const double kt = (firstHarder ? jet2.pt() : jet1.pt())*deltaR;
+                if (deltaR > 0 && kt > 0)
+                    m_emissions.push_back(LundEmission{std::log(1/deltaR),std::log(kt/1.e3)});
+                histIndex = firstHarder ? parent1 : parent2;
+            }
+        }
+
+        fastjet::JetDefinition m_caDef;
+        std::vector<LundEmission> m_emissions;
+        long long m_numReclustered;
+        long long m_numReused;
+};
+
+#endif
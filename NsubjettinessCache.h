@@ -0,0 +1,174 @@
+////////////////////////////////////////
+// Cached N-subjettiness axes
+////////////////////////////////////////
+
+// N-subjettiness with one-pass WTA kt axes, with the exclusive-axis hierarchy computed once per
+// constituent set:
+//  - a single WTA kt clustering provides the seed axes for every N = 1..maxN
+//  - groomed versions of the reference jet reuse the reference seed axes when their
+//    constituents are a subset of the reference constituents (matched by user_index)
+// The reuse is guarded: the groomed jet may only have lost up to a given fraction of the
+// reference scalar pT, and every reused WTA axis must still point along one of its
+// constituents.  Otherwise the hierarchy is recomputed from the groomed constituents.
+// The one-pass minimisation always starts from the chosen seeds, using OnePass_Manual_Axes.
+// For the reference jet, and for jets whose hierarchy is recomputed, the seeds are the WTA kt
+// exclusive axes and the result matches
+//     fastjet::contrib::Nsubjettiness(N,OnePass_WTA_KT_Axes(),UnnormalizedMeasure(beta))
+// For a groomed jet reusing the reference seeds the minimisation starts from different axes than
+// OnePass_WTA_KT_Axes would use on its constituents, so tau_N can differ from the contrib value.
+// lastReused() tells whether the last jet reused the reference seeds, so that those jets can be
+// cross-checked against fastjet::contrib.
+
+#ifndef NSUBJETTINESSCACHE_H
+#define NSUBJETTINESSCACHE_H
+
+#include <vector>
+
+#include "fastjet/ClusterSequence.hh"
+#include "fastjet/contrib/Nsubjettiness.hh"
+
+
+class NsubjettinessCache
+{
+    public:
+        NsubjettinessCache(const int maxN, const double beta, const double maxRemovedPtFraction)
+            : m_maxN(maxN)
+            , m_maxRemovedPtFraction(maxRemovedPtFraction)
+            , m_wtaDef(fastjet::kt_algorithm,fastjet::JetDefinition::max_allowable_R,fastjet::WTA_pt_scheme)
+            , m_referencePt(0)
+            , m_taus(maxN,0.)
+            , m_numReused(0)
+            , m_numRecomputed(0)
+            , m_lastReused(false)
+        {
+            for (int N = 1; N <= m_maxN; ++N)
+                m_tau.push_back(fastjet::contrib::Nsubjettiness(N,fastjet::contrib::OnePass_Manual_Axes(),fastjet::contrib::UnnormalizedMeasure(beta)));
+        }
+
+        // Build the axis hierarchy of the reference (usually ungroomed) jet
+        void setReference(const fastjet::PseudoJet& jet)
+        {
+            const std::vector<fastjet::PseudoJet> constituents = jet.constituents();
+            computeAxes(constituents,m_referenceAxes,m_referenceAxisIndices);
+
+            m_referencePt = 0;
+            m_inReference.clear();
+            for (const fastjet::PseudoJet& constituent : constituents)
+            {
+                m_referencePt += constituent.pt();
+                if (constituent.user_index() < 0)
+                    continue;
+                if (static_cast<size_t>(constituent.user_index()) >= m_inReference.size())
+                    m_inReference.resize(constituent.user_index()+1,false);
+                m_inReference[constituent.user_index()] = true;
+            }
+        }
+
+        // tau_N for N = 1..maxN (at index N-1) of the reference jet or any jet derived from it
+        const std::vector<double>& operator()(const fastjet::PseudoJet& jet)
+        {
+            const std::vector<fastjet::PseudoJet> constituents = jet.constituents();
+
+            const std::vector< std::vector<fastjet::PseudoJet> >* axes = &m_referenceAxes;
+            m_lastReused = canReuseReference(constituents);
+            if (!m_lastReused)
+            {
+                std::vector< std::vector<int> > axisIndices;
+                computeAxes(constituents,m_axes,axisIndices);
+                axes = &m_axes;
+                ++m_numRecomputed;
+            }
+            else
+                ++m_numReused;
+
+            for (int N = 1; N <= m_maxN; ++N)
+            {
+                // As many axes as particles (or more) means every particle is its own subjet
+                if (constituents.size() <= static_cast<size_t>(N))
+                {
+                    m_taus.at(N-1) = 0;
+                    continue;
+                }
+                m_tau.at(N-1).setAxes(axes->at(N-1));
+                m_taus.at(N-1) = m_tau.at(N-1)(jet);
+            }
+            return m_taus;
+        }
+
+        long long numReused() const { return m_numReused; }
+        long long numRecomputed() const { return m_numRecomputed; }
+        bool lastReused() const { return m_lastReused; }
+
+    private:
+        // Exclusive WTA kt axes for every N from one clustering, together with the constituent
+        // that each axis points along
+        void computeAxes(const std::vector<fastjet::PseudoJet>& constituents, std::vector< std::vector<fastjet::PseudoJet> >& axes, std::vector< std::vector<int> >& axisIndices) const
+        {
+            axes.assign(m_maxN,std::vector<fastjet::PseudoJet>());
+            axisIndices.assign(m_maxN,std::vector<int>());
+            if (constituents.empty())
+                return;
+
+            fastjet::ClusterSequence cs(constituents,m_wtaDef);
+            for (int N = 1; N <= m_maxN; ++N)
+            {
+                if (constituents.size() <= static_cast<size_t>(N))
+                    axes.at(N-1) = constituents;
+                else
+                    axes.at(N-1) = cs.exclusive_jets(N);
+
+                for (const fastjet::PseudoJet& axis : axes.at(N-1))
+                {
+                    size_t closest = 0;
+                    for (size_t iConst = 1; iConst < constituents.size(); ++iConst)
+                        if (axis.squared_distance(constituents.at(iConst)) < axis.squared_distance(constituents.at(closest)))
+                            closest = iConst;
+                    axisIndices.at(N-1).push_back(constituents.at(closest).user_index());
+                }
+            }
+        }
+
+        // Accuracy guard for reusing the reference axes
+        bool canReuseReference(const std::vector<fastjet::PseudoJet>& constituents) const
+        {
+            if (m_referencePt <= 0)
+                return false;
+
+            std::vector<bool> present(m_inReference.size(),false);
+            double pt = 0;
+            for (const fastjet::PseudoJet& constituent : constituents)
+            {
+                const int index = constituent.user_index();
+                if (index < 0 || static_cast<size_t>(index) >= m_inReference.size() || !m_inReference[index])
+                    return false;
+                present[index] = true;
+                pt += constituent.pt();
+            }
+            if (1 - pt/m_referencePt > m_maxRemovedPtFraction)
+                return false;
+
+            for (const std::vector<int>& indices : m_referenceAxisIndices)
+                for (const int index : indices)
+                    if (index < 0 || !present[index])
+                        return false;
+            return true;
+        }
+
+        int m_maxN;
+        double m_maxRemovedPtFraction;
+        fastjet::JetDefinition m_wtaDef;
+        std::vector<fastjet::contrib::Nsubjettiness> m_tau;
+
+        double m_referencePt;
+        std::vector<bool> m_inReference;
+        std::vector< std::vector<fastjet::PseudoJet> > m_referenceAxes;
+        std::vector< std::vector<int> > m_referenceAxisIndices;
+
+        std::vector< std::vector<fastjet::PseudoJet> > m_axes;
+        std::vector<double> m_taus;
+        long long m_numReused;
+        long long m_numRecomputed;
+        bool m_lastReused;
+};
+
+#endif
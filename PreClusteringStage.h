@@ -0,0 +1,262 @@
+////////////////////////////////////////
+// Pre-clustering stages
+////////////////////////////////////////
+
+// Stages which act on the full list of event inputs (clusters or particles) before any jet
+// clustering takes place.  Each stage returns the modified list of inputs, and stages can be
+// chained in any order.  Inputs keep their user_index (the index in the input branches), except
+// for stages which build new inputs such as towers, which use their own unique indices.
+
+#ifndef PRECLUSTERINGSTAGE_H
+#define PRECLUSTERINGSTAGE_H
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "fastjet/PseudoJet.hh"
+#include "fastjet/contrib/SoftKiller.hh"
+#include "fastjet/tools/GridMedianBackgroundEstimator.hh"
+
+
+class PreClusteringStage
+{
+    public:
+        virtual ~PreClusteringStage() {}
+
+        // Short name, used when the chain of stages is printed
+        virtual std::string name() const = 0;
+
+        virtual std::vector<fastjet::PseudoJet> process(const std::vector<fastjet::PseudoJet>& inputs) = 0;
+};
+
+
+// SoftKiller: the inputs are binned in a rapidity-phi grid and the pT threshold is set per event
+// as the median over the grid patches of the hardest input in each patch, so that half of the
+// patches end up empty.  Inputs below the threshold are removed.
+class SoftKillerStage : public PreClusteringStage
+{
+    public:
+        SoftKillerStage(const double rapMax, const double tileSize)
+            : m_softKiller(rapMax,tileSize)
+            , m_threshold(0)
+        { }
+
+        std::string name() const { return "SoftKiller"; }
+
+        std::vector<fastjet::PseudoJet> process(const std::vector<fastjet::PseudoJet>& inputs)
+        {
+            std::vector<fastjet::PseudoJet> kept;
+            m_softKiller.apply(inputs,kept,m_threshold);
+            return kept;
+        }
+
+        // pT threshold used for the last event
+        double threshold() const { return m_threshold; }
+
+    private:
+        fastjet::contrib::SoftKiller m_softKiller;
+        double m_threshold;
+};
+
+
+// Event-wide constituent subtraction: massless ghosts on a regular rapidity-phi grid carry the
+// median pT density rho times their area, and every input within maxDeltaR of a ghost is paired
+// with it.  The pairs are processed from the closest to the furthest, each one transferring the
+// smaller of the two remaining pTs, so inputs lose the pT of the ghosts around them.  Corrected
+// inputs keep their direction and m/pT, and inputs whose pT is fully subtracted are removed.
+// Inputs further than maxDeltaR outside the ghost grid are left unchanged.
+// The ghosts are the cells of the grid, so the ghosts near an input are found directly from its
+// cell index and the number of pairs grows linearly with the number of inputs.
+class ConstituentSubtractionStage : public PreClusteringStage
+{
+    public:
+        ConstituentSubtractionStage(const double rapMax, const double ghostSize, const double maxDeltaR, const double rhoGridSize)
+            : m_rapMax(rapMax)
+            , m_maxDeltaR(maxDeltaR)
+            , m_numY(std::max(1,static_cast<int>(std::ceil(2*rapMax/ghostSize))))
+            , m_numPhi(std::max(1,static_cast<int>(std::ceil(2*M_PI/ghostSize))))
+            , m_ghostY(2*rapMax/m_numY)
+            , m_ghostPhi(2*M_PI/m_numPhi)
+            , m_rhoEstimator(rapMax,rhoGridSize)
+            , m_rho(0)
+        { }
+
+        std::string name() const { return "ConstSub"; }
+
+        std::vector<fastjet::PseudoJet> process(const std::vector<fastjet::PseudoJet>& inputs)
+        {
+            m_rhoEstimator.set_particles(inputs);
+            m_rho = m_rhoEstimator.rho();
+            if (m_rho <= 0)
+                return inputs;
+
+            // Pair every input with the ghosts within maxDeltaR, looking only at nearby grid cells
+            const int reachY   = static_cast<int>(std::ceil(m_maxDeltaR/m_ghostY));
+            const int reachPhi = std::min(static_cast<int>(std::ceil(m_maxDeltaR/m_ghostPhi)),(m_numPhi-1)/2);
+            m_pairs.clear();
+            for (size_t iInput = 0; iInput < inputs.size(); ++iInput)
+            {
+                const double y   = inputs.at(iInput).rap();
+                const double phi = inputs.at(iInput).phi();
+                const int cellY   = static_cast<int>(std::floor((y+m_rapMax)/m_ghostY));
+                const int cellPhi = static_cast<int>(std::floor(phi/m_ghostPhi));
+                for (int iY = std::max(0,cellY-reachY); iY <= std::min(m_numY-1,cellY+reachY); ++iY)
+                {
+                    const double deltaY = y - (-m_rapMax + (iY+0.5)*m_ghostY);
+                    for (int iPhi = cellPhi-reachPhi; iPhi <= cellPhi+reachPhi; ++iPhi)
+                    {
+                        const int ghostPhi = (iPhi%m_numPhi + m_numPhi)%m_numPhi;
+                        double deltaPhi = std::fabs(phi - (ghostPhi+0.5)*m_ghostPhi);
+                        if (deltaPhi > M_PI)
+                            deltaPhi = 2*M_PI - deltaPhi;
+                        const double deltaR2 = deltaY*deltaY + deltaPhi*deltaPhi;
+                        if (deltaR2 < m_maxDeltaR*m_maxDeltaR)
+                            m_pairs.push_back(GhostPair{deltaR2,static_cast<int>(iInput),iY*m_numPhi+ghostPhi});
+                    }
+                }
+            }
+            std::sort(m_pairs.begin(),m_pairs.end(),[](const GhostPair& a, const GhostPair& b) { return a.deltaR2 < b.deltaR2; });
+
+            // Transfer pT between the closest pairs first
+            std::vector<double> inputPt(inputs.size());
+            for (size_t iInput = 0; iInput < inputs.size(); ++iInput)
+                inputPt.at(iInput) = inputs.at(iInput).pt();
+            m_ghostPt.assign(m_numY*m_numPhi,m_rho*m_ghostY*m_ghostPhi);
+            for (const GhostPair& pair : m_pairs)
+            {
+                double& particle = inputPt[pair.input];
+                double& ghost    = m_ghostPt[pair.ghost];
+                if (particle <= 0 || ghost <= 0)
+                    continue;
+                const double transfer = std::min(particle,ghost);
+                particle -= transfer;
+                ghost    -= transfer;
+            }
+
+            std::vector<fastjet::PseudoJet> corrected;
+            corrected.reserve(inputs.size());
+            for (size_t iInput = 0; iInput < inputs.size(); ++iInput)
+            {
+                if (inputPt.at(iInput) <= 0)
+                    continue;
+                corrected.push_back(inputs.at(iInput));
+                corrected.back() *= inputPt.at(iInput)/inputs.at(iInput).pt();
+                corrected.back().set_user_index(inputs.at(iInput).user_index());
+            }
+            return corrected;
+        }
+
+        // Median pT density used for the last event
+        double rho() const { return m_rho; }
+
+    private:
+        struct GhostPair
+        {
+            double deltaR2;
+            int input;
+            int ghost;
+        };
+
+        double m_rapMax;
+        double m_maxDeltaR;
+        int m_numY;
+        int m_numPhi;
+        double m_ghostY;
+        double m_ghostPhi;
+        fastjet::GridMedianBackgroundEstimator m_rhoEstimator;
+        double m_rho;
+        std::vector<GhostPair> m_pairs;
+        std::vector<double> m_ghostPt;
+};
+
+
+// Projection of the inputs onto a fixed eta-phi tower grid, bounding the number of inputs to the
+// number of towers.  Each tower is massless, with the summed pT of its inputs at the centre of the
+// tower, and its user_index is the tower index.  Inputs outside the grid go to the edge towers.
+// The tower indices are first computed for all inputs in one loop over flat arrays, which the
+// compiler can vectorise, before the pTs are accumulated.
+class TowerProjectionStage : public PreClusteringStage
+{
+    public:
+        TowerProjectionStage(const double etaMax, const double towerSize)
+            : m_etaMax(etaMax)
+            , m_numEta(std::max(1,static_cast<int>(std::ceil(2*etaMax/towerSize))))
+            , m_numPhi(std::max(1,static_cast<int>(std::ceil(2*M_PI/towerSize))))
+            , m_towerEta(2*etaMax/m_numEta)
+            , m_towerPhi(2*M_PI/m_numPhi)
+            , m_towerPt(m_numEta*m_numPhi,0.)
+        { }
+
+        std::string name() const { return "Towers"; }
+
+        std::vector<fastjet::PseudoJet> process(const std::vector<fastjet::PseudoJet>& inputs)
+        {
+            const size_t numInputs = inputs.size();
+            m_pt.resize(numInputs);
+            m_eta.resize(numInputs);
+            m_phi.resize(numInputs);
+            m_tower.resize(numInputs);
+            for (size_t iInput = 0; iInput < numInputs; ++iInput)
+            {
+                m_pt[iInput]  = inputs[iInput].pt();
+                m_eta[iInput] = m_pt[iInput] > 0 ? inputs[iInput].eta() : 0;
+                m_phi[iInput] = inputs[iInput].phi();
+            }
+
+            const double etaMax  = m_etaMax;
+            const double invEta  = 1/m_towerEta;
+            const double invPhi  = 1/m_towerPhi;
+            const double lastEta = m_numEta-1;
+            const double lastPhi = m_numPhi-1;
+            const int numPhi     = m_numPhi;
+            const double* eta    = m_eta.data();
+            const double* phi    = m_phi.data();
+            int* tower           = m_tower.data();
+            for (size_t iInput = 0; iInput < numInputs; ++iInput)
+            {
+                const double cellEta = std::min(std::max((eta[iInput]+etaMax)*invEta,0.),lastEta);
+                const double cellPhi = std::min(std::max(phi[iInput]*invPhi,0.),lastPhi);
+                tower[iInput] = static_cast<int>(cellEta)*numPhi + static_cast<int>(cellPhi);
+            }
+
+            m_filled.clear();
+            for (size_t iInput = 0; iInput < numInputs; ++iInput)
+            {
+                if (m_pt[iInput] <= 0)
+                    continue;
+                if (m_towerPt[tower[iInput]] == 0)
+                    m_filled.push_back(tower[iInput]);
+                m_towerPt[tower[iInput]] += m_pt[iInput];
+            }
+
+            std::sort(m_filled.begin(),m_filled.end());
+            std::vector<fastjet::PseudoJet> towers;
+            towers.reserve(m_filled.size());
+            for (const int index : m_filled)
+            {
+                fastjet::PseudoJet towerJet;
+                towerJet.reset_PtYPhiM(m_towerPt[index],-m_etaMax+(index/m_numPhi+0.5)*m_towerEta,(index%m_numPhi+0.5)*m_towerPhi);
+                towerJet.set_user_index(index);
+                towers.push_back(towerJet);
+                m_towerPt[index] = 0;
+            }
+            return towers;
+        }
+
+    private:
+        double m_etaMax;
+        int m_numEta;
+        int m_numPhi;
+        double m_towerEta;
+        double m_towerPhi;
+        std::vector<double> m_towerPt;
+        std::vector<double> m_pt;
+        std::vector<double> m_eta;
+        std::vector<double> m_phi;
+        std::vector<int> m_tower;
+        std::vector<int> m_filled;
+};
+
+#endif
@@ -0,0 +1,68 @@
+////////////////////////////////////////
+// Command-line options of the programs
+////////////////////////////////////////
+
+// Parsing shared by jetRecoExp and jetRecoGroom: the name=value settings given after the required
+// arguments, and the comma-separated lists of names or numbers used as values of some of them.
+
+#ifndef PROGRAMOPTIONS_H
+#define PROGRAMOPTIONS_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+
+// Optional settings are given as name=value after the required arguments
+// Only names which already have a default value in the map are accepted
+inline bool parseOptions(const int argc, char* argv[], const int firstOption, std::map<std::string,std::string>& options)
+{
+    for (int iArg = firstOption; iArg < argc; ++iArg)
+    {
+        const std::string arg = argv[iArg];
+        const size_t split = arg.find('=');
+        if (split == std::string::npos || !options.count(arg.substr(0,split)))
+        {
+            printf("Invalid option: %s\n",arg.c_str());
+            return false;
+        }
+        options[arg.substr(0,split)] = arg.substr(split+1);
+    }
+    return true;
+}
+
+// Comma-separated list of names, such as softkiller,towers
+inline std::vector<std::string> splitList(const std::string& list)
+{
+    std::vector<std::string> entries;
+    size_t start = 0;
+    while (start < list.size())
+    {
+        const size_t end = std::min(list.find(',',start),list.size());
+        entries.push_back(list.substr(start,end-start));
+        start = end+1;
+    }
+    return entries;
+}
+
+// Comma-separated list of numbers, such as 0.5,1,2
+inline bool parseList(const std::string& list, std::vector<double>& values)
+{
+    values.clear();
+    for (const std::string& entry : splitList(list))
+    {
+        char* parsed = nullptr;
+        values.push_back(strtod(entry.c_str(),&parsed));
+        if (entry.empty() || *parsed != '\0')
+        {
+            printf("Invalid list entry: %s\n",entry.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,300 @@
+////////////////////////////////////////
+// Streaming statistics of weighted values
+////////////////////////////////////////
+
+// Accumulators which summarise a stream of weighted values in one pass and with bounded memory, and
+// which can be merged, so that copies filled by different threads or on different input files give
+// the same summary as one pass over all the values (up to the approximation of the quantiles).
+//
+// WelfordAccumulator keeps the sum of weights, mean and sum of squared deviations with West's weighted
+// version of Welford's update, which does not lose precision when the mean is large compared to the
+// spread.  TDigest is a merging t-digest: the values are kept as centroids (mean and weight), and
+// neighbouring centroids are merged as long as the quantile range they cover stays within the limit
+// set by the arcsine scale function, which keeps the tails finer than the centre.  The number of
+// centroids stays below about the compression parameter.
+//
+// Unlike a histogram, which keeps entries with zero or negative weights, the accumulators skip them
+// (and TDigest also skips NaN values): a weight which is not positive has no place in a quantile.
+// StreamingStats counts the skipped entries and their summed weight, so that they can be reported.
+//
+// The state of the accumulators (the sums and the centroids) can be read out and used to build them
+// again, so that it can be written to a file and the results of several files merged afterwards.
+
+#ifndef STREAMINGSTATS_H
+#define STREAMINGSTATS_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+
+// Weighted mean and variance
+class WelfordAccumulator
+{
+    public:
+        WelfordAccumulator()
+            : m_sumw(0)
+            , m_sumw2(0)
+            , m_mean(0)
+            , m_sumDev2(0)
+        { }
+
+        // Accumulator with the given state, e.g. read back from a file
+        WelfordAccumulator(const double sumw, const double sumw2, const double mean, const double sumDev2)
+            : m_sumw(sumw)
+            , m_sumw2(sumw2)
+            , m_mean(mean)
+            , m_sumDev2(sumDev2)
+        { }
+
+        // Entries with a weight which is not positive are skipped
+        void add(const double x, const double w = 1)
+        {
+            if (!(w > 0))
+                return;
+            m_sumw  += w;
+            m_sumw2 += w*w;
+            const double delta = x - m_mean;
+            m_mean    += delta*w/m_sumw;
+            m_sumDev2 += w*delta*(x - m_mean);
+        }
+
+        void merge(const WelfordAccumulator& other)
+        {
+            if (!other.m_sumw)
+                return;
+            const double sumw  = m_sumw + other.m_sumw;
+            const double delta = other.m_mean - m_mean;
+            m_mean    += delta*other.m_sumw/sumw;
+            m_sumDev2 += other.m_sumDev2 + delta*delta*m_sumw*other.m_sumw/sumw;
+            m_sumw     = sumw;
+            m_sumw2   += other.m_sumw2;
+        }
+
+        double sumOfWeights() const { return m_sumw; }
+        double sumOfSquaredWeights() const { return m_sumw2; }
+        double sumOfSquaredDeviations() const { return m_sumDev2; }
+        double effectiveEntries() const { return m_sumw2 ? m_sumw*m_sumw/m_sumw2 : 0; }
+        double mean() const { return m_mean; }
+        double variance() const { return m_sumw ? m_sumDev2/m_sumw : 0; }
+        double rms() const { return std::sqrt(variance()); }
+        double meanError() const { return effectiveEntries() ? rms()/std::sqrt(effectiveEntries()) : 0; }
+
+    private:
+        double m_sumw;
+        double m_sumw2;
+        double m_mean;
+        double m_sumDev2;
+};
+
+
+// Approximate quantiles of weighted values
+class TDigest
+{
+    public:
+        TDigest(const double compression = 100)
+            : m_compression(compression)
+            , m_sumw(0)
+            , m_min(std::numeric_limits<double>::max())
+            , m_max(std::numeric_limits<double>::lowest())
+        { }
+
+        // Digest with the given centroids and range of values, e.g. read back from a file
+        TDigest(const double compression, const std::vector<double>& means, const std::vector<double>& weights, const double min, const double max)
+            : m_compression(compression)
+            , m_sumw(0)
+            , m_min(min)
+            , m_max(max)
+        {
+            for (size_t iCentroid = 0; iCentroid < means.size() && iCentroid < weights.size(); ++iCentroid)
+                m_buffer.push_back(Centroid{means[iCentroid],weights[iCentroid]});
+            compress();
+        }
+
+        // Entries with a weight which is not positive or a NaN value are skipped
+        void add(const double x, const double w = 1)
+        {
+            if (!(w > 0) || std::isnan(x))
+                return;
+            m_buffer.push_back(Centroid{x,w});
+            m_min = std::min(m_min,x);
+            m_max = std::max(m_max,x);
+            if (m_buffer.size() >= 5*m_compression)
+                compress();
+        }
+
+        void merge(const TDigest& other)
+        {
+            m_buffer.insert(m_buffer.end(),other.m_centroids.begin(),other.m_centroids.end());
+            m_buffer.insert(m_buffer.end(),other.m_buffer.begin(),other.m_buffer.end());
+            m_min = std::min(m_min,other.m_min);
+            m_max = std::max(m_max,other.m_max);
+            compress();
+        }
+
+        double sumOfWeights()
+        {
+            compress();
+            return m_sumw;
+        }
+
+        // Value below which the fraction q of the weight lies, interpolated linearly between the centres
+        // of the centroids and towards the minimum and maximum values at the ends (NaN if empty)
+        double quantile(const double q)
+        {
+            compress();
+            if (m_centroids.empty())
+                return std::numeric_limits<double>::quiet_NaN();
+            const double target = std::max(0.,std::min(1.,q))*m_sumw;
+            double position = 0;
+            double value    = m_min;
+            double cumulative = 0;
+            for (const Centroid& centroid : m_centroids)
+            {
+                const double centre = cumulative + centroid.weight/2;
+                if (target < centre)
+                    return value + (centre > position ? (target-position)/(centre-position) : 0)*(centroid.mean-value);
+                position   = centre;
+                value      = centroid.mean;
+                cumulative += centroid.weight;
+            }
+            return value + (m_sumw > position ? (target-position)/(m_sumw-position) : 0)*(m_max-value);
+        }
+
+        size_t numCentroids()
+        {
+            compress();
+            return m_centroids.size();
+        }
+
+        // Means and weights of the centroids, in increasing order of the means
+        void getCentroids(std::vector<double>& means, std::vector<double>& weights)
+        {
+            compress();
+            means.clear();
+            weights.clear();
+            for (const Centroid& centroid : m_centroids)
+            {
+                means.push_back(centroid.mean);
+                weights.push_back(centroid.weight);
+            }
+        }
+
+        double compression() const { return m_compression; }
+        double min() const { return m_min; }
+        double max() const { return m_max; }
+
+    private:
+        struct Centroid
+        {
+            double mean;
+            double weight;
+            bool operator<(const Centroid& other) const { return mean < other.mean; }
+        };
+
+        // Scale function k(q) = compression/(2 pi) asin(2q-1) and the quantile one unit of k further
+        double nextQuantileLimit(const double q) const
+        {
+            const double k = m_compression/(2*M_PI)*std::asin(std::max(-1.,std::min(1.,2*q-1))) + 1;
+            if (k >= m_compression/4)
+                return 1;
+            return (std::sin(2*M_PI*k/m_compression)+1)/2;
+        }
+
+        void compress()
+        {
+            if (m_buffer.empty())
+                return;
+            m_buffer.insert(m_buffer.end(),m_centroids.begin(),m_centroids.end());
+            std::sort(m_buffer.begin(),m_buffer.end());
+            m_sumw = 0;
+            for (const Centroid& centroid : m_buffer)
+                m_sumw += centroid.weight;
+
+            m_centroids.clear();
+            Centroid current = m_buffer.front();
+            double weightBefore = 0;
+            double weightLimit  = m_sumw*nextQuantileLimit(0);
+            for (size_t iValue = 1; iValue < m_buffer.size(); ++iValue)
+            {
+                const Centroid& next = m_buffer[iValue];
+                if (weightBefore + current.weight + next.weight <= weightLimit)
+                {
+                    current.weight += next.weight;
+                    current.mean   += (next.mean-current.mean)*next.weight/current.weight;
+                }
+                else
+                {
+                    m_centroids.push_back(current);
+                    weightBefore += current.weight;
+                    weightLimit   = m_sumw*nextQuantileLimit(weightBefore/m_sumw);
+                    current = next;
+                }
+            }
+            m_centroids.push_back(current);
+            m_buffer.clear();
+        }
+
+        double m_compression;
+        double m_sumw;
+        double m_min;
+        double m_max;
+        std::vector<Centroid> m_centroids;
+        std::vector<Centroid> m_buffer;
+};
+
+
+// Mean, variance and quantiles of one stream of weighted values
+class StreamingStats
+{
+    public:
+        StreamingStats(const double compression = 100)
+            : m_quantiles(compression)
+            , m_numSkipped(0)
+            , m_skippedWeight(0)
+        { }
+
+        // Statistics with the given accumulators and skipped entries, e.g. read back from a file
+        StreamingStats(const WelfordAccumulator& moments, const TDigest& quantiles, const long long numSkipped, const double skippedWeight)
+            : m_moments(moments)
+            , m_quantiles(quantiles)
+            , m_numSkipped(numSkipped)
+            , m_skippedWeight(skippedWeight)
+        { }
+
+        // Entries with a weight which is not positive or a NaN value are skipped and counted
+        void add(const double x, const double w = 1)
+        {
+            if (!(w > 0) || std::isnan(x))
+            {
+                ++m_numSkipped;
+                if (!std::isnan(w))
+                    m_skippedWeight += w;
+                return;
+            }
+            m_moments.add(x,w);
+            m_quantiles.add(x,w);
+        }
+
+        void merge(const StreamingStats& other)
+        {
+            m_moments.merge(other.m_moments);
+            m_quantiles.merge(other.m_quantiles);
+            m_numSkipped    += other.m_numSkipped;
+            m_skippedWeight += other.m_skippedWeight;
+        }
+
+        const WelfordAccumulator& moments() const { return m_moments; }
+        TDigest& quantiles() { return m_quantiles; }
+        long long numSkipped() const { return m_numSkipped; }
+        double skippedWeight() const { return m_skippedWeight; }
+
+    private:
+        WelfordAccumulator m_moments;
+        TDigest m_quantiles;
+        long long m_numSkipped;
+        double m_skippedWeight;
+};
+
+#endif
@@ -0,0 +1,255 @@
+////////////////////////////////////////
+// Truth-jet clustering cache
+////////////////////////////////////////
+
+// Truth particle jets do not depend on any reco-level setting, so the inclusive jets of every
+// event are stored on disk together with the indices of their constituents in the input branches
+// (the user_index of the clustered particles).  The file is memory-mapped when it is read back,
+// and the jets of an event are rebuilt directly from the mapped arrays.
+//
+// Groomers such as fastjet::Filter need the clustering history of a jet, so the jets above a pT
+// threshold (and always the leading jet) are reclustered together from their cached constituents
+// with the original jet definition.  As a jet only ever merges its own constituents, and each merge
+// depends only on the two objects merged, this gives exactly the same jets as clustering the whole
+// event.  The softer jets, which are only used for their kinematics, are joined from their
+// constituents without a clustering history.
+//
+// The cache file name is derived from a key, which should identify the input file (path, size and
+// modification time), the tree and the jet definition.  The full key is also stored in the file
+// and checked when it is opened.
+//
+// File layout, all in native byte order:
+//   Header                                     magic, version, sizes and key length
+//   char     key[keyLength]                    padded to a multiple of 8 bytes
+//   uint64_t firstJet[numEvents+1]             index of the first jet of each event
+//   CachedJet jets[numJets]                    four-momentum and range of constituent indices
+//   int32_t  indices[numIndices]               constituent indices of all jets
+
+#ifndef TRUTHJETCACHE_H
+#define TRUTHJETCACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fastjet/PseudoJet.hh"
+#include "fastjet/ClusterSequence.hh"
+
+
+class TruthJetCache
+{
+    public:
+        TruthJetCache(const std::string& directory, const std::string& key)
+            : m_key(key)
+            , m_fileName(directory+"/truthjets_"+hashName(key)+".bin")
+            , m_map(nullptr)
+            , m_mapSize(0)
+            , m_header(nullptr)
+            , m_firstJet(nullptr)
+            , m_jets(nullptr)
+            , m_indices(nullptr)
+        {
+            m_recordFirstJet.push_back(0);
+        }
+
+        ~TruthJetCache()
+        {
+            if (m_map)
+                munmap(m_map,m_mapSize);
+        }
+
+        const std::string& fileName() const { return m_fileName; }
+
+        // Map an existing cache file, returns false if there is none or it does not match the key
+        bool load()
+        {
+            const int fd = open(m_fileName.c_str(),O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat info;
+            if (fstat(fd,&info) || static_cast<size_t>(info.st_size) < sizeof(Header))
+            {
+                close(fd);
+                return false;
+            }
+            void* map = mmap(nullptr,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+            close(fd);
+            if (map == MAP_FAILED)
+                return false;
+
+            const Header* header = static_cast<const Header*>(map);
+            const size_t expected = sizeof(Header) + paddedKeySize(header->keyLength) + (header->numEvents+1)*sizeof(uint64_t)
+                                  + header->numJets*sizeof(CachedJet) + header->numIndices*sizeof(int32_t);
+            const char* key = static_cast<const char*>(map) + sizeof(Header);
+            if (memcmp(header->magic,s_magic,sizeof(header->magic)) || header->version != s_version
+                || static_cast<size_t>(info.st_size) != expected || m_key != std::string(key,header->keyLength))
+            {
+                munmap(map,info.st_size);
+                return false;
+            }
+
+            m_map       = map;
+            m_mapSize   = info.st_size;
+            m_header    = header;
+            m_firstJet  = reinterpret_cast<const uint64_t*>(key + paddedKeySize(header->keyLength));
+            m_jets      = reinterpret_cast<const CachedJet*>(m_firstJet + header->numEvents + 1);
+            m_indices   = reinterpret_cast<const int32_t*>(m_jets + header->numJets);
+            return true;
+        }
+
+        bool loaded() const { return m_header; }
+        long long numEvents() const { return m_header ? m_header->numEvents : 0; }
+
+        // Cached jets of an event, sorted by decreasing pT, rebuilt from the inputs of that event
+        // (which must have been created in the same order as when the cache was written).  The leading
+        // jet and the jets with at least reclusterPtMin are reclustered with jetDef in the sequence,
+        // which is reset when there are no jets.
+        std::vector<fastjet::PseudoJet> jets(const long long event, const std::vector<fastjet::PseudoJet>& inputs,
+                                             const fastjet::JetDefinition& jetDef, const double reclusterPtMin,
+                                             std::shared_ptr<fastjet::ClusterSequence>& sequence) const
+        {
+            std::vector<fastjet::PseudoJet> result;
+            sequence.reset();
+            if (!m_header || event < 0 || event >= numEvents() || m_firstJet[event+1] == m_firstJet[event])
+                return result;
+
+            // The jets are stored in decreasing pT order, so the reclustered ones come first
+            uint64_t endRecluster = m_firstJet[event]+1;
+            while (endRecluster < m_firstJet[event+1] && std::hypot(m_jets[endRecluster].px,m_jets[endRecluster].py) >= reclusterPtMin)
+                ++endRecluster;
+            std::vector<fastjet::PseudoJet> constituents;
+            for (uint64_t iJet = m_firstJet[event]; iJet < endRecluster; ++iJet)
+                appendConstituents(m_jets[iJet],inputs,constituents);
+            sequence.reset(new fastjet::ClusterSequence(constituents,jetDef));
+            result = fastjet::sorted_by_pt(sequence->inclusive_jets());
+
+            result.reserve(m_firstJet[event+1]-m_firstJet[event]);
+            for (uint64_t iJet = endRecluster; iJet < m_firstJet[event+1]; ++iJet)
+            {
+                constituents.clear();
+                appendConstituents(m_jets[iJet],inputs,constituents);
+                result.push_back(fastjet::join(constituents));
+            }
+            return result;
+        }
+
+        // Store the jets of the next event, to be written with save()
+        void record(const std::vector<fastjet::PseudoJet>& jets)
+        {
+            for (const fastjet::PseudoJet& jet : jets)
+            {
+                CachedJet cached = {jet.px(),jet.py(),jet.pz(),jet.E(),m_recordIndices.size(),0};
+                for (const fastjet::PseudoJet& constituent : jet.constituents())
+                    m_recordIndices.push_back(constituent.user_index());
+                cached.numIndices = m_recordIndices.size() - cached.firstIndex;
+                m_recordJets.push_back(cached);
+            }
+            m_recordFirstJet.push_back(m_recordJets.size());
+        }
+
+        long long numRecorded() const { return m_recordFirstJet.size()-1; }
+
+        // Write the recorded events, through a temporary file so that readers never see a partial cache
+        bool save() const
+        {
+            Header header;
+            memcpy(header.magic,s_magic,sizeof(header.magic));
+            header.version    = s_version;
+            header.numEvents  = numRecorded();
+            header.numJets    = m_recordJets.size();
+            header.numIndices = m_recordIndices.size();
+            header.keyLength  = m_key.size();
+
+            const std::string tmpName = m_fileName+".tmp";
+            FILE* file = fopen(tmpName.c_str(),"wb");
+            if (!file)
+                return false;
+            std::vector<char> key(paddedKeySize(m_key.size()),0);
+            memcpy(key.data(),m_key.data(),m_key.size());
+            bool ok = fwrite(&header,sizeof(Header),1,file) == 1;
+            ok = ok && fwrite(key.data(),1,key.size(),file) == key.size();
+            ok = ok && fwrite(m_recordFirstJet.data(),sizeof(uint64_t),m_recordFirstJet.size(),file) == m_recordFirstJet.size();
+            ok = ok && fwrite(m_recordJets.data(),sizeof(CachedJet),m_recordJets.size(),file) == m_recordJets.size();
+            ok = ok && fwrite(m_recordIndices.data(),sizeof(int32_t),m_recordIndices.size(),file) == m_recordIndices.size();
+            ok = !fclose(file) && ok;
+            if (!ok || rename(tmpName.c_str(),m_fileName.c_str()))
+            {
+                remove(tmpName.c_str());
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        struct Header
+        {
+            char magic[8];
+            uint64_t version;
+            uint64_t numEvents;
+            uint64_t numJets;
+            uint64_t numIndices;
+            uint64_t keyLength;
+        };
+
+        struct CachedJet
+        {
+            double px;
+            double py;
+            double pz;
+            double E;
+            uint64_t firstIndex;
+            uint64_t numIndices;
+        };
+
+        static size_t paddedKeySize(const size_t length) { return (length+7)/8*8; }
+
+        void appendConstituents(const CachedJet& jet, const std::vector<fastjet::PseudoJet>& inputs, std::vector<fastjet::PseudoJet>& constituents) const
+        {
+            for (uint64_t iIndex = jet.firstIndex; iIndex < jet.firstIndex+jet.numIndices; ++iIndex)
+                constituents.push_back(inputs.at(m_indices[iIndex]));
+        }
+
+        // 64-bit FNV-1a hash of the key, in hexadecimal
+        static std::string hashName(const std::string& key)
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for (const char c : key)
+            {
+                hash ^= static_cast<unsigned char>(c);
+                hash *= 1099511628211ULL;
+            }
+            char name[17];
+            snprintf(name,sizeof(name),"%016llx",static_cast<unsigned long long>(hash));
+            return name;
+        }
+
+        static constexpr const char* s_magic = "TJETCACH";
+        static constexpr uint64_t s_version  = 1;
+
+        std::string m_key;
+        std::string m_fileName;
+
+        // Memory-mapped cache which is read from
+        void* m_map;
+        size_t m_mapSize;
+        const Header* m_header;
+        const uint64_t* m_firstJet;
+        const CachedJet* m_jets;
+        const int32_t* m_indices;
+
+        // Events recorded to be saved
+        std::vector<uint64_t> m_recordFirstJet;
+        std::vector<CachedJet> m_recordJets;
+        std::vector<int32_t> m_recordIndices;
+};
+
+#endif
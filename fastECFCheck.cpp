@@ -0,0 +1,113 @@
+////////////////////////////////////////
+// Check of the FastECF.h energy correlators
+////////////////////////////////////////
+
+// Compile with (for example):
+// g++ -O2 fastECFCheck.cpp -o fastECFCheck `~/FastJet/fastjet-install/bin/fastjet-config --cxxflags --libs` -lEnergyCorrelator
+//
+// Builds random jets with 1 to 150 constituents, some of them across the phi = +-pi boundary, and
+// compares ECF1, ECF2 and ECF3 of FastECF, and D2, N2 and M2 of ECFScan, to fastjet::contrib for
+// several values of beta.  The kernels picked for the current CPU are the ones checked.  Returns 1
+// if any value differs by more than the relative tolerance.
+
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "fastjet/PseudoJet.hh"
+#include "fastjet/contrib/EnergyCorrelator.hh"
+#include "FastECF.h"
+
+int main (int argc, char* argv[])
+{
+    const int jetsPerSize = argc > 1 ? atoi(argv[1]) : 20;
+    if (jetsPerSize <= 0)
+    {
+        printf("USAGE: %s [number of jets per constituent multiplicity]\n",argv[0]);
+        return 1;
+    }
+
+    // Multiplicities around the vector widths and block sizes of the kernels, and typical jets
+    const std::vector<int> sizes = {1,2,3,4,5,7,8,9,12,16,17,31,33,64,100,150};
+    const std::vector<double> betas = {0.5,1.0,2.0};
+    const double tolerance = 1.e-6;
+
+    std::vector<FastECF> fastECFs;
+    std::vector<fastjet::contrib::EnergyCorrelator> ECF1s, ECF2s, ECF3s;
+    std::vector<fastjet::contrib::EnergyCorrelatorD2> D2s;
+    std::vector<fastjet::contrib::EnergyCorrelatorN2> N2s;
+    std::vector<fastjet::contrib::EnergyCorrelatorM2> M2s;
+    for (const double beta : betas)
+    {
+        fastECFs.push_back(FastECF(beta));
+        ECF1s.push_back(fastjet::contrib::EnergyCorrelator(1,beta,fastjet::contrib::EnergyCorrelator::pt_R));
+        ECF2s.push_back(fastjet::contrib::EnergyCorrelator(2,beta,fastjet::contrib::EnergyCorrelator::pt_R));
+        ECF3s.push_back(fastjet::contrib::EnergyCorrelator(3,beta,fastjet::contrib::EnergyCorrelator::pt_R));
+        D2s.push_back(fastjet::contrib::EnergyCorrelatorD2(beta,fastjet::contrib::EnergyCorrelator::pt_R));
+        N2s.push_back(fastjet::contrib::EnergyCorrelatorN2(beta,fastjet::contrib::EnergyCorrelator::pt_R));
+        M2s.push_back(fastjet::contrib::EnergyCorrelatorM2(beta,fastjet::contrib::EnergyCorrelator::pt_R));
+    }
+    ECFScan ecfScan(betas);
+    printf("Checking the %s ECF3 kernel and the %s ECFScan kernel against fastjet::contrib\n",fastECFs.front().isaName(),ecfScan.isaName());
+
+    // Largest relative difference of each value, over all jets and betas
+    const int numValues = 6;
+    const char* names[numValues] = {"ECF1","ECF2","ECF3","D2","N2","M2"};
+    double maxDiff[numValues] = {0};
+    long long numFailed[numValues] = {0};
+    auto check = [&](const int iValue, const double fast, const double contrib)
+    {
+        const double diff = contrib ? std::fabs(fast-contrib)/std::fabs(contrib) : std::fabs(fast);
+        maxDiff[iValue] = std::max(maxDiff[iValue],diff);
+        if (!(diff <= tolerance))
+            ++numFailed[iValue];
+    };
+
+    std::mt19937 random(1234);
+    std::exponential_distribution<double> softPt(1/5.);
+    std::normal_distribution<double> spread(0,0.3);
+    std::uniform_real_distribution<double> uniform(-1,1);
+    long long numJets = 0;
+    for (const int size : sizes)
+        for (int iJet = 0; iJet < jetsPerSize; ++iJet)
+        {
+            // Every other jet is centred on the phi = +-pi boundary
+            const double jetRap = 2*uniform(random);
+            const double jetPhi = iJet%2 ? M_PI : M_PI*uniform(random);
+            std::vector<fastjet::PseudoJet> constituents;
+            for (int iConst = 0; iConst < size; ++iConst)
+                constituents.push_back(fastjet::PtYPhiM(0.1+softPt(random),jetRap+spread(random),jetPhi+spread(random)));
+            const fastjet::PseudoJet jet = fastjet::join(constituents);
+            ++numJets;
+
+            const std::vector<ECFScanValues>& scan = ecfScan(jet);
+            for (size_t iBeta = 0; iBeta < betas.size(); ++iBeta)
+            {
+                const ECFValues ecfs = fastECFs[iBeta](jet);
+                check(0,ecfs.ecf1,ECF1s[iBeta](jet));
+                check(1,ecfs.ecf2,ECF2s[iBeta](jet));
+                check(2,ecfs.ecf3,ECF3s[iBeta](jet));
+
+                // The ratios are only defined from three constituents
+                if (size < 3)
+                    continue;
+                check(3,scan[iBeta].D2(),D2s[iBeta](jet));
+                check(4,scan[iBeta].N2(),N2s[iBeta](jet));
+                check(5,scan[iBeta].M2(),M2s[iBeta](jet));
+            }
+        }
+
+    bool passed = true;
+    printf("Largest relative differences for %lld jets and %zu values of beta (tolerance %.0e):\n",numJets,betas.size(),tolerance);
+    for (int iValue = 0; iValue < numValues; ++iValue)
+    {
+        printf("\t%-5s %9.2e, %lld values outside the tolerance %s\n",names[iValue],maxDiff[iValue],numFailed[iValue],numFailed[iValue] ? "FAILED" : "ok");
+        passed = passed && !numFailed[iValue];
+    }
+    printf("%s\n",passed ? "All checks passed" : "Some checks FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+////////////////////////////////////////
+// Microbenchmark of the FastHist.h histograms
+////////////////////////////////////////
+
+// Compile with (for example):
+// g++ -O2 fastHistBench.cpp -o fastHistBench `root-config --cflags --libs`
+//
+// Fills the same random values into ROOT histograms and into the FastHist.h histograms of the
+// types used by jetRecoExp and jetRecoGroom, one at a time and as arrays with FillN(), prints the
+// CPU time per fill, and checks that the converted ROOT objects have the same contents, errors and
+// statistics.
+
+
+#include <vector>
+#include <memory>
+
+#include "TFile.h"
+#include "TH1F.h"
+#include "TH2I.h"
+#include "TProfile2D.h"
+#include "TRandom3.h"
+#include "TStopwatch.h"
+#include "FastHist.h"
+
+// Largest relative difference between the contents, errors and statistics of two histograms
+double compare(const TH1& a, const TH1& b)
+{
+    double maxDiff = 0;
+    auto relDiff = [](const double x, const double y) { return x == y ? 0. : std::fabs(x-y)/std::max(std::fabs(x),std::fabs(y)); };
+    for (int iBin = 0; iBin < a.GetNcells(); ++iBin)
+    {
+        maxDiff = std::max(maxDiff,relDiff(a.GetBinContent(iBin),b.GetBinContent(iBin)));
+        maxDiff = std::max(maxDiff,relDiff(a.GetBinError(iBin),b.GetBinError(iBin)));
+    }
+    double statsA[TH1::kNstat];
+    double statsB[TH1::kNstat];
+    a.GetStats(statsA);
+    b.GetStats(statsB);
+    for (int iStat = 0; iStat < TH1::kNstat; ++iStat)
+        maxDiff = std::max(maxDiff,relDiff(statsA[iStat],statsB[iStat]));
+    return std::max(maxDiff,relDiff(a.GetEntries(),b.GetEntries()));
+}
+
+int main (int argc, char* argv[])
+{
+    const long long numFills = argc > 1 ? atoll(argv[1]) : 10000000;
+    if (numFills <= 0)
+    {
+        printf("USAGE: %s [number of fills]\n",argv[0]);
+        return 1;
+    }
+
+    // Values shaped like the event loop ones: jet pT, mu, NPV, multiplicity and event weight
+    TRandom3 random(1234);
+    std::vector<double> pt(numFills), mu(numFills), npv(numFills), njets(numFills), weight(numFills), ones(numFills,1.);
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+    {
+        pt[iFill]     = random.Exp(100.e3);
+        mu[iFill]     = random.Uniform(0,95);
+        npv[iFill]    = random.Poisson(mu[iFill]*0.6);
+        njets[iFill]  = random.Poisson(3+mu[iFill]*0.05);
+        weight[iFill] = random.Uniform(0.5,1.5);
+    }
+
+    // Write the converted histograms to a file that is thrown away, as the programs do
+    TFile* outFile = TFile::Open("fastHistBench.root","RECREATE");
+    TStopwatch timer;
+
+    // TH1F with weights
+    TH1F rootTH1F("Bench_TH1F","Weighted TH1F",199,10.e3,2000.e3);
+    FastHist1D<TH1F> fastTH1F("Bench_TH1F_fast","Weighted TH1F",199,10.e3,2000.e3);
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        rootTH1F.Fill(pt[iFill],weight[iFill]);
+    const double timeRootTH1F = timer.CpuTime();
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        fastTH1F.Fill(pt[iFill],weight[iFill]);
+    const double timeFastTH1F = timer.CpuTime();
+    FastHist1D<TH1F> arrayTH1F("Bench_TH1F_array","Weighted TH1F",199,10.e3,2000.e3);
+    timer.Start();
+    arrayTH1F.FillN(numFills,pt.data(),weight.data());
+    const double timeArrayTH1F = timer.CpuTime();
+
+    // TH2I without weights
+    TH2I rootTH2I("Bench_TH2I","Unweighted TH2I",90,0,90,60,0,60);
+    FastHist2D<TH2I> fastTH2I("Bench_TH2I_fast","Unweighted TH2I",90,0,90,60,0,60);
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        rootTH2I.Fill(mu[iFill],npv[iFill]);
+    const double timeRootTH2I = timer.CpuTime();
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        fastTH2I.Fill(mu[iFill],npv[iFill]);
+    const double timeFastTH2I = timer.CpuTime();
+    FastHist2D<TH2I> arrayTH2I("Bench_TH2I_array","Unweighted TH2I",90,0,90,60,0,60);
+    timer.Start();
+    arrayTH2I.FillN(numFills,mu.data(),npv.data(),ones.data());
+    const double timeArrayTH2I = timer.CpuTime();
+
+    // TProfile2D with weights
+    TProfile2D rootTProfile2D("Bench_TProfile2D","Weighted TProfile2D",90,0,90,60,0,60);
+    FastProfile2D<TProfile2D> fastTProfile2D("Bench_TProfile2D_fast","Weighted TProfile2D",90,0,90,60,0,60);
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        rootTProfile2D.Fill(mu[iFill],npv[iFill],njets[iFill],weight[iFill]);
+    const double timeRootTProfile2D = timer.CpuTime();
+    timer.Start();
+    for (long long iFill = 0; iFill < numFills; ++iFill)
+        fastTProfile2D.Fill(mu[iFill],npv[iFill],njets[iFill],weight[iFill]);
+    const double timeFastTProfile2D = timer.CpuTime();
+    FastProfile2D<TProfile2D> arrayTProfile2D("Bench_TProfile2D_array","Weighted TProfile2D",90,0,90,60,0,60);
+    timer.Start();
+    arrayTProfile2D.FillN(numFills,mu.data(),npv.data(),njets.data(),weight.data());
+    const double timeArrayTProfile2D = timer.CpuTime();
+
+    // Convert the fast histograms and read them back for the comparison
+    fastTH1F.Write();
+    fastTH2I.Write();
+    fastTProfile2D.Write();
+    arrayTH1F.Write();
+    arrayTH2I.Write();
+    arrayTProfile2D.Write();
+    const double diffTH1F       = compare(rootTH1F,*dynamic_cast<TH1*>(outFile->Get("Bench_TH1F_fast")));
+    const double diffTH2I       = compare(rootTH2I,*dynamic_cast<TH1*>(outFile->Get("Bench_TH2I_fast")));
+    const double diffTProfile2D = compare(rootTProfile2D,*dynamic_cast<TH1*>(outFile->Get("Bench_TProfile2D_fast")));
+    const double diffArrayTH1F       = compare(rootTH1F,*dynamic_cast<TH1*>(outFile->Get("Bench_TH1F_array")));
+    const double diffArrayTH2I       = compare(rootTH2I,*dynamic_cast<TH1*>(outFile->Get("Bench_TH2I_array")));
+    const double diffArrayTProfile2D = compare(rootTProfile2D,*dynamic_cast<TH1*>(outFile->Get("Bench_TProfile2D_array")));
+
+    printf("Time per fill for %lld fills, ROOT vs FastHist.h vs FastHist.h FillN() (maximum relative difference after conversion):\n",numFills);
+    printf("\tTH1F,       weighted:   %6.2f ns vs %6.2f ns (%.1e) vs %6.2f ns (%.1e)\n",1.e9*timeRootTH1F/numFills,      1.e9*timeFastTH1F/numFills,      diffTH1F,      1.e9*timeArrayTH1F/numFills,      diffArrayTH1F);
+    printf("\tTH2I,       unweighted: %6.2f ns vs %6.2f ns (%.1e) vs %6.2f ns (%.1e)\n",1.e9*timeRootTH2I/numFills,      1.e9*timeFastTH2I/numFills,      diffTH2I,      1.e9*timeArrayTH2I/numFills,      diffArrayTH2I);
+    printf("\tTProfile2D, weighted:   %6.2f ns vs %6.2f ns (%.1e) vs %6.2f ns (%.1e)\n",1.e9*timeRootTProfile2D/numFills,1.e9*timeFastTProfile2D/numFills,diffTProfile2D,1.e9*timeArrayTProfile2D/numFills,diffArrayTProfile2D);
+
+    outFile->Close();
+    return 0;
+}
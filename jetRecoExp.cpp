@@ -9,6 +9,11 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <array>
+#include <type_traits>
 
 #include "TFile.h"
 #include "TTree.h"
@@ -16,16 +21,89 @@
 #include "TH1F.h"
 #include "TH2I.h"
 #include "TH2F.h"
+#include "TH1D.h"
+#include "TProfile.h"
 #include "TProfile2D.h"
-#include "TLorentzVector.h"
 #include "TVector2.h"
+#include "TF1.h"
+#include "TString.h"
+#include "TStopwatch.h"
+#include "ProgramOptions.h"
+#include "HistRegistry.h"
+#include "EventColumns.h"
+#include "JetMatching.h"
+#include "StreamingStats.h"
+
+// Iterative Gaussian fit of the core of a response distribution: start from its mean and RMS, then fit
+// within 1.5 standard deviations of the previous result until the mean moves by less than 0.1% of the width
+// Returns false if the distribution has fewer than 20 effective entries or the fit fails
+bool fitResponseCore(TH1D& hist, double& mean, double& meanError, double& sigma, double& sigmaError)
+{
+    double sumw = 0, sumw2 = 0, sumwx = 0, sumwx2 = 0, maximum = 0;
+    for (int iBin = 1; iBin <= hist.GetNbinsX(); ++iBin)
+    {
+        const double x = hist.GetXaxis()->GetBinCenter(iBin);
+        const double w = hist.GetBinContent(iBin);
+        sumw    += w;
+        sumw2   += hist.GetBinError(iBin)*hist.GetBinError(iBin);
+        sumwx   += w*x;
+        sumwx2  += w*x*x;
+        maximum  = std::max(maximum,w);
+    }
+    if (sumw <= 0 || sumw*sumw < 20*sumw2)
+        return false;
+    mean  = sumwx/sumw;
+    sigma = std::sqrt(std::max(0.,sumwx2/sumw - mean*mean));
+    if (sigma <= 0)
+        return false;
+
+    TF1 gauss("responseCore","gaus",0,2);
+    for (int iFit = 0; iFit < 10; ++iFit)
+    {
+        gauss.SetParameters(maximum,mean,sigma);
+        gauss.SetRange(mean-1.5*sigma,mean+1.5*sigma);
+        const int status = hist.Fit(&gauss,"QN0R");
+        if (status != 0 || gauss.GetParameter(2) == 0)
+            return false;
+        const double previousMean = mean;
+        mean       = gauss.GetParameter(1);
+        meanError  = gauss.GetParError(1);
+        sigma      = std::fabs(gauss.GetParameter(2));
+        sigmaError = gauss.GetParError(2);
+        if (std::fabs(mean-previousMean) < 1.e-3*sigma)
+            return true;
+    }
+    return true;
+}
+
+// Linear interpolation in log(x) between points sorted in x, with the value of the nearest point outside their range
+double interpolateLogX(const std::vector< std::pair<double,double> >& points, const double x)
+{
+    if (x <= points.front().first)
+        return points.front().second;
+    if (x >= points.back().first)
+        return points.back().second;
+    const size_t iHigh = std::upper_bound(points.begin(),points.end(),std::make_pair(x,0.),
+                                          [](const std::pair<double,double>& a, const std::pair<double,double>& b) { return a.first < b.first; }) - points.begin();
+    const std::pair<double,double>& low  = points.at(iHigh-1);
+    const std::pair<double,double>& high = points.at(iHigh);
+    const double fraction = std::log(x/low.first)/std::log(high.first/low.first);
+    return low.second + fraction*(high.second-low.second);
+}
 
 int main (int argc, char* argv[])
 {
+    // Optional settings and their default values
+    std::map<std::string,std::string> options;
+    options["njetscan"] = "";       // Increasing jet pT thresholds of the step 3 and 4 multiplicity scan (empty = no scan)
+    options["match"]    = "greedy"; // Step 5 truth-reco and truth-track jet matching: greedy (by truth jet pT) or optimal (smallest sum of DR^2)
+    options["matchdr"]  = "0.3";    // Maximum distance between matched jets in step 5
+    options["matchiso"] = "0";      // Only match jets with no other jet of the same collection within this distance (0 = no requirement)
+
     // Check arguments
     if (argc < 5)
     {
-        printf("USAGE: %s <output file> <step number> <tree name> <input file>\n",argv[0]);
+        printf("USAGE: %s <output file> <step number> <tree name> <input file> [option=value ...]\n",argv[0]);
         printf("Valid step number options:\n");
         printf("\t0 = all steps\n");
         printf("\t1 = only step 1  (event-level information)\n");
@@ -33,6 +111,11 @@ int main (int argc, char* argv[])
         printf("\t3 = up to step 3 (pileup dependence)\n");
         printf("\t4 = up to step 4 (tracks and track jets)\n");
         printf("\t5 = up to step 5 (jet response studies)\n");
+        printf("Valid options (default value in brackets):\n");
+        printf("\tnjetscan=<pT1,pT2,...>  also fill the step 3 and 4 jet multiplicities above each of these increasing pT thresholds [%s]\n",options["njetscan"].c_str());
+        printf("\tmatch=greedy|optimal    truth-reco and truth-track jet matching used by the step 5 response histograms [%s]\n",options["match"].c_str());
+        printf("\tmatchdr=<R>             maximum distance between matched jets in step 5 [%s]\n",options["matchdr"].c_str());
+        printf("\tmatchiso=<R>            only match jets with no other jet of the same collection within this distance [%s]\n",options["matchiso"].c_str());
         return 1;
     }
 
@@ -46,6 +129,25 @@ int main (int argc, char* argv[])
         printf("Invalid step number: %d\n",stepNum);
         return 1;
     }
+    if (!parseOptions(argc,argv,5,options))
+        return 1;
+    std::vector<double> scanThresholds;
+    if (!parseList(options["njetscan"],scanThresholds))
+        return 1;
+    for (size_t iThreshold = 1; iThreshold < scanThresholds.size(); ++iThreshold)
+        if (scanThresholds.at(iThreshold) <= scanThresholds.at(iThreshold-1))
+        {
+            printf("The njetscan thresholds must be increasing: %s\n",options["njetscan"].c_str());
+            return 1;
+        }
+    if (options["match"] != "greedy" && options["match"] != "optimal")
+    {
+        printf("Invalid matching: %s\n",options["match"].c_str());
+        return 1;
+    }
+    const MatchingMode matchMode = options["match"] == "optimal" ? OptimalMatching : GreedyMatching;
+    const double matchDR         = atof(options["matchdr"].c_str());
+    const double matchIsolation  = atof(options["matchiso"].c_str());
 
     // Open the input file and get the tree
     TFile* inFile = TFile::Open(inFileName.c_str(),"READ");
@@ -142,56 +244,202 @@ int main (int argc, char* argv[])
     // Prepare the output file and histograms                 //
     ////////////////////////////////////////////////////////////
 
-    // Step 1: event-level information
+    // Per-event quantities computed in the event loop and read by the fill expressions below
+    std::vector<double> truthEta, truthPhi, recoEta, recoPhi, trackEta, trackPhi; // coordinates of all jets as double arrays
+    std::vector<int> recoMatches, trackMatches; // index of the matched cluster (track) jet of each truth jet, or -1
+    double DRtruth_reco  = -1; // negative if there is no leading truth or cluster jet
+    double DRtruth_track = -1; // negative if there is no leading truth or track jet
+    int recoJetOrigin    = -1; // 1 if the leading cluster jet is truth-matched, 0 if it is a pileup jet, negative otherwise
+
+    // Only the histograms of the enabled steps are booked, and each is filled by its expression
     TFile* outFile = TFile::Open(outFileName.c_str(),"RECREATE");
-    TH1I hist_mu("Step1_mu","#mu_{average}",90,0,90);
-    TH1I hist_npv("Step1_npv","NPV",60,0,60);
-    TH2I hist_mu_npv("Step1_mu_npv","Correlation between #mu_{average} and NPV",90,0,90,60,0,60);
+    HistRegistry histograms(stepNum);
+    typedef FastHist1D<TH1I> Hist1I;
+    typedef FastHist1D<TH1F> Hist1F;
+    typedef FastHist2D<TH2I> Hist2I;
+    typedef FastHist2D<TH2F> Hist2F;
+    typedef FastProfile1D<TProfile> Profile1D;
+    typedef FastProfile2D<TProfile2D> Profile2D;
+
+    // Step 1: event-level information
+    histograms.book<Hist1I>(1,[&](Hist1I& hist) { hist.Fill(mu_average); },"Step1_mu","#mu_{average}",90,0,90);
+    histograms.book<Hist1I>(1,[&](Hist1I& hist) { hist.Fill(NPV); },"Step1_npv","NPV",60,0,60);
+    histograms.book<Hist2I>(1,[&](Hist2I& hist) { hist.Fill(mu_average,NPV); },"Step1_mu_npv","Correlation between #mu_{average} and NPV",90,0,90,60,0,60);
 
     // Step 2: R=0.4 cluster and truth jets and the event weight
-    TH1F hist_reco_pt_nw("Step2_RecoJet_pt_noweight","Leading R=0.4 cluster jet p_{T}, no weights",199,10.e3,2000.e3);
-    TH1F hist_reco_pt("Step2_RecoJet_pt","Leading R=0.4 cluster jet p_{T}",199,10.e3,2000.e3);
-    
-    TH1F hist_truth_pt_nw("Step2_TruthJet_pt_noweight","Leading R=0.4 truth jet p_{T}",199,10.e3,2000.e3);
-    TH1F hist_truth_pt("Step2_TruthJet_pt","Leading R=0.4 truth jet p_{T}",199,10.e3,2000.e3);
+    histograms.book<Hist1F>(2,[&](Hist1F& hist) { if (RecoJet_pt->size()) hist.Fill(RecoJet_pt->at(0)); },
+                            "Step2_RecoJet_pt_noweight","Leading R=0.4 cluster jet p_{T}, no weights",199,10.e3,2000.e3);
+    histograms.book<Hist1F>(2,[&](Hist1F& hist) { if (RecoJet_pt->size()) hist.Fill(RecoJet_pt->at(0),EventWeight); },
+                            "Step2_RecoJet_pt","Leading R=0.4 cluster jet p_{T}",199,10.e3,2000.e3);
+    histograms.book<Hist1F>(2,[&](Hist1F& hist) { if (TruthJet_pt->size()) hist.Fill(TruthJet_pt->at(0)); },
+                            "Step2_TruthJet_pt_noweight","Leading R=0.4 truth jet p_{T}",199,10.e3,2000.e3);
+    histograms.book<Hist1F>(2,[&](Hist1F& hist) { if (TruthJet_pt->size()) hist.Fill(TruthJet_pt->at(0),EventWeight); },
+                            "Step2_TruthJet_pt","Leading R=0.4 truth jet p_{T}",199,10.e3,2000.e3);
+
+    // Steps 3 and 4: jet multiplicity above 20 GeV in three ranges of mu and vs mu and NPV, for events with at least one jet
+    // These histograms have no fill expression: they are filled in bulk for blocks of events in the event loop
+    auto bookMultiplicity = [&](const int step, const std::string& prefix, const std::string& jetType)
+    {
+        return std::array<Hist1F*,3>{{
+            histograms.book<Hist1F>(step,nullptr,(prefix+"_njets_lowmu").c_str(),("Number of "+jetType+" jets above 20 GeV, #mu_{average} < 30").c_str(),15,0,30),
+            histograms.book<Hist1F>(step,nullptr,(prefix+"_njets_midmu").c_str(),("Number of "+jetType+" jets above 20 GeV, 35 < #mu_{average} < 45").c_str(),15,0,30),
+            histograms.book<Hist1F>(step,nullptr,(prefix+"_njets_highmu").c_str(),("Number of "+jetType+" jets above 20 GeV, #mu_{average} > 50").c_str(),15,0,30)}};
+    };
+    auto bookMultiplicity2D = [&](const int step, const std::string& prefix, const std::string& jetType)
+    {
+        return histograms.book<Profile2D>(step,nullptr,(prefix+"_njets_2D").c_str(),("Average number of "+jetType+" jets above 20 GeV, vs #mu_{average} and NPV").c_str(),90,0,90,60,0,60);
+    };
 
-    // Step 3: Pileup dependence
-    TH1F hist_reco_njets_lowmu("Step3_RecoJet_njets_lowmu","Number of cluster jets above 20 GeV, #mu_{average} < 30",15,0,30);
-    TH1F hist_reco_njets_midmu("Step3_RecoJet_njets_midmu","Number of cluster jets above 20 GeV, 35 < #mu_{average} < 45",15,0,30);
-    TH1F hist_reco_njets_highmu("Step3_RecoJet_njets_highmu","Number of cluster jets above 20 GeV, #mu_{average} > 50",15,0,30);
+    // Threshold scan: average jet multiplicity above each njetscan threshold, for all events, vs mu and
+    // the threshold index, and vs mu and NPV for each threshold
+    auto bookScan = [&](const int step, const std::string& prefix, const std::string& jetType)
+    {
+        std::vector<Profile2D*> hists;
+        if (scanThresholds.empty())
+            return hists;
+        std::string thresholdList;
+        for (const double threshold : scanThresholds)
+            thresholdList += Form("%s%g",thresholdList.empty() ? "" : ", ",threshold/1.e3);
+        hists.push_back(histograms.book<Profile2D>(step,nullptr,(prefix+"_njets_scan").c_str(),
+                                                   ("Average number of "+jetType+" jets above the threshold ("+thresholdList+" GeV), vs #mu_{average} and threshold").c_str(),
+                                                   90,0,90,scanThresholds.size(),0,scanThresholds.size()));
+        for (const double threshold : scanThresholds)
+        {
+            // Use p instead of a decimal point in the histogram names, e.g. pt22p5
+            std::string thresholdName = Form("%g",threshold/1.e3);
+            std::replace(thresholdName.begin(),thresholdName.end(),'.','p');
+            hists.push_back(histograms.book<Profile2D>(step,nullptr,(prefix+"_njets_2D_pt"+thresholdName).c_str(),
+                                                       Form("Average number of %s jets above %g GeV, vs #mu_{average} and NPV",jetType.c_str(),threshold/1.e3),90,0,90,60,0,60));
+        }
+        return hists;
+    };
 
-    TH1F hist_truth_njets_lowmu("Step3_TruthJet_njets_lowmu","Number of truth jets above 20 GeV, #mu_{average} < 30",15,0,30);
-    TH1F hist_truth_njets_midmu("Step3_TruthJet_njets_midmu","Number of truth jets above 20 GeV, 35 < #mu_{average} < 45",15,0,30);
-    TH1F hist_truth_njets_highmu("Step3_TruthJet_njets_highmu","Number of truth jets above 20 GeV, #mu_{average} > 50",15,0,30);
-    
-    TProfile2D hist_reco_njets_mu_npv("Step3_RecoJets_njets_2D","Average number of cluster jets above 20 GeV, vs #mu_{average} and NPV",90,0,90,60,0,60);
-    TProfile2D hist_truth_njets_mu_npv("Step3_TruthJets_njets_2D","Average number of truth jets above 20 GeV, vs #mu_{average} and NPV",90,0,90,60,0,60);
-    
+    // Step 3: Pileup dependence
+    const std::array<Hist1F*,3> hists_njets_reco  = bookMultiplicity(3,"Step3_RecoJet","cluster");
+    const std::array<Hist1F*,3> hists_njets_truth = bookMultiplicity(3,"Step3_TruthJet","truth");
+    Profile2D* hist_njets_2D_reco  = bookMultiplicity2D(3,"Step3_RecoJets","cluster");
+    Profile2D* hist_njets_2D_truth = bookMultiplicity2D(3,"Step3_TruthJets","truth");
+    const std::vector<Profile2D*> hists_scan_reco  = bookScan(3,"Step3_RecoJets","cluster");
+    const std::vector<Profile2D*> hists_scan_truth = bookScan(3,"Step3_TruthJets","truth");
 
     // Step 4: Tracks and R=0.4 track jets 
-    TH1F hist_reco_jvf_pt20("Step4_RecoJet_jvf_pt20","Leading R=0.4 jet JVF, p_{T} > 20 GeV",44,-1.1,1.1);
-    TH1F hist_reco_jvf_pt60("Step4_RecoJet_jvf_pt60","Leading R=0.4 jet JVF, p_{T} > 60 GeV", 44,-1.1,1.1);
-    TH1F hist_reco_jvf_pt100("Step4_RecoJet_jvf_pt100","Leading R=0.4 jet JVF, p_{T} > 100 GeV",  44,-1.1,1.1);
-    TH1F hist_reco_pt_jvf("Step4_RecoJet_pt_jvf","Leading R=0.4 cluster jet p_{T} after |JVF|>0.5",199,10.e3,2000.e3);
-    
-    TH1F hist_track_pt("Step4_TrackJet_pt","Leading R=0.4 track jet p_{T}",199,10.e3,2000.e3);
-    TH1F hist_track_njets_lowmu("Step4_TrackJet_njets_lowmu","Number of track jets above 20 GeV, #mu_{average} < 30",15,0,30);
-    TH1F hist_track_njets_midmu("Step4_TrackJet_njets_midmu","Number of track jets above 20 GeV, 35 < #mu_{average} < 45",15,0,30);
-    TH1F hist_track_njets_highmu("Step4_TrackJet_njets_highmu","Number of track jets above 20 GeV, #mu_{average} > 50",15,0,30);
-    TProfile2D hist_track_njets_mu_npv("Step4_TrackJets_njets_2D","Average number of track jets above 20 GeV, vs #mu_{average} and NPV",90,0,90,60,0,60);
+    Hist1F* hist_jvf_pt20  = histograms.book<Hist1F>(4,nullptr,"Step4_RecoJet_jvf_pt20","Leading R=0.4 jet JVF, p_{T} > 20 GeV",44,-1.1,1.1);
+    Hist1F* hist_jvf_pt60  = histograms.book<Hist1F>(4,nullptr,"Step4_RecoJet_jvf_pt60","Leading R=0.4 jet JVF, p_{T} > 60 GeV",44,-1.1,1.1);
+    Hist1F* hist_jvf_pt100 = histograms.book<Hist1F>(4,nullptr,"Step4_RecoJet_jvf_pt100","Leading R=0.4 jet JVF, p_{T} > 100 GeV",44,-1.1,1.1);
+    Hist1F* hist_pt_jvf    = histograms.book<Hist1F>(4,nullptr,"Step4_RecoJet_pt_jvf","Leading R=0.4 cluster jet p_{T} after |JVF|>0.5",199,10.e3,2000.e3);
 
+    Hist1F* hist_pt_track = histograms.book<Hist1F>(4,nullptr,"Step4_TrackJet_pt","Leading R=0.4 track jet p_{T}",199,10.e3,2000.e3);
+    const std::array<Hist1F*,3> hists_njets_track = bookMultiplicity(4,"Step4_TrackJet","track");
+    Profile2D* hist_njets_2D_track = bookMultiplicity2D(4,"Step4_TrackJets","track");
+    const std::vector<Profile2D*> hists_scan_track = bookScan(4,"Step4_TrackJets","track");
 
     // Step 5: Jet response studies
-    TH1F hist_DRtruth_reco("Step5_DRtruth_reco","DR between leading truth and reco jet",10,0,1);
-    TH1F hist_DRtruth_reco_jvf("Step5_DRtruth_reco_jvf","DR between leading truth and reco jet, after |JVF| > 0.5",10,0,1);
-    TH1F hist_DRtruth_track("Step5_DRtruth_track","DR between leading truth and track jet",10,0,1);
-
-    TH1F hist_response_reco_pt20("Step5_response_reco_pt20","Cluster jet p_{T} response, p_T{}^{truth} > 20 GeV",100,0,2);
-    TH1F hist_response_reco_pt100("Step5_response_reco_pt100","Cluster jet p_{T} response, p_{T}^{truth} > 100 GeV",100,0,2);
-    TH1F hist_response_reco_pt1000("Step5_response_reco_pt1000","Cluster jet p_{T} response, p_{T}^{truth} > 1000 GeV",100,0,2);
-    TH1F hist_response_track_pt20("Step5_response_track_pt20","Track jet p_{T} response, p_{T}^{truth} > 20 GeV",100,0,2);
-    TH1F hist_response_track_pt100("Step5_response_track_pt100","Track jet p_{T} response, p_{T}^{truth} > 100 GeV",100,0,2);
-    TH1F hist_response_track_pt1000("Step5_response_track_pt1000","Track jet p_{T} response, p_{T}^{truth} > 1000 GeV",100,0,2);
+    // The DR histograms use leading truth jets above 20 GeV, and the response histograms leading jets matched within DR < 0.3
+    histograms.book<Hist1F>(5,[&](Hist1F& hist) { if (DRtruth_reco >= 0 && TruthJet_pt->at(0) > 20.e3) hist.Fill(DRtruth_reco,EventWeight); },
+                            "Step5_DRtruth_reco","DR between leading truth and reco jet",10,0,1);
+    histograms.book<Hist1F>(5,[&](Hist1F& hist) { if (DRtruth_reco >= 0 && TruthJet_pt->at(0) > 20.e3 && fabs(RecoJet_jvf->at(0)) > 0.5) hist.Fill(DRtruth_reco,EventWeight); },
+                            "Step5_DRtruth_reco_jvf","DR between leading truth and reco jet, after |JVF| > 0.5",10,0,1);
+    histograms.book<Hist1F>(5,[&](Hist1F& hist) { if (DRtruth_track >= 0 && TruthJet_pt->at(0) > 20.e3) hist.Fill(DRtruth_track,EventWeight); },
+                            "Step5_DRtruth_track","DR between leading truth and track jet",10,0,1);
+
+    // The response histograms use the truth jets and their matched cluster or track jets: the leading
+    // truth jet, or all truth jets above the pT threshold
+    auto bookResponse = [&](const std::vector<int>& matches, std::vector<float>* const& jetPt, const double truthPtMin, const std::string& name, const std::string& title)
+    {
+        histograms.book<Hist1F>(5,[&matches,&jetPt,&TruthJet_pt,&EventWeight,truthPtMin](Hist1F& hist)
+                                  { if (matches.size() && matches[0] >= 0 && TruthJet_pt->at(0) > truthPtMin) hist.Fill(jetPt->at(matches[0])/TruthJet_pt->at(0),EventWeight); },
+                                name.c_str(),title.c_str(),100,0,2);
+        histograms.book<Hist1F>(5,[&matches,&jetPt,&TruthJet_pt,&EventWeight,truthPtMin](Hist1F& hist)
+                                  {
+                                      for (size_t iTruth = 0; iTruth < matches.size(); ++iTruth)
+                                          if (matches[iTruth] >= 0 && TruthJet_pt->at(iTruth) > truthPtMin)
+                                              hist.Fill(jetPt->at(matches[iTruth])/TruthJet_pt->at(iTruth),EventWeight);
+                                  },
+                                (name+"_all").c_str(),(title+", all matched jets").c_str(),100,0,2);
+    };
+    bookResponse(recoMatches,RecoJet_pt,20.e3,"Step5_response_reco_pt20","Cluster jet p_{T} response, p_T{}^{truth} > 20 GeV");
+    bookResponse(recoMatches,RecoJet_pt,100.e3,"Step5_response_reco_pt100","Cluster jet p_{T} response, p_{T}^{truth} > 100 GeV");
+    bookResponse(recoMatches,RecoJet_pt,1000.e3,"Step5_response_reco_pt1000","Cluster jet p_{T} response, p_{T}^{truth} > 1000 GeV");
+    bookResponse(trackMatches,TrackJet_pt,20.e3,"Step5_response_track_pt20","Track jet p_{T} response, p_{T}^{truth} > 20 GeV");
+    bookResponse(trackMatches,TrackJet_pt,100.e3,"Step5_response_track_pt100","Track jet p_{T} response, p_{T}^{truth} > 100 GeV");
+    bookResponse(trackMatches,TrackJet_pt,1000.e3,"Step5_response_track_pt1000","Track jet p_{T} response, p_{T}^{truth} > 1000 GeV");
+
+    // Jet energy scale and resolution: response of all the matched jets vs truth pT, in bins of truth |eta|,
+    // and its mean and RMS per bin; the Gaussian fits and the calibration are derived after the loop
+    const int jesPtBins = 20;
+    std::vector<double> jesPtEdges(jesPtBins+1);
+    for (int iBin = 0; iBin <= jesPtBins; ++iBin)
+        jesPtEdges[iBin] = 20.e3*std::pow(100.,static_cast<double>(iBin)/jesPtBins); // logarithmic, from 20 GeV to 2 TeV
+    const std::vector<double> jesEtaEdges = {0,0.3,0.8,1.2,1.6,2.1,2.8,3.6,4.5};
+    const std::string jesJetTypes[2]      = {"reco","track"};
+    const std::string jesJetTitles[2]     = {"Cluster","Track"};
+    std::vector<Hist2F*> hists_jes[2];
+    std::vector<Profile1D*> hists_jes_truthpt[2];
+    auto bookJES = [&](const int iType, const std::vector<int>& matches, std::vector<float>* const& jetPt)
+    {
+        for (size_t iEta = 0; iEta+1 < jesEtaEdges.size(); ++iEta)
+        {
+            const double etaLow  = jesEtaEdges.at(iEta);
+            const double etaHigh = jesEtaEdges.at(iEta+1);
+            std::string etaName = Form("eta%gto%g",etaLow,etaHigh);
+            std::replace(etaName.begin(),etaName.end(),'.','p');
+            const std::string etaTitle = Form("%g < |#eta^{truth}| < %g",etaLow,etaHigh);
+            auto forEachMatch = [&matches,&jetPt,&TruthJet_pt,&TruthJet_eta,etaLow,etaHigh](auto fill)
+            {
+                for (size_t iTruth = 0; iTruth < matches.size(); ++iTruth)
+                    if (matches[iTruth] >= 0 && fabs(TruthJet_eta->at(iTruth)) >= etaLow && fabs(TruthJet_eta->at(iTruth)) < etaHigh)
+                        fill(TruthJet_pt->at(iTruth),jetPt->at(matches[iTruth])/TruthJet_pt->at(iTruth));
+            };
+            hists_jes[iType].push_back(histograms.book<Hist2F>(5,[forEachMatch,&EventWeight](Hist2F& hist)
+                                                                 { forEachMatch([&](const double pt, const double response) { hist.Fill(pt,response,EventWeight); }); },
+                                                               ("Step5_JESgrid_"+jesJetTypes[iType]+"_"+etaName).c_str(),(jesJetTitles[iType]+" jet p_{T} response vs p_{T}^{truth}, "+etaTitle).c_str(),
+                                                               jesPtBins,jesPtEdges.data(),200,0,2));
+            histograms.book<Profile1D>(5,[forEachMatch,&EventWeight](Profile1D& hist)
+                                         { forEachMatch([&](const double pt, const double response) { hist.Fill(pt,response,EventWeight); }); },
+                                       ("Step5_JESmean_"+jesJetTypes[iType]+"_"+etaName).c_str(),(jesJetTitles[iType]+" jet average p_{T} response vs p_{T}^{truth}, "+etaTitle).c_str(),
+                                       jesPtBins,jesPtEdges.data());
+            // Average truth pT of the matched jets in each bin, where the fitted response is placed for the inversion
+            hists_jes_truthpt[iType].push_back(histograms.book<Profile1D>(5,[forEachMatch,&EventWeight](Profile1D& hist)
+                                                                            { forEachMatch([&](const double pt, const double) { hist.Fill(pt,pt,EventWeight); }); },
+                                                                          ("Step5_JEStruthpt_"+jesJetTypes[iType]+"_"+etaName).c_str(),(jesJetTitles[iType]+" jet average p_{T}^{truth} of the matched truth jets vs p_{T}^{truth}, "+etaTitle).c_str(),
+                                                                          jesPtBins,jesPtEdges.data()));
+        }
+    };
+    bookJES(0,recoMatches,RecoJet_pt);
+    bookJES(1,trackMatches,TrackJet_pt);
+
+    // Online mean, RMS and quantiles of the response in each (pT, |eta|) bin of the same grid, which give
+    // the JES and JER at the end of the loop without fits, with a fixed memory per bin
+    const int jesEtaBins = jesEtaEdges.size()-1;
+    std::vector<StreamingStats> responseStats[2];
+    if (histograms.stepEnabled(5))
+        for (int iType = 0; iType < 2; ++iType)
+            responseStats[iType].resize(jesPtBins*jesEtaBins);
+    auto jesBin = [&](const double pt, const double eta)
+    {
+        const int binPt  = std::upper_bound(jesPtEdges.begin(),jesPtEdges.end(),pt) - jesPtEdges.begin() - 1;
+        const int binEta = std::upper_bound(jesEtaEdges.begin(),jesEtaEdges.end(),fabs(eta)) - jesEtaEdges.begin() - 1;
+        return binPt < 0 || binPt >= jesPtBins || binEta < 0 || binEta >= jesEtaBins ? -1 : binPt*jesEtaBins + binEta;
+    };
+
+    // JVF cut scan: |JVF| vs pT of the leading cluster jet, for truth-matched (DR < 0.3 to a truth jet) and
+    // pileup (DR > 0.6 to all truth jets) jets in bins of mu; the efficiency and rejection of every cut are derived after the loop
+    const std::vector<double> jvfScanMuBins = {0,20,40,60,100};
+    const std::string jvfScanOrigins[2]      = {"pileup","matched"};
+    const int jvfScanPtBins  = 9;   // 20 GeV bins from 20 to 200 GeV
+    const int jvfScanJvfBins = 101; // 0.01 bins from 0 to 1.01, so that |JVF| = 1 is in range
+    std::vector<Hist2F*> hists_jvfscan[2];
+    for (int origin = 0; origin < 2; ++origin)
+        for (size_t iMu = 0; iMu+1 < jvfScanMuBins.size(); ++iMu)
+        {
+            const double muLow  = jvfScanMuBins.at(iMu);
+            const double muHigh = jvfScanMuBins.at(iMu+1);
+            const std::string histName  = Form("Step5_JVFscan_%s_mu%gto%g",jvfScanOrigins[origin].c_str(),muLow,muHigh);
+            const std::string histTitle = Form("Leading R=0.4 %s jet |JVF| vs p_{T}, %g < #mu_{average} < %g",jvfScanOrigins[origin].c_str(),muLow,muHigh);
+            hists_jvfscan[origin].push_back(histograms.book<Hist2F>(5,[&,origin,muLow,muHigh](Hist2F& hist)
+                                                                      { if (recoJetOrigin == origin && mu_average >= muLow && mu_average < muHigh) hist.Fill(RecoJet_pt->at(0),fabs(RecoJet_jvf->at(0)),EventWeight); },
+                                                                    histName.c_str(),histTitle.c_str(),jvfScanPtBins,20.e3,200.e3,jvfScanJvfBins,0,1.01));
+        }
 
 
 
@@ -199,267 +447,215 @@ int main (int argc, char* argv[])
     // Run over the events in the file and reconstruct jets   //
     ////////////////////////////////////////////////////////////
 
+    // The loop is instantiated for the highest enabled step, so the checks of the later steps
+    // are resolved at compile time, and the choice is made once here
     const long long int numEvents = inTree->GetEntries();
-    for (long long iEvent = 0; iEvent < numEvents; ++iEvent)
-    {
-        // Print out the even number every 10k events and then load the event
-        if (iEvent%10000 == 0)
-            printf("Processing event %lld/%lld\n",iEvent,numEvents);
-        inTree->GetEntry(iEvent);
-
 
+    // Steps 3 and 4: the jet pT, JVF, mu, NPV and weight are collected as columns for blocks of events,
+    // then the multiplicities, leading jets and ranges of mu are computed for the whole block
+    const size_t blockSize = 4096;
+    JaggedColumn blockRecoPt, blockTruthPt, blockTrackPt, blockRecoJvf;
+    std::vector<double> blockMu, blockNPV, blockWeight;
+    std::vector<int> blockMuRange, selected;
+    std::vector<double> numJets, scanCounts, leadRecoPt, leadRecoJvf, leadTrackPt;
+    std::vector<char> hasRecoPt, hasRecoJvf, hasTrackPt;
+    std::vector<double> selX, selY, selZ, selW;
+
+    // Fill a histogram with the values of a column for the events of the block passing the selection
+    auto fillSelected = [&](Hist1F* hist, const std::vector<double>& column, const auto& selection)
+    {
+        selectEvents(blockMu.size(),selection,selected);
+        gatherColumn(column,selected,selX);
+        gatherColumn(blockWeight,selected,selW);
+        hist->FillN(selected.size(),selX.data(),selW.data());
+    };
+    auto fillMultiplicity = [&](const JaggedColumn& jetPt, const std::array<Hist1F*,3>& hists, Profile2D* hist2D)
+    {
+        jetPt.countAbove(20.e3,numJets);
+        for (int iRange = 0; iRange < 3; ++iRange)
+            fillSelected(hists[iRange],numJets,[&](const size_t iEvent) { return numJets[iEvent] && blockMuRange[iEvent] == iRange; });
+        selectEvents(blockMu.size(),[&](const size_t iEvent) { return numJets[iEvent] > 0; },selected);
+        gatherColumn(blockMu,selected,selX);
+        gatherColumn(blockNPV,selected,selY);
+        gatherColumn(numJets,selected,selZ);
+        gatherColumn(blockWeight,selected,selW);
+        hist2D->FillN(selected.size(),selX.data(),selY.data(),selZ.data(),selW.data());
+    };
+
+    // Counts above all the scan thresholds from one pass over the jets of each event
+    auto fillScan = [&](const JaggedColumn& jetPt, const std::vector<Profile2D*>& hists)
+    {
+        if (hists.empty())
+            return;
+        const size_t numBlock      = blockMu.size();
+        const size_t numThresholds = scanThresholds.size();
+        jetPt.countAboveEach(scanThresholds,scanCounts);
+
+        // Vs mu and the threshold index: one entry per event and threshold
+        selX.resize(numBlock*numThresholds);
+        selY.resize(numBlock*numThresholds);
+        selW.resize(numBlock*numThresholds);
+        for (size_t iEvent = 0; iEvent < numBlock; ++iEvent)
+            for (size_t iThreshold = 0; iThreshold < numThresholds; ++iThreshold)
+            {
+                selX[iEvent*numThresholds+iThreshold] = blockMu[iEvent];
+                selY[iEvent*numThresholds+iThreshold] = iThreshold+0.5;
+                selW[iEvent*numThresholds+iThreshold] = blockWeight[iEvent];
+            }
+        hists.at(0)->FillN(numBlock*numThresholds,selX.data(),selY.data(),scanCounts.data(),selW.data());
 
-        // Step 1: event-level information
-        // Histograms to fill:
-        //  hist_mu:     mu distribution
-        //  hist_npv:    npv distribution
-        //  hist_mu_npv: mu (x-axis) vs npv (y-axis) distribution 
-        if (!stepNum || stepNum >= 1)
+        // Vs mu and NPV for each threshold
+        selZ.resize(numBlock);
+        for (size_t iThreshold = 0; iThreshold < numThresholds; ++iThreshold)
         {
-             // TODO fill the mu, npv, and mu vs npv histograms
-            hist_mu.Fill(mu_average);
-            hist_npv.Fill(NPV);
-            hist_mu_npv.Fill(mu_average,NPV);
+            for (size_t iEvent = 0; iEvent < numBlock; ++iEvent)
+                selZ[iEvent] = scanCounts[iEvent*numThresholds+iThreshold];
+            hists.at(iThreshold+1)->FillN(numBlock,blockMu.data(),blockNPV.data(),selZ.data(),blockWeight.data());
         }
+    };
 
+    // Step 5: matching of all the truth jets to the cluster and track jets
+    JetMatcher recoMatcher(matchDR,matchMode);
+    JetMatcher trackMatcher(matchDR,matchMode);
+    recoMatcher.setIsolation(matchIsolation,matchIsolation);
+    trackMatcher.setIsolation(matchIsolation,matchIsolation);
 
+    auto eventLoop = [&](auto maxStep)
+    {
+        constexpr int MaxStep = decltype(maxStep)::value;
 
-        // Step 2: R=0.4 cluster and truth jets and the event weight
-        // Histograms to fill:
-        //  hist_reco_pt_nw:  Leading R=0.4 calorimeter jet pT, without the event weight
-        //  hist_reco_pt:     Leading R=0.4 calorimeter jet pT, with the event weight
-        //  hist_truth_pt_nw: Leading R=0.4 truth jet pT, without the event weight
-        //  hist_truth_pt:    Leading R=0.4 truth jet pT, with the event weight
-        if (!stepNum || stepNum >= 2)
+        auto fillBlock = [&]()
         {
-            // TODO fill the calorimeter and truth jet pT histograms
-            if (RecoJet_pt->size())
+            // Range of mu of each event: 0 for mu < 30, 1 for 35 < mu < 45, 2 for mu > 50, and -1 otherwise
+            blockMuRange.resize(blockMu.size());
+            for (size_t iEvent = 0; iEvent < blockMu.size(); ++iEvent)
+                blockMuRange[iEvent] = blockMu[iEvent] < 30 ? 0 : (blockMu[iEvent] > 35 && blockMu[iEvent] < 45) ? 1 : blockMu[iEvent] > 50 ? 2 : -1;
+
+            // Step 3: Pileup dependence
+            fillMultiplicity(blockRecoPt,hists_njets_reco,hist_njets_2D_reco);
+            fillMultiplicity(blockTruthPt,hists_njets_truth,hist_njets_2D_truth);
+            fillScan(blockRecoPt,hists_scan_reco);
+            fillScan(blockTruthPt,hists_scan_truth);
+
+            // Step 4: Tracks and R=0.4 track jets 
+            if constexpr (MaxStep >= 4)
             {
-                hist_reco_pt_nw.Fill(RecoJet_pt->at(0));
-                hist_reco_pt.Fill(RecoJet_pt->at(0),EventWeight);
+                blockRecoPt.leading(leadRecoPt,hasRecoPt);
+                blockRecoJvf.leading(leadRecoJvf,hasRecoJvf);
+                blockTrackPt.leading(leadTrackPt,hasTrackPt);
+                fillSelected(hist_jvf_pt20, leadRecoJvf,[&](const size_t iEvent) { return hasRecoJvf[iEvent] && leadRecoPt[iEvent] > 20.e3; });
+                fillSelected(hist_jvf_pt60, leadRecoJvf,[&](const size_t iEvent) { return hasRecoJvf[iEvent] && leadRecoPt[iEvent] > 60.e3; });
+                fillSelected(hist_jvf_pt100,leadRecoJvf,[&](const size_t iEvent) { return hasRecoJvf[iEvent] && leadRecoPt[iEvent] > 100.e3; });
+                fillSelected(hist_pt_jvf,   leadRecoPt, [&](const size_t iEvent) { return hasRecoJvf[iEvent] && fabs(leadRecoJvf[iEvent]) > 0.5; });
+                fillSelected(hist_pt_track, leadTrackPt,[&](const size_t iEvent) { return hasTrackPt[iEvent]; });
+                fillMultiplicity(blockTrackPt,hists_njets_track,hist_njets_2D_track);
+                fillScan(blockTrackPt,hists_scan_track);
             }
-            if (TruthJet_pt->size())
+
+            blockMu.clear();
+            blockNPV.clear();
+            blockWeight.clear();
+            blockRecoPt.clear();
+            blockTruthPt.clear();
+            blockTrackPt.clear();
+            blockRecoJvf.clear();
+        };
+
+        for (long long iEvent = 0; iEvent < numEvents; ++iEvent)
+        {
+            // Print out the even number every 10k events and then load the event
+            if (iEvent%10000 == 0)
+                printf("Processing event %lld/%lld\n",iEvent,numEvents);
+            inTree->GetEntry(iEvent);
+
+
+
+            // Step 1: event-level information
+            // Step 2: R=0.4 cluster and truth jets and the event weight
+            // (the histograms are filled directly from the branches)
+
+            // Step 3: Pileup dependence
+            // Add the event to the columns of the block
+            if constexpr (MaxStep >= 3)
             {
-                hist_truth_pt_nw.Fill(TruthJet_pt->at(0));
-                hist_truth_pt.Fill(TruthJet_pt->at(0),EventWeight);
+                blockMu.push_back(mu_average);
+                blockNPV.push_back(NPV);
+                blockWeight.push_back(EventWeight);
+                blockRecoPt.push_back(*RecoJet_pt);
+                blockTruthPt.push_back(*TruthJet_pt);
             }
-        }
 
-        // Step 3: Pileup dependence
-        // Histograms to fill:
-        //  hist_reco_njets_lowmu:   R=0.4 calorimeter jet multiplicity for pT > 20 GeV, mu < 30, with the event weight
-        //  hist_reco_njets_midmu:   R=0.4 calorimeter jet multiplicity for pT > 20 GeV, 35 < mu < 45, with the event weight
-        //  hist_reco_njets_highmu:  R=0.4 calorimeter jet multiplicity for pT > 20 GeV, mu > 50, with the event weight
-        //  hist_truth_njets_lowmu:  R=0.4 truth jet multiplicity for pT > 20 GeV, mu < 30, with the event weight
-        //  hist_truth_njets_midmu:  R=0.4 truth jet multiplicity for pT > 20 GeV, 35 < mu < 45, with the event weight
-        //  hist_truth_njets_highmu: R=0.4 truth jet multiplicity for pT > 20 GeV, mu > 50, with the event weight
-        //  hist_reco_njets_mu_npv:  R=0.4 calorimeter jet multiplicity for pT > 20 GeV (z-axis), vs mu (x-axis) and npv (y-axis), with the event weight
-        //  hist_truth_njets_mu_npv: R=0.4 truth jet multiplicity for pT > 20 GeV (z-axis), vs mu (x-axis) and npv (y-axis), with the event weight
-        if (!stepNum || stepNum >= 3)
-        {// TODO fill the jet multiplicity histograms for calorimeter and truth jets for different mu selections, and also vs both mu and npv
-            
-            //Reco Jets:Count the number of cluster jets
-		    unsigned numJetReco=0;
-		    for (size_t iJet=0; iJet<RecoJet_pt->size();++iJet)
-		    {
-			    if (RecoJet_pt->at(iJet)>20.e3)
-				    numJetReco++;
-		    }
-	        //Reco Jets:Considering events with atleast one jet
-		    if (numJetReco !=0)
-		    {
-			    if (mu_average<30)
-				    hist_reco_njets_lowmu.Fill(numJetReco,EventWeight);
-			    else if (mu_average>35 && mu_average<45)
-				    hist_reco_njets_midmu.Fill(numJetReco,EventWeight);				
-			    else if (mu_average>50)
-				    hist_reco_njets_highmu.Fill(numJetReco,EventWeight);
-			    hist_reco_njets_mu_npv.Fill(mu_average,NPV,numJetReco,EventWeight);
-		    }
-	        //Truth Jets:Count the number of cluster jets
-		    unsigned numJetTruth=0;
-		    for (size_t iJet=0; iJet<TruthJet_pt->size();++iJet)
-		    {
-			    if (TruthJet_pt->at(iJet)>20.e3)
-				    numJetTruth++;
-		    }
-	        //Truth Jets:Considering events with atleast one jet
-		    if (numJetTruth !=0)
-		    {
-			    if (mu_average<30)
-				    hist_truth_njets_lowmu.Fill(numJetTruth,EventWeight);
-			    else if (mu_average>35 && mu_average<45)
-				    hist_truth_njets_midmu.Fill(numJetTruth,EventWeight);				
-			    else if (mu_average>50)
-				    hist_truth_njets_highmu.Fill(numJetTruth,EventWeight);
-			    hist_truth_njets_mu_npv.Fill(mu_average,NPV,numJetTruth,EventWeight);
-		    }
-        }
+            // Step 4: Tracks and R=0.4 track jets 
+            if constexpr (MaxStep >= 4)
+            {
+                blockTrackPt.push_back(*TrackJet_pt);
+                blockRecoJvf.push_back(*RecoJet_jvf);
+            }
 
-        // Step 4: Tracks and R=0.4 track jets 
-        // Histograms to fill:
-        //  hist_reco_jvf_pt20:      Leading R=0.4 calorimeter jet JVF, pT > 20 GeV, with the event weight
-        //  hist_reco_jvf_pt60:      Leading R=0.4 calorimeter jet JVF, pT > 60 GeV, with the event weight
-        //  hist_reco_jvf_pt100:     Leading R=0.4 calorimeter jet JVF, pT > 100 GeV, with the event weight
-        //  hist_reco_pt_jvf:        Leading R=0.4 calorimeter jet pT, after |JVF|>0.5, with the event weight
-        //  hist_track_pt:           Leading R=0.4 track jet pT, with the event weight
-        //  hist_track_njets_lowmu:  R=0.4 track jet multiplicity for pT > 20 GeV, mu < 30, with the event weight
-        //  hist_track_njets_midmu:  R=0.4 track jet multiplicity for pT > 20 GeV, 35 < mu < 45, with the event weight
-        //  hist_track_njets_highmu: R=0.4 track jet multiplicity for pT > 20 GeV, mu > 50, with the event weight
-        //  hist_track_njets_mu_npv: R=0.4 track jet multiplicity for pT > 20 GeV (z-axis), vs mu (x-axis) and npv (y-axis), with the event weight
-        if (!stepNum || stepNum >= 4)
-	{ // TODO fill the calorimeter JVF histograms and apply a |JVF|>0.5 cut to the leading calorimeter jet pT spectrum to see the impact of tracking on jet multiplicity suppression, then look at track jets
-		if (RecoJet_jvf->size() && RecoJet_pt->at(0)>20.e3)
-			hist_reco_jvf_pt20.Fill(RecoJet_jvf->at(0),EventWeight);
-		if (RecoJet_jvf->size() && RecoJet_pt->at(0)>60.e3)
-			hist_reco_jvf_pt60.Fill(RecoJet_jvf->at(0),EventWeight);
-		if (RecoJet_jvf->size() && RecoJet_pt->at(0)>100.e3)
-			hist_reco_jvf_pt100.Fill(RecoJet_jvf->at(0),EventWeight);
-		if (RecoJet_jvf->size() && fabs(RecoJet_jvf->at(0))>0.5)
-			hist_reco_pt_jvf.Fill(RecoJet_pt->at(0),EventWeight);
-	    //Track Jet pileup studies:
-
-            //Track Jets:Count the number of cluster jets
-		unsigned numJetTrack=0;
-		for (size_t iJet=0; iJet<TrackJet_pt->size();++iJet)
-		{
-			if (TrackJet_pt->at(iJet)>20.e3)
-				numJetTrack++;
-		}
-	    //Track Jets:Considering events with atleast one jet
-		if (numJetTrack !=0)
-		{
-			if (mu_average<30)
-				hist_track_njets_lowmu.Fill(numJetTrack,EventWeight);
-			else if (mu_average>35 && mu_average<45)
-				hist_track_njets_midmu.Fill(numJetTrack,EventWeight);				
-			else if (mu_average>50)
-				hist_track_njets_highmu.Fill(numJetTrack,EventWeight);
-			hist_track_njets_mu_npv.Fill(mu_average,NPV,numJetTrack,EventWeight);
-		}
-		//Track Jet pT distribution
-		if (TrackJet_pt->size())
-			hist_track_pt.Fill(TrackJet_pt->at(0),EventWeight);		
-        }
+            // Step 5: Jet response studies
+            // DR between the leading truth jet and the leading cluster and track jets, and matching of all the truth jets
+            if constexpr (MaxStep >= 5)
+            {
+                truthEta.assign(TruthJet_eta->begin(),TruthJet_eta->end());
+                truthPhi.assign(TruthJet_phi->begin(),TruthJet_phi->end());
+                recoEta.assign(RecoJet_eta->begin(),RecoJet_eta->end());
+                recoPhi.assign(RecoJet_phi->begin(),RecoJet_phi->end());
+                trackEta.assign(TrackJet_eta->begin(),TrackJet_eta->end());
+                trackPhi.assign(TrackJet_phi->begin(),TrackJet_phi->end());
+
+                DRtruth_reco  = -1;
+                DRtruth_track = -1;
+                if (truthEta.size() && recoEta.size())
+                    DRtruth_reco = std::sqrt(EtaPhiGrid::deltaR2Of(truthEta[0],truthPhi[0],recoEta[0],recoPhi[0]));
+                if (truthEta.size() && trackEta.size())
+                    DRtruth_track = std::sqrt(EtaPhiGrid::deltaR2Of(truthEta[0],truthPhi[0],trackEta[0],trackPhi[0]));
+
+                recoMatches  = recoMatcher.match(truthEta,truthPhi,recoEta,recoPhi);
+                trackMatches = trackMatcher.match(truthEta,truthPhi,trackEta,trackPhi);
+                for (int iType = 0; iType < 2; ++iType)
+                {
+                    const std::vector<int>& matches = iType ? trackMatches : recoMatches;
+                    const std::vector<float>& jetPt = iType ? *TrackJet_pt : *RecoJet_pt;
+                    for (size_t iTruth = 0; iTruth < matches.size(); ++iTruth)
+                    {
+                        const int bin = jesBin(TruthJet_pt->at(iTruth),truthEta[iTruth]);
+                        if (matches[iTruth] >= 0 && bin >= 0)
+                            responseStats[iType][bin].add(jetPt.at(matches[iTruth])/TruthJet_pt->at(iTruth),EventWeight);
+                    }
+                }
+
+                // Whether the leading cluster jet is matched to any truth jet, for the JVF cut scan
+                recoJetOrigin = -1;
+                if (RecoJet_jvf->size())
+                {
+                    double minDR2 = 1.e10;
+                    for (size_t iJet = 0; iJet < truthEta.size(); ++iJet)
+                        minDR2 = std::min(minDR2,EtaPhiGrid::deltaR2Of(recoEta[0],recoPhi[0],truthEta[iJet],truthPhi[iJet]));
+                    recoJetOrigin = minDR2 < 0.3*0.3 ? 1 : minDR2 > 0.6*0.6 ? 0 : -1;
+                }
+            }
 
-        // Step 5: Jet response studies
-        // Histograms to fill:
-        //  hist_DRtruth_reco:          Delta R between the leading R=0.4 truth and calorimeter jets, with the event weight
-        //  hist_DRtruth_reco_jvf:      Delta R between the leading R=0.4 truth and calorimeter jets, after |JVF|>0.5, with the event weight
-        //  hist_DRtruth_track:         Delta R between the leading R=0.4 truth and track jets, with the event weight
-        //  hist_response_reco_pt20:    Response (pTreco/pTtrue) for the leading calorimeter jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 20 GeV, with the event weight
-        //  hist_response_reco_pt100:   Response (pTreco/pTtrue) for the leading calorimeter jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 100 GeV, with the event weight
-        //  hist_response_reco_pt1000:  Response (pTreco/pTtrue) for the leading calorimeter jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 1000 GeV, with the event weight
-        //  hist_response_track_pt20:   Response (pTreco/pTtrue) for the leading track jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 20 GeV, with the event weight
-        //  hist_response_track_pt100:  Response (pTreco/pTtrue) for the leading track jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 100 GeV, with the event weight
-        //  hist_response_track_pt1000: Response (pTreco/pTtrue) for the leading track jet matched to the leading truth jet within DR of 0.3, with a truth jet pT cut of 1000 GeV, with the event weight
-        if (!stepNum || stepNum >= 5)
-        {// TODO Match reconstructed jets to truth jets, and then study the response of matched jets (both calorimeter and track jets matched to truth jets)
-		//Comparing Truth Jet to Reconstructed Jet
-		//20GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>20.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (RecoJet_pt->size())
-			{
-				TLorentzVector recoJet;
-				recoJet.SetPtEtaPhiM(RecoJet_pt->at(0),RecoJet_eta->at(0),RecoJet_phi->at(0),RecoJet_m->at(0));
-				hist_DRtruth_reco.Fill(truthJet.DeltaR(recoJet),EventWeight);
-				if (fabs(RecoJet_jvf->at(0))>0.5)
-					hist_DRtruth_reco_jvf.Fill(truthJet.DeltaR(recoJet),EventWeight);
-				//Study response from matched truth to reco jets:pt>20GeV
-				if (truthJet.DeltaR(recoJet)<0.3)
-				{
-					hist_response_reco_pt20.Fill(recoJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}
-		//100GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>100.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (RecoJet_pt->size())
-			{
-				TLorentzVector recoJet;
-				recoJet.SetPtEtaPhiM(RecoJet_pt->at(0),RecoJet_eta->at(0),RecoJet_phi->at(0),RecoJet_m->at(0));
-				//Study response from matched truth to reco jets:pt>100GeV
-				if (truthJet.DeltaR(recoJet)<0.3)
-				{
-					hist_response_reco_pt100.Fill(recoJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}
-		//1000GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>1000.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (RecoJet_pt->size())
-			{
-				TLorentzVector recoJet;
-				recoJet.SetPtEtaPhiM(RecoJet_pt->at(0),RecoJet_eta->at(0),RecoJet_phi->at(0),RecoJet_m->at(0));
-				//Study response from matched truth to reco jets:pt>1000GeV
-				if (truthJet.DeltaR(recoJet)<0.3)
-				{
-					hist_response_reco_pt1000.Fill(recoJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}
-
-		//Comparing Truth Jet to Track Jet
-		//20GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>20.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (TrackJet_pt->size())
-			{
-				TLorentzVector trackJet;
-				trackJet.SetPtEtaPhiM(TrackJet_pt->at(0),TrackJet_eta->at(0),TrackJet_phi->at(0),TrackJet_m->at(0));
-				hist_DRtruth_track.Fill(truthJet.DeltaR(trackJet),EventWeight);
-				//Study response from matched truth to reco jets:pt>20GeV
-				if (truthJet.DeltaR(trackJet)<0.3)
-				{
-					hist_response_track_pt20.Fill(trackJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}
-		//100GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>100.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (TrackJet_pt->size())
-			{
-				TLorentzVector trackJet;
-				trackJet.SetPtEtaPhiM(TrackJet_pt->at(0),TrackJet_eta->at(0),TrackJet_phi->at(0),TrackJet_m->at(0));
-				//Study response from matched truth to reco jets:pt>100GeV
-				if (truthJet.DeltaR(trackJet)<0.3)
-				{
-					hist_response_track_pt100.Fill(trackJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}
-		//1000GeV
-		if (TruthJet_pt->size() && TruthJet_pt->at(0)>1000.e3)
-		{
-			TLorentzVector truthJet;
-			truthJet.SetPtEtaPhiM(TruthJet_pt->at(0),TruthJet_eta->at(0),TruthJet_phi->at(0),TruthJet_m->at(0));
-			if (TrackJet_pt->size())
-			{
-				TLorentzVector trackJet;
-				trackJet.SetPtEtaPhiM(TrackJet_pt->at(0),TrackJet_eta->at(0),TrackJet_phi->at(0),TrackJet_m->at(0));
-				//Study response from matched truth to reco jets:pt>1000GeV
-				if (truthJet.DeltaR(trackJet)<0.3)
-				{
-					hist_response_track_pt1000.Fill(trackJet.Pt()/truthJet.Pt(),EventWeight);
-				}
-			}
-		}				
+            histograms.fill();
+            if constexpr (MaxStep >= 3)
+                if (blockMu.size() == blockSize)
+                    fillBlock();
         }
+        if constexpr (MaxStep >= 3)
+            fillBlock();
+    };
+
+    TStopwatch timer;
+    timer.Start();
+    switch (stepNum)
+    {
+        case 1:  eventLoop(std::integral_constant<int,1>()); break;
+        case 2:  eventLoop(std::integral_constant<int,2>()); break;
+        case 3:  eventLoop(std::integral_constant<int,3>()); break;
+        case 4:  eventLoop(std::integral_constant<int,4>()); break;
+        default: eventLoop(std::integral_constant<int,5>()); break;
     }
+    timer.Stop();
+    printf("Event loop up to step %d: CPU time per event %.2f us\n",stepNum ? stepNum : 5,numEvents ? 1.e6*timer.CpuTime()/numEvents : 0.);
 
 
 
@@ -468,69 +664,162 @@ int main (int argc, char* argv[])
     ////////////////////////////////////////////////////////////
 
     outFile->cd();
+    histograms.write();
 
-    // Step 1: event-level information
-    if (!stepNum || stepNum >= 1)
-    {
-        hist_mu.Write();
-        hist_npv.Write();
-        hist_mu_npv.Write();
-    }
-
-    // Step 2: R=0.4 cluster and truth jets and the event weight
-    if (!stepNum || stepNum >= 2)
-    {
-        hist_reco_pt_nw.Write();
-        hist_reco_pt.Write();
-        hist_truth_pt_nw.Write();
-        hist_truth_pt.Write();
-    }
-
-    // Step 3: Pileup dependence
-    if (!stepNum || stepNum >= 3)
-    {
-        hist_reco_njets_lowmu.Write();
-        hist_reco_njets_midmu.Write();
-        hist_reco_njets_highmu.Write();
-        hist_truth_njets_lowmu.Write();
-        hist_truth_njets_midmu.Write();
-        hist_truth_njets_highmu.Write();
-
-        hist_reco_njets_mu_npv.Write();
-        hist_truth_njets_mu_npv.Write();
-    }
-
-    // Step 4: Tracks and R=0.4 track jets 
-    if (!stepNum || stepNum >= 4)
-    {
-        hist_reco_jvf_pt20.Write();
-        hist_reco_jvf_pt60.Write();
-        hist_reco_jvf_pt100.Write();
-        hist_reco_pt_jvf.Write();
-
-        hist_track_pt.Write();
-        hist_track_njets_lowmu.Write();
-        hist_track_njets_midmu.Write();
-        hist_track_njets_highmu.Write();
-        hist_track_njets_mu_npv.Write();
-    }
-
-    // Step 5: Jet response studies
-    if (!stepNum || stepNum >= 5)
-    {
-        hist_DRtruth_reco.Write();
-        hist_DRtruth_reco_jvf.Write();
-        hist_DRtruth_track.Write();
-
-        hist_response_reco_pt20.Write();
-        hist_response_reco_pt100.Write();
-        hist_response_reco_pt1000.Write();
-        hist_response_track_pt20.Write();
-        hist_response_track_pt100.Write();
-        hist_response_track_pt1000.Write();
-    }
+    // JVF cut scan: fraction of the matched jets kept (efficiency) and of the pileup jets removed (rejection)
+    // by the cut |JVF| >= the lower edge of each y bin, from the cumulative |JVF| distribution in each pT bin
+    if (histograms.stepEnabled(5))
+        for (int origin = 0; origin < 2; ++origin)
+            for (size_t iMu = 0; iMu+1 < jvfScanMuBins.size(); ++iMu)
+            {
+                Hist2F* hist = hists_jvfscan[origin].at(iMu);
+                const std::string curveName  = Form("Step5_JVFscan_%s_mu%gto%g",origin ? "eff" : "rej",jvfScanMuBins.at(iMu),jvfScanMuBins.at(iMu+1));
+                const std::string curveTitle = Form("Leading R=0.4 %s jet %s of the cut |JVF| #geq y, %g < #mu_{average} < %g",jvfScanOrigins[origin].c_str(),
+                                                    origin ? "efficiency" : "rejection",jvfScanMuBins.at(iMu),jvfScanMuBins.at(iMu+1));
+                TH2F curve(curveName.c_str(),curveTitle.c_str(),jvfScanPtBins,20.e3,200.e3,jvfScanJvfBins,0,1.01);
+                std::vector<double> passing(jvfScanJvfBins+3,0.);
+                for (int binx = 1; binx <= jvfScanPtBins; ++binx)
+                {
+                    for (int biny = jvfScanJvfBins+1; biny >= 0; --biny)
+                        passing[biny] = hist->GetBinContent(hist->GetBin(binx,biny)) + passing[biny+1];
+                    if (passing[0] <= 0)
+                        continue;
+                    for (int biny = 1; biny <= jvfScanJvfBins; ++biny)
+                        curve.SetBinContent(binx,biny,origin ? passing[biny]/passing[0] : 1-passing[biny]/passing[0]);
+                }
+                curve.Write();
+            }
 
+    // Jet energy scale and resolution from the iterative Gaussian fits of the response in each (pT, |eta|) bin, and
+    // the calibration factor 1/R vs reco pT from numerical inversion: the response R fitted in a bin of average truth pT
+    // corresponds to reco pT R*pT
+    if (histograms.stepEnabled(5))
+        for (int iType = 0; iType < 2; ++iType)
+        {
+            TH2F jes(("Step5_JES_"+jesJetTypes[iType]).c_str(),(jesJetTitles[iType]+" jet energy scale (fitted response) vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                     jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TH2F jer(("Step5_JER_"+jesJetTypes[iType]).c_str(),(jesJetTitles[iType]+" jet energy resolution (fitted #sigma/#mu) vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                     jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TH2F calib(("Step5_calib_"+jesJetTypes[iType]).c_str(),(jesJetTitles[iType]+" jet calibration factor vs p_{T}^{reco} and |#eta|").c_str(),
+                       jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            for (int iEta = 0; iEta < jesEtaBins; ++iEta)
+            {
+                Hist2F* grid = hists_jes[iType].at(iEta);
+                Profile1D* truthPt = hists_jes_truthpt[iType].at(iEta);
+                std::vector< std::pair<double,double> > inversion;
+                for (int binx = 1; binx <= jesPtBins; ++binx)
+                {
+                    TH1D response("responseCore","",200,0,2);
+                    response.SetDirectory(nullptr);
+                    for (int biny = 1; biny <= 200; ++biny)
+                    {
+                        response.SetBinContent(biny,grid->GetBinContent(grid->GetBin(binx,biny)));
+                        response.SetBinError(biny,grid->GetBinError(grid->GetBin(binx,biny)));
+                    }
+                    double mean = 0, meanError = 0, sigma = 0, sigmaError = 0;
+                    if (!fitResponseCore(response,mean,meanError,sigma,sigmaError) || mean <= 0)
+                        continue;
+                    jes.SetBinContent(binx,iEta+1,mean);
+                    jes.SetBinError(binx,iEta+1,meanError);
+                    jer.SetBinContent(binx,iEta+1,sigma/mean);
+                    jer.SetBinError(binx,iEta+1,sigmaError/mean);
+                    inversion.push_back(std::make_pair(mean*truthPt->GetBinContent(binx),1/mean));
+                }
+                if (inversion.empty())
+                    continue;
+                std::sort(inversion.begin(),inversion.end());
+                for (int binx = 1; binx <= jesPtBins; ++binx)
+                    calib.SetBinContent(binx,iEta+1,interpolateLogX(inversion,std::sqrt(jesPtEdges.at(binx-1)*jesPtEdges.at(binx))));
+            }
+            jes.Write();
+            jer.Write();
+            calib.Write();
+        }
 
+    // JES and JER from the online statistics: mean and RMS/mean, and median and IQR/1.349/median (the
+    // Gaussian width for a Gaussian response, but less sensitive to the tails)
+    //
+    // The histograms are derived and cannot be merged with hadd, which would add them bin by bin.  The
+    // state of the statistics of each bin (the Welford sums and the t-digest centroids) is therefore
+    // also written, one tree entry per bin: hadd appends the entries of several outputs, and the
+    // statistics are merged by building a StreamingStats from each entry and merging those of the same
+    // bin, from which the mean, RMS and quantiles of all the outputs are then recomputed.
+    if (histograms.stepEnabled(5))
+        for (int iType = 0; iType < 2; ++iType)
+        {
+            const std::string title = jesJetTitles[iType]+" jet ";
+            TH2F jesMean(("Step5_JESonline_"+jesJetTypes[iType]).c_str(),(title+"mean p_{T} response vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                         jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TH2F jerRMS(("Step5_JERonline_"+jesJetTypes[iType]).c_str(),(title+"p_{T} response RMS/mean vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                        jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TH2F jesMedian(("Step5_JESmedian_"+jesJetTypes[iType]).c_str(),(title+"median p_{T} response vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                           jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TH2F jerIQR(("Step5_JERiqr_"+jesJetTypes[iType]).c_str(),(title+"p_{T} response IQR/1.349/median vs p_{T}^{truth} and |#eta^{truth}|").c_str(),
+                        jesPtBins,jesPtEdges.data(),jesEtaBins,jesEtaEdges.data());
+            TTree statsTree(("Step5_JESstats_"+jesJetTypes[iType]).c_str(),(title+"p_{T} response statistics per p_{T}^{truth} and |#eta^{truth}| bin").c_str());
+            int treeBinPt = 0, treeBinEta = 0;
+            long long treeNumSkipped = 0;
+            double treeSumw = 0, treeSumw2 = 0, treeMean = 0, treeSumDev2 = 0, treeSkippedWeight = 0;
+            double treeCompression = 0, treeMin = 0, treeMax = 0;
+            std::vector<double> treeCentroidMeans, treeCentroidWeights;
+            statsTree.Branch("binPt",&treeBinPt);
+            statsTree.Branch("binEta",&treeBinEta);
+            statsTree.Branch("sumw",&treeSumw);
+            statsTree.Branch("sumw2",&treeSumw2);
+            statsTree.Branch("mean",&treeMean);
+            statsTree.Branch("sumDev2",&treeSumDev2);
+            statsTree.Branch("numSkipped",&treeNumSkipped);
+            statsTree.Branch("skippedWeight",&treeSkippedWeight);
+            statsTree.Branch("compression",&treeCompression);
+            statsTree.Branch("min",&treeMin);
+            statsTree.Branch("max",&treeMax);
+            statsTree.Branch("centroidMeans",&treeCentroidMeans);
+            statsTree.Branch("centroidWeights",&treeCentroidWeights);
+
+            long long numSkipped = 0;
+            double skippedWeight = 0;
+            for (int binPt = 0; binPt < jesPtBins; ++binPt)
+                for (int binEta = 0; binEta < jesEtaBins; ++binEta)
+                {
+                    StreamingStats& stats = responseStats[iType].at(binPt*jesEtaBins + binEta);
+                    numSkipped    += stats.numSkipped();
+                    skippedWeight += stats.skippedWeight();
+
+                    treeBinPt         = binPt;
+                    treeBinEta        = binEta;
+                    treeSumw          = stats.moments().sumOfWeights();
+                    treeSumw2         = stats.moments().sumOfSquaredWeights();
+                    treeMean          = stats.moments().mean();
+                    treeSumDev2       = stats.moments().sumOfSquaredDeviations();
+                    treeNumSkipped    = stats.numSkipped();
+                    treeSkippedWeight = stats.skippedWeight();
+                    treeCompression   = stats.quantiles().compression();
+                    treeMin           = stats.quantiles().min();
+                    treeMax           = stats.quantiles().max();
+                    stats.quantiles().getCentroids(treeCentroidMeans,treeCentroidWeights);
+                    statsTree.Fill();
+
+                    const WelfordAccumulator& moments = stats.moments();
+                    if (moments.effectiveEntries() < 2 || moments.mean() <= 0)
+                        continue;
+                    jesMean.SetBinContent(binPt+1,binEta+1,moments.mean());
+                    jesMean.SetBinError(binPt+1,binEta+1,moments.meanError());
+                    jerRMS.SetBinContent(binPt+1,binEta+1,moments.rms()/moments.mean());
+                    const double median = stats.quantiles().quantile(0.5);
+                    if (median <= 0)
+                        continue;
+                    jesMedian.SetBinContent(binPt+1,binEta+1,median);
+                    jerIQR.SetBinContent(binPt+1,binEta+1,(stats.quantiles().quantile(0.75)-stats.quantiles().quantile(0.25))/1.349/median);
+                }
+            jesMean.Write();
+            jerRMS.Write();
+            jesMedian.Write();
+            jerIQR.Write();
+            statsTree.Write();
+            if (numSkipped)
+                printf("%s jet online JES/JER: skipped %lld matched jets with a non-positive event weight or an undefined response (summed weight %g), which the histograms include\n",
+                       jesJetTitles[iType].c_str(),numSkipped,skippedWeight);
+        }
 
     outFile->Close();
 
@@ -4,18 +4,29 @@
 ////////////////////////////////////////
 
 // Compile with (for example, update to point to your files and FastJet directory):
-// g++ jetRecoGroom.cpp -o jetRecoGroom `~/FastJet/fastjet-install/bin/fastjet-config --cxxflags --libs --plugins` `root-config --cflags --libs` -lRecursiveTools -lEnergyCorrelator -lNsubjettiness
+// g++ jetRecoGroom.cpp -o jetRecoGroom `~/FastJet/fastjet-install/bin/fastjet-config --cxxflags --libs --plugins` `root-config --cflags --libs` -lRecursiveTools -lEnergyCorrelator -lNsubjettiness -lSoftKiller -lVariableR
 
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <limits>
 
 #include "TFile.h"
 #include "TTree.h"
 #include "TH1I.h"
 #include "TH1F.h"
+#include "TH2F.h"
+#include "TProfile.h"
 #include "TLorentzVector.h"
 #include "TVector2.h"
+#include "TString.h"
+#include "TStopwatch.h"
+#include "ProgramOptions.h"
+#include "HistRegistry.h"
 
 
 // Step 1: event-level information
@@ -28,19 +39,282 @@
 // TODO: add headers here (jet reconstruction and trimming)
 #include "fastjet/ClusterSequence.hh"
 #include "fastjet/tools/Filter.hh"
+#include "fastjet/ClusterSequenceArea.hh"
+#include "fastjet/tools/GridMedianBackgroundEstimator.hh"
+#include "fastjet/tools/Subtractor.hh"
+#include "fastjet/contrib/VariableRPlugin.hh"
+#include "TruthJetCache.h"
+#include "PreClusteringStage.h"
 
 // Step 4: Building other types of R=1.0 jets from topoclusters
-// TODO: add headers here (Pruning, SoftDrop, Recursive SoftDrop, and Bottom-Up SoftDrop)
+#include "fastjet/tools/Pruner.hh"
+#include "fastjet/contrib/SoftDrop.hh"
+#include "fastjet/contrib/RecursiveSoftDrop.hh"
+#include "fastjet/contrib/BottomUpSoftDrop.hh"
 
 // Step 5: Calculating substructure variables for R=1.0 jets
-// TODO: add headers here (Energy correlators and N subjettiness)
+#include "fastjet/contrib/EnergyCorrelator.hh"
+#include "fastjet/contrib/Nsubjettiness.hh"
+#include "FastECF.h"
+#include "NsubjettinessCache.h"
+#include "LundPlane.h"
+
+// Step 6: Truth-reco response of matched R=1.0 jets
+#include "JetMatching.h"
+
+
+// Drop the softest constituents of a jet, removing at most maxDroppedFraction of the jet pT
+// and keeping at most maxKept constituents (0 for no limit), but never fewer than three
+fastjet::PseudoJet truncateConstituents(const fastjet::PseudoJet& jet, const double maxDroppedFraction, const size_t maxKept)
+{
+    std::vector<fastjet::PseudoJet> constituents = fastjet::sorted_by_pt(jet.constituents());
+
+    size_t numKept = constituents.size();
+    double droppedPt = 0;
+    while (numKept && droppedPt + constituents.at(numKept-1).pt() <= maxDroppedFraction*jet.pt())
+        droppedPt += constituents.at(--numKept).pt();
+    if (maxKept && numKept > maxKept)
+        numKept = maxKept;
+    numKept = std::min(constituents.size(),std::max<size_t>(numKept,3));
+
+    if (numKept == constituents.size())
+        return jet;
+    constituents.resize(numKept);
+    return fastjet::join(constituents);
+}
+
+// All of the jet types which substructure is calculated for in step 5
+const size_t numJetTypes = 7;
+const std::string jetTypeNames[numJetTypes]  = {"Ungroomed","Trimmed","Pruned","SD","RSD","BUSD","BUSDT"};
+const std::string jetTypeTitles[numJetTypes] = {"Ungroomed","Trimmed","Pruned","SD","RSD","BUSD","Tight BUSD"};
+
+// The step 4 groomers which are also applied to the reclustered jets
+const size_t numReclusGroomers = 5;
+
+// Input branches and histograms of steps 2 to 5 for one level: reco (RecoJets and Clusters) or
+// truth (TruthJets and Particles)
+struct JetRecoLevel
+{
+    JetRecoLevel(const bool truth, const int stepNum)
+        : isTruth(truth)
+        , name(truth ? "Truth" : "Reco")
+        , jetTypeString(truth ? "TruthJets" : "RecoJets")
+        , inputTypeString(truth ? "Particles" : "Clusters")
+        , histograms(stepNum)
+    {
+        timeClusterJets.Reset();
+        timeReclusJets.Reset();
+        timeAllJets.Reset();
+    }
+
+    const bool isTruth;
+    const std::string name;
+    const std::string jetTypeString;
+    const std::string inputTypeString;
+
+    // Step 2: Existing jets
+    std::vector<float>* jet_R10_ungroom_pt = nullptr;
+    std::vector<float>* jet_R10_ungroom_m  = nullptr;
+    std::vector<float>* jet_R10_trimmed_pt = nullptr;
+    std::vector<float>* jet_R10_trimmed_m  = nullptr;
+
+    // Step 3: Clusters (or particles) and the existing R=0.4 jets
+    std::vector<float>* cluster_pt  = nullptr;
+    std::vector<float>* cluster_eta = nullptr;
+    std::vector<float>* cluster_phi = nullptr;
+    std::vector<float>* cluster_m   = nullptr;
+    std::vector<float>* jet_R4_pt   = nullptr;
+    std::vector<float>* jet_R4_eta  = nullptr;
+    std::vector<float>* jet_R4_phi  = nullptr;
+    std::vector<float>* jet_R4_m    = nullptr;
+
+    // Histograms of steps 2 to 5, only the ones of the enabled steps and options are booked
+    HistRegistry histograms;
+
+    // Step 2: Existing jets and the event weight
+    FastHist1D<TH1F>* hist_ungroom_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_ungroom_pt = nullptr;
+    FastHist1D<TH1F>* hist_trimmed_pt = nullptr;
+
+    FastHist1D<TH1F>* hist_ungroom_m = nullptr;
+    FastHist1D<TH1F>* hist_trimmed_m = nullptr;
+
+    // Step 3: Building our own R=1.0 jets from topoclusters
+    FastHist1D<TH1F>* hist_myungroom_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_pt = nullptr;
+    FastHist1D<TH1F>* hist_mytrimmed_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_mytrimmed_pt = nullptr;
+
+    // Step 3, pileup subtraction: event pT density and rho*A subtracted jets
+    FastHist1D<TH1F>* hist_rho = nullptr;
+    FastProfile1D<TProfile>* hist_rho_mu = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_area = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_m = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_pt_sub = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_m_sub = nullptr;
+    FastProfile1D<TProfile>* hist_myungroom_m_mu = nullptr;
+    FastProfile1D<TProfile>* hist_myungroom_m_sub_mu = nullptr;
+
+    // Step 3, variable-R: anti-kt jets with R_eff = rho/pT built from the same inputs
+    FastHist1D<TH1F>* hist_myvarr_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_myvarr_pt = nullptr;
+    FastHist1D<TH1F>* hist_myvarr_m = nullptr;
+    FastHist1D<TH1F>* hist_myvarr_reff = nullptr;
+
+    // Step 3, pre-clustering: input multiplicity, SoftKiller threshold and jets built without the stages
+    FastProfile1D<TProfile>* hist_ninputs_mu = nullptr;
+    FastProfile1D<TProfile>* hist_ninputs_preclus_mu = nullptr;
+    FastHist1D<TH1F>* hist_softkiller_ptcut = nullptr;
+    FastProfile1D<TProfile>* hist_softkiller_ptcut_mu = nullptr;
+    FastHist1D<TH1F>* hist_constsub_rho = nullptr;
+    FastProfile1D<TProfile>* hist_constsub_rho_mu = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_pt_ref = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_m_ref = nullptr;
+    FastProfile1D<TProfile>* hist_myungroom_m_ref_mu = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_pt_ratio = nullptr;
+    FastHist1D<TH1F>* hist_myungroom_m_ratio = nullptr;
+    FastProfile1D<TProfile>* hist_myungroom_pt_ratio_mu = nullptr;
+    FastProfile1D<TProfile>* hist_myungroom_m_ratio_mu = nullptr;
+
+    // Step 3, reclustering: R=1.0 jets built from the existing R=0.4 jets
+    FastHist1D<TH1F>* hist_myreclus_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_myreclus_pt = nullptr;
+    FastHist1D<TH1F>* hist_myreclus_m = nullptr;
+    FastHist1D<TH1F>* hist_myreclustrim_pt_nw = nullptr;
+    FastHist1D<TH1F>* hist_myreclustrim_pt = nullptr;
+    FastHist1D<TH1F>* hist_myreclus_nsub = nullptr;
+
+    // Step 4: Building other types of R=1.0 jets from topoclusters
+    FastHist1D<TH1F>* hist_mypruned_pt = nullptr;
+    FastHist1D<TH1F>* hist_mypruned_m = nullptr;
+
+    FastHist1D<TH1F>* hist_mySD_pt = nullptr;
+    FastHist1D<TH1F>* hist_mySD_m = nullptr;
+
+    FastHist1D<TH1F>* hist_myRSD_pt = nullptr;
+    FastHist1D<TH1F>* hist_myRSD_m = nullptr;
+
+    FastHist1D<TH1F>* hist_myBUSD_pt = nullptr;
+    FastHist1D<TH1F>* hist_myBUSD_m = nullptr;
+
+    FastHist1D<TH1F>* hist_myBUSDT_pt = nullptr;
+    FastHist1D<TH1F>* hist_myBUSDT_m = nullptr;
+
+    // Step 4, reclustering: the same groomers applied to the reclustered jets
+    FastHist1D<TH1F>* hists_reclus_groomed_pt[numReclusGroomers] = {};
+    FastHist1D<TH1F>* hists_reclus_groomed_m[numReclusGroomers]  = {};
+
+    // Step 5, angular-exponent scan: D2, N2 and M2 for every requested beta and jet type
+    std::vector<FastHist1D<TH1F>*> hists_scan_D2;
+    std::vector<FastHist1D<TH1F>*> hists_scan_N2;
+    std::vector<FastHist1D<TH1F>*> hists_scan_M2;
+
+    // Step 5, constituent truncation: difference between the truncated and full calculation
+    FastHist1D<TH1F>* hist_trunc_D2_bias = nullptr;
+    FastHist1D<TH1F>* hist_trunc_tau32_bias = nullptr;
+    FastHist1D<TH1F>* hist_trunc_kept = nullptr;
+
+    // Step 5, Lund plane: TH2F per jet type and mu bin, and the number of jets per mu bin
+    std::vector<FastHist2D<TH2F>*> hists_lund;
+    std::vector<FastHist1D<TH1F>*> hists_lund_jets;
+
+    // All of the jet types which substructure is calculated for
+    FastHist1D<TH1F>* hists_D2[numJetTypes]    = {};
+    FastHist1D<TH1F>* hists_tau32[numJetTypes] = {};
+
+    // All-jets mode: every R=1.0 jet above the pT threshold, not only the leading one
+    FastHist1D<TH1F>* hist_alljets_num = nullptr;
+    std::vector<FastHist1D<TH1F>*> hists_alljets_pt;
+    std::vector<FastHist1D<TH1F>*> hists_alljets_m;
+    std::vector<FastHist1D<TH1F>*> hists_alljets_D2;
+    std::vector<FastHist1D<TH1F>*> hists_alljets_tau32;
+
+    // All-jets mode: jets collected over a batch of events, together with the cluster sequences they
+    // come from, so that each groomer and substructure tool is run over the whole batch at once
+    struct BatchJet
+    {
+        fastjet::PseudoJet jet;
+        long long event;
+        int rank;
+        float weight;
+        float mu;
+    };
+    std::vector<BatchJet> batchJets;
+    std::vector< std::shared_ptr<fastjet::ClusterSequence> > batchSequences;
+    std::vector<fastjet::PseudoJet> batchGroomed[numJetTypes];
+
+    // All-jets mode: optional jet-level output tree, one entry per jet
+    TTree* jetTree = nullptr;
+    long long tree_event  = 0;
+    int tree_rank         = 0;
+    float tree_weight     = 0;
+    float tree_mu         = 0;
+    float tree_pt[numJetTypes];
+    float tree_m[numJetTypes];
+    float tree_D2[numJetTypes];
+    float tree_tau32[numJetTypes];
+
+    // Output directory, the truth histograms have their own directory if both levels are run
+    TDirectory* outDir = nullptr;
+
+    // Step 3 R=1.0 jets of the current event, kept for the step 6 truth-reco matching
+    std::shared_ptr<fastjet::ClusterSequence> cs_a10_clusters;
+    std::vector<fastjet::PseudoJet> jets_a10_clusters;
+
+    // CPU time spent building the R=1.0 jets from clusters and from R=0.4 jets
+    TStopwatch timeClusterJets;
+    TStopwatch timeReclusJets;
+
+    // CPU time spent grooming and measuring the jets of the all-jets mode, and their number
+    TStopwatch timeAllJets;
+    long long numAllJets = 0;
+};
 
 int main (int argc, char* argv[])
 {
+    // Optional settings and their default values
+    std::map<std::string,std::string> options;
+    options["level"]       = "reco";   // Jets and inputs used in steps 2 to 5: reco, truth or both (in the same pass over the events)
+    options["truthcache"]  = "";       // Directory of the on-disk cache of truth R=1.0 jets (empty = no cache)
+    options["area"]        = "none";   // Jet area for the step 3 rho*A subtraction: none, voronoi or active
+    options["rhoymax"]     = "2.5";    // Rapidity range of the grid used for the median pT density rho
+    options["rhogrid"]     = "0.55";   // Cell size of the grid used for the median pT density rho
+    options["preclus"]     = "none";   // Comma-separated pre-clustering stages applied to the inputs before step 3: softkiller, constsub, towers
+    options["preclusref"]  = "0";      // Also cluster the unmodified inputs in step 3 to compare with the pre-clustered jets
+    options["skymax"]      = "4.0";    // Rapidity range of the SoftKiller grid
+    options["skgrid"]      = "0.4";    // Cell size of the SoftKiller grid
+    options["csymax"]      = "4.0";    // Rapidity range of the constituent subtraction ghosts and rho grid
+    options["csghost"]     = "0.1";    // Spacing of the constituent subtraction ghosts
+    options["csdrmax"]     = "0.25";   // Maximum distance between an input and the ghosts it is corrected with
+    options["toweretamax"] = "4.9";    // Pseudorapidity range of the tower grid
+    options["towersize"]   = "0.1";    // Eta and phi size of the towers
+    options["varr"]        = "0";      // Also build variable-R anti-kt jets (R_eff = rho/pT) from the clusters in step 3
+    options["varrrho"]     = "600.e3"; // Variable-R rho parameter, R_eff = rho/pT
+    options["varrmin"]     = "0.2";    // Minimum effective radius of the variable-R jets
+    options["varrmax"]     = "1.0";    // Maximum effective radius of the variable-R jets
+    options["recluster"]   = "off";    // R=1.0 jets reclustered from the existing R=0.4 jets in steps 3 and 4: off, both or only (no cluster-level jets)
+    options["reclusptmin"] = "25.e3";  // Minimum pT of the R=0.4 jets used for reclustering
+    options["ecf"]         = "fast";   // Energy correlator implementation for step 5: fast or contrib
+    options["ecfcheck"]    = "0";      // Number of jets for which the fast ECFs are cross-checked against fastjet::contrib::EnergyCorrelator
+    options["betas"]       = "";       // Angular exponents for the additional D2, N2 and M2 histograms in step 5
+    options["nsub"]        = "contrib"; // N-subjettiness implementation for step 5: cached or contrib
+    options["nsubcheck"]   = "0";      // Number of jets reusing the cached axes for which tau32 is cross-checked against fastjet::contrib
+    options["nsubreuse"]   = "0.05";   // Maximum fraction of the ungroomed jet pT a groomer may remove for the ungroomed axes to be reused
+    options["truncfrac"]   = "0";      // Drop the softest constituents up to this fraction of the jet pT before step 5 (0 = off)
+    options["trunctopk"]   = "0";      // Keep only the hardest K constituents before step 5 (0 = off)
+    options["truncval"]    = "0";      // Number of truncated jets for which the full calculation is also done to measure the bias
+    options["matchdr"]     = "0.75";   // Maximum distance between matched truth and reco R=1.0 jets in step 6
+    options["lund"]        = "1";      // Fill the primary Lund-plane density of the leading jet of every type in step 5
+    options["lundmu"]      = "20";     // Width of the mu_average bins of the Lund-plane histograms, from 0 to 100
+    options["alljets"]     = "0";      // Also groom and calculate substructure for all R=1.0 jets above allptmin, not only the leading jet
+    options["allptmin"]    = "400.e3"; // Minimum ungroomed pT of the jets used in the all-jets mode
+    options["allbatch"]    = "100";    // Number of events whose jets are groomed together in the all-jets mode (0 = each jet on its own)
+    options["jettree"]     = "0";      // Write a tree with one entry per jet of the all-jets mode
+
     // Check arguments
     if (argc < 5)
     {
-        printf("USAGE: %s <output file> <step number> <tree name> <input file>\n",argv[0]);
+        printf("USAGE: %s <output file> <step number> <tree name> <input file> [option=value ...]\n",argv[0]);
         printf("Valid step number options:\n");
         printf("\t0 = all steps\n");
         printf("\t1 = only step 1  (event-level information)\n");
@@ -48,6 +322,44 @@ int main (int argc, char* argv[])
         printf("\t3 = up to step 3 (building our own R=1.0 jets from topoclusters)\n");
         printf("\t4 = up to step 4 (building other types of R=1.0 jets from topoclusters)\n");
         printf("\t5 = up to step 5 (calculating substructure variables for R=1.0 jets)\n");
+        printf("\t6 = up to step 6 (truth-reco response of matched R=1.0 jets, needs level=both)\n");
+        printf("Valid options (default value in brackets):\n");
+        printf("\tlevel=reco|truth|both     reco (RecoJets and Clusters) and/or truth (TruthJets and Particles) jets in steps 2 to 5 [%s]\n",options["level"].c_str());
+        printf("\ttruthcache=<directory>    cache the step 3 truth jets in this directory and reuse them in later runs [%s]\n",options["truthcache"].c_str());
+        printf("\tarea=none|voronoi|active  jet area for rho*A subtracted step 3 histograms [%s]\n",options["area"].c_str());
+        printf("\trhoymax=<y>               rapidity range of the grid used to estimate rho [%s]\n",options["rhoymax"].c_str());
+        printf("\trhogrid=<size>            cell size of the grid used to estimate rho [%s]\n",options["rhogrid"].c_str());
+        printf("\tpreclus=none|<s1,s2,...>  pre-clustering stages applied in order to the step 3 inputs, from: softkiller, constsub, towers [%s]\n",options["preclus"].c_str());
+        printf("\tpreclusref=0|1            also build step 3 jets without the pre-clustering stages for comparison [%s]\n",options["preclusref"].c_str());
+        printf("\tskymax=<y>                rapidity range of the SoftKiller grid [%s]\n",options["skymax"].c_str());
+        printf("\tskgrid=<size>             cell size of the SoftKiller grid [%s]\n",options["skgrid"].c_str());
+        printf("\tcsymax=<y>                rapidity range of the constituent subtraction ghosts [%s]\n",options["csymax"].c_str());
+        printf("\tcsghost=<size>            spacing of the constituent subtraction ghosts [%s]\n",options["csghost"].c_str());
+        printf("\tcsdrmax=<R>               maximum input-ghost distance used by the constituent subtraction [%s]\n",options["csdrmax"].c_str());
+        printf("\ttoweretamax=<eta>         pseudorapidity range of the tower grid [%s]\n",options["toweretamax"].c_str());
+        printf("\ttowersize=<size>          eta and phi size of the towers [%s]\n",options["towersize"].c_str());
+        printf("\tvarr=0|1                  also build variable-R anti-kt jets from the clusters in step 3 [%s]\n",options["varr"].c_str());
+        printf("\tvarrrho=<rho>             variable-R rho parameter, R_eff = rho/pT [%s]\n",options["varrrho"].c_str());
+        printf("\tvarrmin=<R>               minimum effective radius of the variable-R jets [%s]\n",options["varrmin"].c_str());
+        printf("\tvarrmax=<R>               maximum effective radius of the variable-R jets [%s]\n",options["varrmax"].c_str());
+        printf("\trecluster=off|both|only   R=1.0 jets reclustered from R=0.4 jets in steps 3 and 4, with or without the cluster-level jets [%s]\n",options["recluster"].c_str());
+        printf("\treclusptmin=<pT>          minimum pT of the R=0.4 jets used for reclustering [%s]\n",options["reclusptmin"].c_str());
+        printf("\tecf=fast|contrib          energy correlator implementation used in step 5 [%s]\n",options["ecf"].c_str());
+        printf("\tecfcheck=<N>              cross-check the fast ECFs against fastjet::contrib for the first N jets [%s]\n",options["ecfcheck"].c_str());
+        printf("\tbetas=<b1,b2,...>         also fill D2, N2 and M2 for each of these angular exponents in step 5 [%s]\n",options["betas"].c_str());
+        printf("\tnsub=cached|contrib       N-subjettiness implementation used in step 5 [%s]\n",options["nsub"].c_str());
+        printf("\tnsubreuse=<f>             reuse the ungroomed jet axes for groomed jets which lost at most this pT fraction [%s]\n",options["nsubreuse"].c_str());
+        printf("\tnsubcheck=<N>             cross-check tau32 against fastjet::contrib for the first N jets reusing the cached axes [%s]\n",options["nsubcheck"].c_str());
+        printf("\ttruncfrac=<f>             drop the softest constituents up to this fraction of the jet pT in step 5 [%s]\n",options["truncfrac"].c_str());
+        printf("\ttrunctopk=<K>             only keep the hardest K constituents in step 5 [%s]\n",options["trunctopk"].c_str());
+        printf("\ttruncval=<N>              measure the truncation bias on the first N truncated jets [%s]\n",options["truncval"].c_str());
+        printf("\tmatchdr=<R>               maximum distance between matched truth and reco jets in step 6 [%s]\n",options["matchdr"].c_str());
+        printf("\tlund=0|1                  fill the primary Lund-plane density of every jet type in step 5 [%s]\n",options["lund"].c_str());
+        printf("\tlundmu=<width>            width of the mu_average bins of the Lund-plane histograms, from 0 to 100 [%s]\n",options["lundmu"].c_str());
+        printf("\talljets=0|1               groom and calculate substructure for all jets above allptmin in steps 3 to 5 [%s]\n",options["alljets"].c_str());
+        printf("\tallptmin=<pT>             minimum ungroomed pT of the jets in the all-jets mode [%s]\n",options["allptmin"].c_str());
+        printf("\tallbatch=<N>              number of events whose jets are groomed together in the all-jets mode, 0 for each jet on its own [%s]\n",options["allbatch"].c_str());
+        printf("\tjettree=0|1               write a tree with one entry per jet of the all-jets mode [%s]\n",options["jettree"].c_str());
         return 1;
     }
 
@@ -56,11 +368,138 @@ int main (int argc, char* argv[])
     const int stepNum             = atol(argv[2]);
     const std::string inTreeName  = argv[3];
     const std::string inFileName  = argv[4];
-    if (stepNum < 0 || stepNum > 5)
+    if (stepNum < 0 || stepNum > 6)
     {
         printf("Invalid step number: %d\n",stepNum);
         return 1;
     }
+    if (!parseOptions(argc,argv,5,options))
+        return 1;
+    const std::string levelType = options["level"];
+    if (levelType != "reco" && levelType != "truth" && levelType != "both")
+    {
+        printf("Invalid level: %s\n",levelType.c_str());
+        return 1;
+    }
+    const std::string truthCacheDir = options["truthcache"];
+    const std::string areaType = options["area"];
+    const bool doAreaSub       = areaType != "none";
+    const double rhoYMax       = atof(options["rhoymax"].c_str());
+    const double rhoGrid       = atof(options["rhogrid"].c_str());
+    if (doAreaSub && areaType != "voronoi" && areaType != "active")
+    {
+        printf("Invalid jet area type: %s\n",areaType.c_str());
+        return 1;
+    }
+    std::vector< std::unique_ptr<PreClusteringStage> > preClusteringStages;
+    SoftKillerStage* softKiller = nullptr;
+    ConstituentSubtractionStage* constSub = nullptr;
+    TowerProjectionStage* towers = nullptr;
+    for (const std::string& stageName : splitList(options["preclus"]))
+    {
+        if (stageName == "none")
+            continue;
+        else if (stageName == "softkiller" && !softKiller)
+        {
+            softKiller = new SoftKillerStage(atof(options["skymax"].c_str()),atof(options["skgrid"].c_str()));
+            preClusteringStages.emplace_back(softKiller);
+        }
+        else if (stageName == "constsub" && !constSub)
+        {
+            constSub = new ConstituentSubtractionStage(atof(options["csymax"].c_str()),atof(options["csghost"].c_str()),atof(options["csdrmax"].c_str()),rhoGrid);
+            preClusteringStages.emplace_back(constSub);
+        }
+        else if (stageName == "towers" && !towers)
+        {
+            towers = new TowerProjectionStage(atof(options["toweretamax"].c_str()),atof(options["towersize"].c_str()));
+            preClusteringStages.emplace_back(towers);
+        }
+        else
+        {
+            printf("Invalid pre-clustering stage: %s\n",stageName.c_str());
+            return 1;
+        }
+    }
+    const bool doPreClus    = !preClusteringStages.empty();
+    const bool doPreClusRef = doPreClus && atol(options["preclusref"].c_str());
+
+    const bool doVarR         = atol(options["varr"].c_str());
+    const double varRRho      = atof(options["varrrho"].c_str());
+    const double varRMin      = atof(options["varrmin"].c_str());
+    const double varRMax      = atof(options["varrmax"].c_str());
+    if (doVarR && (varRRho <= 0 || varRMin <= 0 || varRMax < varRMin))
+    {
+        printf("Invalid variable-R parameters: rho=%g, min R=%g, max R=%g\n",varRRho,varRMin,varRMax);
+        return 1;
+    }
+
+    const bool doRecluster    = options["recluster"] != "off";
+    const bool doClusterJets  = options["recluster"] != "only";
+    const double reclusPtMin  = atof(options["reclusptmin"].c_str());
+    if (doRecluster && options["recluster"] != "both" && options["recluster"] != "only")
+    {
+        printf("Invalid reclustering mode: %s\n",options["recluster"].c_str());
+        return 1;
+    }
+
+    const bool useFastECF     = options["ecf"] == "fast";
+    const long long ecfChecks = atol(options["ecfcheck"].c_str());
+    if (!useFastECF && options["ecf"] != "contrib")
+    {
+        printf("Invalid energy correlator implementation: %s\n",options["ecf"].c_str());
+        return 1;
+    }
+    std::vector<double> scanBetas;
+    if (!parseList(options["betas"],scanBetas))
+        return 1;
+    const bool useNsubCache = options["nsub"] == "cached";
+    const double nsubReuse  = atof(options["nsubreuse"].c_str());
+    const long long nsubChecks = atol(options["nsubcheck"].c_str());
+    if (!useNsubCache && options["nsub"] != "contrib")
+    {
+        printf("Invalid N-subjettiness implementation: %s\n",options["nsub"].c_str());
+        return 1;
+    }
+    const double truncFrac        = atof(options["truncfrac"].c_str());
+    const size_t truncTopK        = atol(options["trunctopk"].c_str());
+    const long long truncValidate = atol(options["truncval"].c_str());
+    const bool doTruncate         = truncFrac > 0 || truncTopK > 0;
+
+    const bool doLund        = atol(options["lund"].c_str()) && (!stepNum || stepNum >= 5) && doClusterJets;
+    const double lundMuWidth = atof(options["lundmu"].c_str());
+    if (doLund && (lundMuWidth <= 0 || lundMuWidth > 100))
+    {
+        printf("Invalid Lund-plane mu bin width: %g\n",lundMuWidth);
+        return 1;
+    }
+    std::vector<double> lundMuBins;
+    const int numLundMuBins = doLund ? static_cast<int>(std::ceil(100/lundMuWidth-1.e-6)) : 0;
+    for (int iMu = 0; iMu <= numLundMuBins; ++iMu)
+        lundMuBins.push_back(std::min(100.,iMu*lundMuWidth));
+
+    const bool doAllJets         = atol(options["alljets"].c_str()) && (!stepNum || stepNum >= 3) && doClusterJets;
+    const double allJetsPtMin    = atof(options["allptmin"].c_str());
+    const long long allJetsBatch = atol(options["allbatch"].c_str());
+    const bool doJetTree         = doAllJets && atol(options["jettree"].c_str());
+    if (doAllJets && allJetsBatch < 0)
+    {
+        printf("Invalid all-jets batch size: %lld\n",allJetsBatch);
+        return 1;
+    }
+
+    // The response needs the cluster-level jets of both levels, so it is skipped otherwise when running all steps
+    const double matchDR   = atof(options["matchdr"].c_str());
+    const bool doResponse  = (!stepNum || stepNum >= 6) && levelType == "both" && doClusterJets;
+    if (stepNum == 6 && !doResponse)
+    {
+        printf("Step 6 needs level=both and the cluster-level jets\n");
+        return 1;
+    }
+    if (doResponse && matchDR <= 0)
+    {
+        printf("Invalid matching distance: %g\n",matchDR);
+        return 1;
+    }
 
     // Open the input file and get the tree
     TFile* inFile = TFile::Open(inFileName.c_str(),"READ");
@@ -79,9 +518,15 @@ int main (int argc, char* argv[])
     ////////////////////////////////////////////////////////////
     // Specify the input branches that we want to read        //
     ////////////////////////////////////////////////////////////
-    const bool isTruth = false;
-    const std::string jetTypeString   = !isTruth ? "RecoJets" : "TruthJets";
-    const std::string inputTypeString = !isTruth  ? "Clusters" : "Particles";
+
+    // Steps 2 to 5 are run for every requested level in the same pass over the events
+    // The histograms are not attached to a directory, so the levels can use the same names
+    TH1::AddDirectory(false);
+    std::vector< std::unique_ptr<JetRecoLevel> > levels;
+    if (levelType != "truth")
+        levels.emplace_back(new JetRecoLevel(false,stepNum));
+    if (levelType != "reco")
+        levels.emplace_back(new JetRecoLevel(true,stepNum));
 
     // Step 1: event-level information
     float mu_average = 0;
@@ -97,41 +542,55 @@ int main (int argc, char* argv[])
 
     // Step 2: Existing jets and the event weight
     float EventWeight = 0;
-    std::vector<float>* jet_R10_ungroom_pt = nullptr;
-    std::vector<float>* jet_R10_ungroom_m  = nullptr;
-    std::vector<float>* jet_R10_trimmed_pt = nullptr;
-    std::vector<float>* jet_R10_trimmed_m  = nullptr;
     if (!stepNum || stepNum >= 2)
     {
         inTree->SetBranchStatus("EventWeight",1);
-        inTree->SetBranchStatus((jetTypeString+"_R10_pt").c_str(),1);
-        inTree->SetBranchStatus((jetTypeString+"_R10_m").c_str(),1);
-        inTree->SetBranchStatus((jetTypeString+"_R10_Trimmed_pt").c_str(),1);
-        inTree->SetBranchStatus((jetTypeString+"_R10_Trimmed_m").c_str(),1);
-
         inTree->SetBranchAddress("EventWeight",&EventWeight);
-        inTree->SetBranchAddress((jetTypeString+"_R10_pt").c_str(),&jet_R10_ungroom_pt);
-        inTree->SetBranchAddress((jetTypeString+"_R10_m").c_str(), &jet_R10_ungroom_m);
-        inTree->SetBranchAddress((jetTypeString+"_R10_Trimmed_pt").c_str(),&jet_R10_trimmed_pt);
-        inTree->SetBranchAddress((jetTypeString+"_R10_Trimmed_m").c_str(), &jet_R10_trimmed_m);
     }
-
-    // Step 3: Building our own R=1.0 jets from topoclusters
-    std::vector<float>* cluster_pt  = nullptr;
-    std::vector<float>* cluster_eta = nullptr;
-    std::vector<float>* cluster_phi = nullptr;
-    std::vector<float>* cluster_m   = nullptr;
-    if (!stepNum || stepNum >= 3)
+    for (const std::unique_ptr<JetRecoLevel>& level : levels)
     {
-        inTree->SetBranchStatus((inputTypeString+"_pt").c_str(),1);
-        inTree->SetBranchStatus((inputTypeString+"_eta").c_str(),1);
-        inTree->SetBranchStatus((inputTypeString+"_phi").c_str(),1);
-        inTree->SetBranchStatus((inputTypeString+"_m").c_str(),1);
+        const std::string& jetTypeString   = level->jetTypeString;
+        const std::string& inputTypeString = level->inputTypeString;
+        if (!stepNum || stepNum >= 2)
+        {
+            inTree->SetBranchStatus((jetTypeString+"_R10_pt").c_str(),1);
+            inTree->SetBranchStatus((jetTypeString+"_R10_m").c_str(),1);
+            inTree->SetBranchStatus((jetTypeString+"_R10_Trimmed_pt").c_str(),1);
+            inTree->SetBranchStatus((jetTypeString+"_R10_Trimmed_m").c_str(),1);
+
+            inTree->SetBranchAddress((jetTypeString+"_R10_pt").c_str(),&level->jet_R10_ungroom_pt);
+            inTree->SetBranchAddress((jetTypeString+"_R10_m").c_str(), &level->jet_R10_ungroom_m);
+            inTree->SetBranchAddress((jetTypeString+"_R10_Trimmed_pt").c_str(),&level->jet_R10_trimmed_pt);
+            inTree->SetBranchAddress((jetTypeString+"_R10_Trimmed_m").c_str(), &level->jet_R10_trimmed_m);
+        }
 
-        inTree->SetBranchAddress((inputTypeString+"_pt").c_str(), &cluster_pt);
-        inTree->SetBranchAddress((inputTypeString+"_eta").c_str(),&cluster_eta);
-        inTree->SetBranchAddress((inputTypeString+"_phi").c_str(),&cluster_phi);
-        inTree->SetBranchAddress((inputTypeString+"_m").c_str(),  &cluster_m);
+        // Step 3: Building our own R=1.0 jets from topoclusters
+        if ((!stepNum || stepNum >= 3) && doClusterJets)
+        {
+            inTree->SetBranchStatus((inputTypeString+"_pt").c_str(),1);
+            inTree->SetBranchStatus((inputTypeString+"_eta").c_str(),1);
+            inTree->SetBranchStatus((inputTypeString+"_phi").c_str(),1);
+            inTree->SetBranchStatus((inputTypeString+"_m").c_str(),1);
+
+            inTree->SetBranchAddress((inputTypeString+"_pt").c_str(), &level->cluster_pt);
+            inTree->SetBranchAddress((inputTypeString+"_eta").c_str(),&level->cluster_eta);
+            inTree->SetBranchAddress((inputTypeString+"_phi").c_str(),&level->cluster_phi);
+            inTree->SetBranchAddress((inputTypeString+"_m").c_str(),  &level->cluster_m);
+        }
+
+        // Step 3, reclustering: the existing R=0.4 jets
+        if ((!stepNum || stepNum >= 3) && doRecluster)
+        {
+            inTree->SetBranchStatus((jetTypeString+"_R4_pt").c_str(), 1);
+            inTree->SetBranchStatus((jetTypeString+"_R4_eta").c_str(),1);
+            inTree->SetBranchStatus((jetTypeString+"_R4_phi").c_str(),1);
+            inTree->SetBranchStatus((jetTypeString+"_R4_m").c_str(),  1);
+
+            inTree->SetBranchAddress((jetTypeString+"_R4_pt").c_str(), &level->jet_R4_pt);
+            inTree->SetBranchAddress((jetTypeString+"_R4_eta").c_str(),&level->jet_R4_eta);
+            inTree->SetBranchAddress((jetTypeString+"_R4_phi").c_str(),&level->jet_R4_phi);
+            inTree->SetBranchAddress((jetTypeString+"_R4_m").c_str(),  &level->jet_R4_m);
+        }
     }
 
     // Step 4: Building other types of R=1.0 jets from topoclusters
@@ -145,62 +604,237 @@ int main (int argc, char* argv[])
     // Prepare the output file and histograms                 //
     ////////////////////////////////////////////////////////////
 
-    // Step 1: event-level information
+    // Step 1: event-level information, filled by the expressions of the registry
     TFile* outFile = TFile::Open(outFileName.c_str(),"RECREATE");
-    TH1I hist_mu("Step1_mu","#mu_{average}",100,0,100);
-    TH1I hist_npv("Step1_npv","NPV",50,0,50);
-
-    // Step 2: Existing jets and the event weight
-    TH1F hist_ungroom_pt_nw("Step2_UngroomPt_noweight","Leading ungroomed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
-    TH1F hist_ungroom_pt("Step2_UngroomPt","Leading ungroomed R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_trimmed_pt("Step2_TrimmedPt","Leading trimmed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+    HistRegistry histograms(stepNum);
+    typedef FastHist1D<TH1I> Hist1I;
+    histograms.book<Hist1I>(1,[&](Hist1I& hist) { hist.Fill(mu_average); },"Step1_mu","#mu_{average}",100,0,100);
+    histograms.book<Hist1I>(1,[&](Hist1I& hist) { hist.Fill(NPV); },"Step1_npv","NPV",50,0,50);
+
+    // Steps 2 to 5: the histograms of each level are booked in its registry, with the same conditions as the filling
+    typedef FastHist1D<TH1F> Hist1F;
+    typedef FastHist2D<TH2F> Hist2F;
+    typedef FastProfile1D<TProfile> Profile1F;
+    for (const std::unique_ptr<JetRecoLevel>& levelPtr : levels)
+    {
+        JetRecoLevel& level = *levelPtr;
+        HistRegistry& hists = level.histograms;
+        const bool levelAreaSub    = doAreaSub && !level.isTruth;
+        const bool levelPreClus    = doPreClus && !level.isTruth;
+        const bool levelPreClusRef = doPreClusRef && !level.isTruth;
 
-    TH1F hist_ungroom_m("Step2_UngroomMass","Leading ungroomed R=1.0 jet mass",99,10.e3,1000.e3);
-    TH1F hist_trimmed_m("Step2_TrimmedMass","Leading trimmed R=1.0 jet mass",99,10.e3,1000.e3);
+        // Step 2: Existing jets and the event weight
+        level.hist_ungroom_pt_nw = hists.book<Hist1F>(2,nullptr,"Step2_UngroomPt_noweight","Leading ungroomed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
+        level.hist_ungroom_pt = hists.book<Hist1F>(2,nullptr,"Step2_UngroomPt","Leading ungroomed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+        level.hist_trimmed_pt = hists.book<Hist1F>(2,nullptr,"Step2_TrimmedPt","Leading trimmed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+        level.hist_ungroom_m = hists.book<Hist1F>(2,nullptr,"Step2_UngroomMass","Leading ungroomed R=1.0 jet mass",99,10.e3,1000.e3);
+        level.hist_trimmed_m = hists.book<Hist1F>(2,nullptr,"Step2_TrimmedMass","Leading trimmed R=1.0 jet mass",99,10.e3,1000.e3);
 
-    // Step 3: Building our own R=1.0 jets from topoclusters
-    TH1F hist_myungroom_pt_nw("Step3_MyUngroomPt_noweight","My leading ungroomed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
-    TH1F hist_myungroom_pt("Step3_MyUngroomPt","My leading ungroomed R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_mytrimmed_pt_nw("Step3_MyTrimmedPt_noweight","My leading trimmed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
-    TH1F hist_mytrimmed_pt("Step3_MyTrimmedPt","My leading trimmed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+        // Step 3: Building our own R=1.0 jets from topoclusters
+        if (doClusterJets)
+        {
+            level.hist_myungroom_pt_nw = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomPt_noweight","My leading ungroomed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
+            level.hist_myungroom_pt = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomPt","My leading ungroomed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_mytrimmed_pt_nw = hists.book<Hist1F>(3,nullptr,"Step3_MyTrimmedPt_noweight","My leading trimmed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
+            level.hist_mytrimmed_pt = hists.book<Hist1F>(3,nullptr,"Step3_MyTrimmedPt","My leading trimmed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            if (doVarR)
+            {
+                level.hist_myvarr_pt_nw = hists.book<Hist1F>(3,nullptr,"Step3_MyVarRUngroomPt_noweight","My leading ungroomed variable-R jet p_{T}, no weights",215,50.e3,2200.e3);
+                level.hist_myvarr_pt = hists.book<Hist1F>(3,nullptr,"Step3_MyVarRUngroomPt","My leading ungroomed variable-R jet p_{T}",215,50.e3,2200.e3);
+                level.hist_myvarr_m = hists.book<Hist1F>(3,nullptr,"Step3_MyVarRUngroomMass","My leading ungroomed variable-R jet mass",99,10.e3,1000.e3);
+                level.hist_myvarr_reff = hists.book<Hist1F>(3,nullptr,"Step3_MyVarRUngroomReff","My leading ungroomed variable-R jet effective radius",50,0,1.25);
+            }
+            if (levelAreaSub || levelPreClus)
+            {
+                level.hist_myungroom_m = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomMass","My leading ungroomed R=1.0 jet mass",99,10.e3,1000.e3);
+                level.hist_myungroom_m_mu = hists.book<Profile1F>(3,nullptr,"Step3_MyUngroomMass_vs_mu","My leading ungroomed R=1.0 jet average mass vs #mu_{average}",100,0,100);
+            }
+            if (levelAreaSub)
+            {
+                level.hist_rho = hists.book<Hist1F>(3,nullptr,"Step3_Rho","Event p_{T} density #rho",100,0,50.e3);
+                level.hist_rho_mu = hists.book<Profile1F>(3,nullptr,"Step3_Rho_vs_mu","Average #rho vs #mu_{average}",100,0,100);
+                level.hist_myungroom_area = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomArea","My leading ungroomed R=1.0 jet area",50,0,5);
+                level.hist_myungroom_pt_sub = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomPt_rhoA","My leading ungroomed R=1.0 jet p_{T}, #rho#timesA subtracted",215,50.e3,2200.e3);
+                level.hist_myungroom_m_sub = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomMass_rhoA","My leading ungroomed R=1.0 jet mass, #rho#timesA subtracted",99,10.e3,1000.e3);
+                level.hist_myungroom_m_sub_mu = hists.book<Profile1F>(3,nullptr,"Step3_MyUngroomMass_rhoA_vs_mu","My leading ungroomed R=1.0 jet average mass vs #mu_{average}, #rho#timesA subtracted",100,0,100);
+            }
+            if (levelPreClus)
+            {
+                level.hist_ninputs_mu = hists.book<Profile1F>(3,nullptr,"Step3_NumInputs_vs_mu","Average number of inputs vs #mu_{average}",100,0,100);
+                level.hist_ninputs_preclus_mu = hists.book<Profile1F>(3,nullptr,"Step3_NumInputs_PreClus_vs_mu","Average number of inputs after pre-clustering vs #mu_{average}",100,0,100);
+                if (softKiller)
+                {
+                    level.hist_softkiller_ptcut = hists.book<Hist1F>(3,nullptr,"Step3_SoftKillerPtCut","SoftKiller p_{T} threshold",100,0,5.e3);
+                    level.hist_softkiller_ptcut_mu = hists.book<Profile1F>(3,nullptr,"Step3_SoftKillerPtCut_vs_mu","Average SoftKiller p_{T} threshold vs #mu_{average}",100,0,100);
+                }
+                if (constSub)
+                {
+                    level.hist_constsub_rho = hists.book<Hist1F>(3,nullptr,"Step3_ConstSubRho","Event p_{T} density #rho used for constituent subtraction",100,0,50.e3);
+                    level.hist_constsub_rho_mu = hists.book<Profile1F>(3,nullptr,"Step3_ConstSubRho_vs_mu","Average #rho used for constituent subtraction vs #mu_{average}",100,0,100);
+                }
+            }
+            if (levelPreClusRef)
+            {
+                level.hist_myungroom_pt_ref = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomPt_noPreClus","My leading ungroomed R=1.0 jet p_{T}, no pre-clustering",215,50.e3,2200.e3);
+                level.hist_myungroom_m_ref = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomMass_noPreClus","My leading ungroomed R=1.0 jet mass, no pre-clustering",99,10.e3,1000.e3);
+                level.hist_myungroom_m_ref_mu = hists.book<Profile1F>(3,nullptr,"Step3_MyUngroomMass_noPreClus_vs_mu","My leading ungroomed R=1.0 jet average mass vs #mu_{average}, no pre-clustering",100,0,100);
+                level.hist_myungroom_pt_ratio = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomPt_PreClusOverNoPreClus","My leading ungroomed R=1.0 jet p_{T}, with / without pre-clustering",100,0.5,1.5);
+                level.hist_myungroom_m_ratio = hists.book<Hist1F>(3,nullptr,"Step3_MyUngroomMass_PreClusOverNoPreClus","My leading ungroomed R=1.0 jet mass, with / without pre-clustering",100,0.5,1.5);
+                level.hist_myungroom_pt_ratio_mu = hists.book<Profile1F>(3,nullptr,"Step3_MyUngroomPt_PreClusOverNoPreClus_vs_mu","My leading ungroomed R=1.0 jet average p_{T} with / without pre-clustering vs #mu_{average}",100,0,100);
+                level.hist_myungroom_m_ratio_mu = hists.book<Profile1F>(3,nullptr,"Step3_MyUngroomMass_PreClusOverNoPreClus_vs_mu","My leading ungroomed R=1.0 jet average mass with / without pre-clustering vs #mu_{average}",100,0,100);
+            }
+        }
 
-    // Step 4: Building other types of R=1.0 jets from topoclusters
-    TH1F hist_mypruned_pt("Step4_MyPrunedPt","My leading pruned R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_mypruned_m("Step4_MyPrunedMass","My leading pruned R=1.0 jet mass",215,10.e3,1000.e3);
+        // Step 3, reclustering: R=1.0 jets built from the existing R=0.4 jets
+        if (doRecluster)
+        {
+            level.hist_myreclus_pt_nw = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusUngroomPt_noweight","My leading reclustered ungroomed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
+            level.hist_myreclus_pt = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusUngroomPt","My leading reclustered ungroomed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_myreclus_m = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusUngroomMass","My leading reclustered ungroomed R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hist_myreclustrim_pt_nw = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusTrimmedPt_noweight","My leading reclustered trimmed R=1.0 jet p_{T}, no weights",215,50.e3,2200.e3);
+            level.hist_myreclustrim_pt = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusTrimmedPt","My leading reclustered trimmed R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_myreclus_nsub = hists.book<Hist1F>(3,nullptr,"Step3_MyReclusNumSubjets","Number of R=0.4 jets in my leading reclustered R=1.0 jet",20,0,20);
+        }
 
-    TH1F hist_mySD_pt("Step4_MySDPt","My leading SD R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_mySD_m("Step4_MySDMass","My leading SD R=1.0 jet mass",99,10.e3,1000.e3);
-    
-    TH1F hist_myRSD_pt("Step4_MyRSDPt","My leading RSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_myRSD_m("Step4_MyRSDMass","My leading RSD R=1.0 jet mass",99,10.e3,1000.e3);
+        // Step 4: Building other types of R=1.0 jets from topoclusters
+        if (doClusterJets)
+        {
+            level.hist_mypruned_pt = hists.book<Hist1F>(4,nullptr,"Step4_MyPrunedPt","My leading pruned R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_mypruned_m = hists.book<Hist1F>(4,nullptr,"Step4_MyPrunedMass","My leading pruned R=1.0 jet mass",215,10.e3,1000.e3);
+            level.hist_mySD_pt = hists.book<Hist1F>(4,nullptr,"Step4_MySDPt","My leading SD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_mySD_m = hists.book<Hist1F>(4,nullptr,"Step4_MySDMass","My leading SD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hist_myRSD_pt = hists.book<Hist1F>(4,nullptr,"Step4_MyRSDPt","My leading RSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_myRSD_m = hists.book<Hist1F>(4,nullptr,"Step4_MyRSDMass","My leading RSD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hist_myBUSD_pt = hists.book<Hist1F>(4,nullptr,"Step4_MyBUSDPt","My leading BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_myBUSD_m = hists.book<Hist1F>(4,nullptr,"Step4_MyBUSDMass","My leading BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hist_myBUSDT_pt = hists.book<Hist1F>(4,nullptr,"Step4_MyBUSDTPt","My leading tight BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hist_myBUSDT_m = hists.book<Hist1F>(4,nullptr,"Step4_MyBUSDTMass","My leading tight BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+        }
 
-    TH1F hist_myBUSD_pt("Step4_MyBUSDPt","My leading BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_myBUSD_m("Step4_MyBUSDMass","My leading BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+        // Step 4, reclustering: the same groomers applied to the reclustered jets
+        if (doRecluster)
+        {
+            level.hists_reclus_groomed_pt[0] = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusPrunedPt","My leading reclustered pruned R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hists_reclus_groomed_m[0]  = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusPrunedMass","My leading reclustered pruned R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hists_reclus_groomed_pt[1] = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusSDPt","My leading reclustered SD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hists_reclus_groomed_m[1]  = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusSDMass","My leading reclustered SD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hists_reclus_groomed_pt[2] = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusRSDPt","My leading reclustered RSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hists_reclus_groomed_m[2]  = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusRSDMass","My leading reclustered RSD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hists_reclus_groomed_pt[3] = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusBUSDPt","My leading reclustered BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hists_reclus_groomed_m[3]  = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusBUSDMass","My leading reclustered BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+            level.hists_reclus_groomed_pt[4] = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusBUSDTPt","My leading reclustered tight BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
+            level.hists_reclus_groomed_m[4]  = hists.book<Hist1F>(4,nullptr,"Step4_MyReclusBUSDTMass","My leading reclustered tight BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+        }
 
-    TH1F hist_myBUSDT_pt("Step4_MyBUSDTPt","My leading tight BUSD R=1.0 jet p_{T}",215,50.e3,2200.e3);
-    TH1F hist_myBUSDT_m("Step4_MyBUSDTMass","My leading tight BUSD R=1.0 jet mass",99,10.e3,1000.e3);
+        // Step 5: Calculating substructure variables for R=1.0 jets, for all of the jet types
+        if (doClusterJets)
+        {
+            for (size_t iType = 0; iType < numJetTypes; ++iType)
+            {
+                level.hists_D2[iType]    = hists.book<Hist1F>(5,nullptr,("Step5_"+jetTypeNames[iType]+"_D2").c_str(),(jetTypeTitles[iType]+" R=1.0 jet D_{2}^{#beta=1}").c_str(),20,0,5);
+                level.hists_tau32[iType] = hists.book<Hist1F>(5,nullptr,("Step5_"+jetTypeNames[iType]+"_Tau32").c_str(),(jetTypeTitles[iType]+" R=1.0 jet #tau_{32}^{WTA}").c_str(),20,0,1);
+            }
 
-    // Step 5: Calculating substructure variables for R=1.0 jets
-    TH1F hist_ungroom_D2(   "Step5_Ungroomed_D2",   "Ungroomed R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_ungroom_tau32("Step5_Ungroomed_Tau32","Ungroomed R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+            // Angular-exponent scan: D2, N2 and M2 for every requested beta and jet type
+            for (size_t iType = 0; iType < numJetTypes; ++iType)
+                for (size_t iBeta = 0; iBeta < scanBetas.size(); ++iBeta)
+                {
+                    // Use p instead of a decimal point in the histogram names, e.g. beta0p5
+                    std::string betaName = Form("%g",scanBetas.at(iBeta));
+                    std::replace(betaName.begin(),betaName.end(),'.','p');
+                    const std::string histName  = "Step5_"+jetTypeNames[iType];
+                    const std::string histTitle = jetTypeTitles[iType]+" R=1.0 jet ";
+                    const std::string betaTitle = Form("^{#beta=%g}",scanBetas.at(iBeta));
+                    level.hists_scan_D2.push_back(hists.book<Hist1F>(5,nullptr,(histName+"_D2_beta"+betaName).c_str(),(histTitle+"D_{2}"+betaTitle).c_str(),20,0,5));
+                    level.hists_scan_N2.push_back(hists.book<Hist1F>(5,nullptr,(histName+"_N2_beta"+betaName).c_str(),(histTitle+"N_{2}"+betaTitle).c_str(),20,0,0.5));
+                    level.hists_scan_M2.push_back(hists.book<Hist1F>(5,nullptr,(histName+"_M2_beta"+betaName).c_str(),(histTitle+"M_{2}"+betaTitle).c_str(),20,0,0.25));
+                }
 
-    TH1F hist_trimmed_D2(   "Step5_Trimmed_D2",   "Trimmed R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_trimmed_tau32("Step5_Trimmed_Tau32","Trimmed R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+            // Lund plane: primary emission density for every jet type and mu bin
+            for (size_t iType = 0; iType < numJetTypes && doLund; ++iType)
+            {
+                for (size_t iMu = 0; iMu+1 < lundMuBins.size(); ++iMu)
+                {
+                    const std::string histName  = "Step5_"+jetTypeNames[iType]+Form("_LundPlane_mu%gto%g",lundMuBins.at(iMu),lundMuBins.at(iMu+1));
+                    const std::string histTitle = jetTypeTitles[iType]+" R=1.0 jet primary Lund plane"+Form(", %g < #mu_{average} < %g",lundMuBins.at(iMu),lundMuBins.at(iMu+1));
+                    level.hists_lund.push_back(hists.book<Hist2F>(5,nullptr,histName.c_str(),(histTitle+";ln(1/#DeltaR);ln(k_{t}/GeV)").c_str(),60,0,6,50,-3,7));
+                }
+                // Number of jets per mu bin, to normalise the Lund-plane densities
+                level.hists_lund_jets.push_back(hists.book<Hist1F>(5,nullptr,("Step5_"+jetTypeNames[iType]+"_LundPlane_NumJets").c_str(),(jetTypeTitles[iType]+" R=1.0 jets in the Lund plane;#mu_{average}").c_str(),lundMuBins.size()-1,lundMuBins.data()));
+            }
 
-    TH1F hist_pruned_D2(   "Step5_Pruned_D2",   "Pruned R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_pruned_tau32("Step5_Pruned_Tau32","Pruned R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+            // Constituent truncation: difference between the truncated and full calculation
+            if (doTruncate && truncValidate > 0)
+            {
+                level.hist_trunc_D2_bias = hists.book<Hist1F>(5,nullptr,"Step5_Truncation_D2_bias","R=1.0 jet D_{2}^{#beta=1}, truncated - full",100,-1,1);
+                level.hist_trunc_tau32_bias = hists.book<Hist1F>(5,nullptr,"Step5_Truncation_Tau32_bias","R=1.0 jet #tau_{32}^{WTA}, truncated - full",100,-0.5,0.5);
+                level.hist_trunc_kept = hists.book<Hist1F>(5,nullptr,"Step5_Truncation_KeptFraction","Fraction of R=1.0 jet constituents kept after truncation",50,0,1);
+            }
+        }
 
-    TH1F hist_SD_D2(   "Step5_SD_D2",   "SD R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_SD_tau32("Step5_SD_Tau32","SD R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+        // All-jets mode: the ungroomed jets come from step 3 and the groomed jets from step 4
+        if (doAllJets)
+        {
+            level.hist_alljets_num = hists.book<Hist1F>(3,nullptr,"Step3_AllJets_Multiplicity","Number of R=1.0 jets above the all-jets p_{T} threshold",20,0,20);
+            for (size_t iType = 0; iType < numJetTypes; ++iType)
+            {
+                const std::string histName  = std::string(iType ? "Step4" : "Step3")+"_AllJets_"+jetTypeNames[iType];
+                const std::string histTitle = "All "+jetTypeTitles[iType]+" R=1.0 jets ";
+                level.hists_alljets_pt.push_back(hists.book<Hist1F>(iType ? 4 : 3,nullptr,(histName+"_Pt").c_str(),(histTitle+"p_{T}").c_str(),215,50.e3,2200.e3));
+                level.hists_alljets_m.push_back(hists.book<Hist1F>(iType ? 4 : 3,nullptr,(histName+"_Mass").c_str(),(histTitle+"mass").c_str(),99,10.e3,1000.e3));
+                level.hists_alljets_D2.push_back(hists.book<Hist1F>(5,nullptr,("Step5_AllJets_"+jetTypeNames[iType]+"_D2").c_str(),(histTitle+"D_{2}^{#beta=1}").c_str(),20,0,5));
+                level.hists_alljets_tau32.push_back(hists.book<Hist1F>(5,nullptr,("Step5_AllJets_"+jetTypeNames[iType]+"_Tau32").c_str(),(histTitle+"#tau_{32}^{WTA}").c_str(),20,0,1));
+            }
+        }
+    }
 
-    TH1F hist_RSD_D2(   "Step5_RSD_D2",   "RSD R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_RSD_tau32("Step5_RSD_Tau32","RSD R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+    // Output directories of the levels
+    for (const std::unique_ptr<JetRecoLevel>& level : levels)
+    {
+        level->outDir = level->isTruth && levels.size() > 1 ? outFile->mkdir(level->name.c_str()) : outFile;
 
-    TH1F hist_BUSD_D2(   "Step5_BUSD_D2",   "BUSD R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_BUSD_tau32("Step5_BUSD_Tau32","BUSD R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+        // All-jets mode: the jet-level tree is written to the level directory as it fills
+        if (doJetTree)
+        {
+            level->outDir->cd();
+            level->jetTree = new TTree("JetTree",(level->name+" R=1.0 jets above the all-jets p_{T} threshold").c_str());
+            level->jetTree->Branch("event",&level->tree_event,"event/L");
+            level->jetTree->Branch("rank",&level->tree_rank,"rank/I");
+            level->jetTree->Branch("weight",&level->tree_weight,"weight/F");
+            level->jetTree->Branch("mu",&level->tree_mu,"mu/F");
+            for (size_t iType = 0; iType < numJetTypes; ++iType)
+            {
+                const std::string branchName = jetTypeNames[iType];
+                level->jetTree->Branch((branchName+"_pt").c_str(),&level->tree_pt[iType],(branchName+"_pt/F").c_str());
+                level->jetTree->Branch((branchName+"_m").c_str(),&level->tree_m[iType],(branchName+"_m/F").c_str());
+                level->jetTree->Branch((branchName+"_D2").c_str(),&level->tree_D2[iType],(branchName+"_D2/F").c_str());
+                level->jetTree->Branch((branchName+"_tau32").c_str(),&level->tree_tau32[iType],(branchName+"_tau32/F").c_str());
+            }
+        }
+    }
+    outFile->cd();
 
-    TH1F hist_BUSDT_D2(   "Step5_BUSDT_D2",   "Tight BUSD R=1.0 jet D_{2}^{#beta=1}",20,0,5);
-    TH1F hist_BUSDT_tau32("Step5_BUSDT_Tau32","Tight BUSD R=1.0 jet #tau_{32}^{WTA}",20,0,1);
+    // Step 6: Truth-reco response of matched R=1.0 jets, per jet type, variable and truth jet pT bin
+    const std::vector<double> responsePtBins = {200.e3,400.e3,600.e3,1000.e3,2000.e3};
+    const size_t numResponseVars = 4;
+    const std::string responseVarNames[numResponseVars]  = {"Pt","Mass","D2","Tau32"};
+    const std::string responseVarTitles[numResponseVars] = {"p_{T}","mass","D_{2}^{#beta=1}","#tau_{32}^{WTA}"};
+    std::vector<FastHist1D<TH1F>*> hists_response;
+    FastHist1D<TH1F>* hist_match_dR         = nullptr;
+    FastProfile1D<TProfile>* hist_match_eff = nullptr;
+    if (doResponse)
+    {
+        for (size_t iType = 0; iType < numJetTypes; ++iType)
+            for (size_t iBin = 0; iBin+1 < responsePtBins.size(); ++iBin)
+                for (size_t iVar = 0; iVar < numResponseVars; ++iVar)
+                {
+                    const std::string histName  = "Step6_"+jetTypeNames[iType]+"_"+responseVarNames[iVar]+"Response"+Form("_pt%.0fto%.0f",responsePtBins.at(iBin)/1.e3,responsePtBins.at(iBin+1)/1.e3);
+                    const std::string histTitle = jetTypeTitles[iType]+" R=1.0 jet "+responseVarTitles[iVar]+" reco / truth"+Form(", %.0f < p_{T}^{truth} < %.0f GeV",responsePtBins.at(iBin)/1.e3,responsePtBins.at(iBin+1)/1.e3);
+                    hists_response.push_back(histograms.book<FastHist1D<TH1F>>(6,nullptr,histName.c_str(),histTitle.c_str(),100,0,2));
+                }
+        hist_match_dR  = histograms.book<FastHist1D<TH1F>>(6,nullptr,"Step6_MatchDeltaR","#DeltaR between matched truth and reco R=1.0 jets",50,0,matchDR);
+        hist_match_eff = histograms.book<FastProfile1D<TProfile>>(6,nullptr,"Step6_MatchEfficiency_vs_TruthPt","Fraction of truth R=1.0 jets matched to a reco jet vs truth p_{T}",responsePtBins.size()-1,responsePtBins.data());
+    }
 
 
     ////////////////////////////////////////////////////////////
@@ -217,225 +851,851 @@ int main (int argc, char* argv[])
     // TODO: add tools here (jet reconstruction and trimming)
     fastjet::JetDefinition akt10(fastjet::antikt_algorithm,1.0);
     fastjet::Transformer *trimmer = new fastjet::Filter(fastjet::JetDefinition(fastjet::kt_algorithm, 0.2), fastjet::SelectorPtFractionMin(0.05) );
+
+    // Variable-R anti-kt jets, clustered with the same nearest-neighbour strategy choice as akt10
+    fastjet::contrib::VariableRPlugin varRPlugin(varRRho,varRMin,varRMax,fastjet::contrib::VariableRPlugin::AKTLIKE,false,fastjet::contrib::VariableRPlugin::Best);
+    fastjet::JetDefinition varRDef(&varRPlugin);
+
+    // Pileup subtraction: rho is the median pT/area of a fixed rapidity-phi grid of the inputs, so no
+    // kt clustering with ghosts is needed, and the jet areas come either from the Voronoi cells of the
+    // constituents (no ghosts at all) or from the active area with implicit ghosts for comparison
+    fastjet::GridMedianBackgroundEstimator rhoEstimator(rhoYMax,rhoGrid);
+    fastjet::Subtractor rhoSubtractor(&rhoEstimator);
+    const fastjet::AreaDefinition areaDef = areaType == "active" ? fastjet::AreaDefinition(fastjet::active_area,fastjet::GhostedAreaSpec(4.5))
+                                                                 : fastjet::AreaDefinition(fastjet::VoronoiAreaSpec(1.0));
     
     
     // Step 4: Building other types of R=1.0 jets from topoclusters
-    // TODO: add tools here (Pruning, SoftDrop, Recursive SoftDrop, and Bottom-Up SoftDrop)
+    fastjet::Pruner pruner(fastjet::cambridge_algorithm,0.1,0.5);
+    fastjet::contrib::SoftDrop sd(2,0.1,1.0);
+    fastjet::contrib::RecursiveSoftDrop rsd(2,0.1,-1,1.0);
+    fastjet::contrib::BottomUpSoftDrop busd(2,0.1,1.0);
+    fastjet::contrib::BottomUpSoftDrop busdt(0.5,0.1,1.0);
+    const fastjet::Transformer* reclusGroomers[numReclusGroomers] = {&pruner,&sd,&rsd,&busd,&busdt};
     
     // Step 5: Calculating substructure variables for R=1.0 jets
-    // TODO: add tools here (Energy correlators and N subjettiness)
-    
-
-    ////////////////////////////////////////////////////////////
-    // Run over the events in the file and reconstruct jets   //
-    ////////////////////////////////////////////////////////////
-
-    const long long int numEvents = inTree->GetEntries();
-    for (long long iEvent = 0; iEvent < numEvents; ++iEvent)
+    // The fast ECFs give the same values as fastjet::contrib::EnergyCorrelator with the pt_R measure
+    FastECF fastECF(1.0);
+    fastjet::contrib::EnergyCorrelator ECF1(1,1.0,fastjet::contrib::EnergyCorrelator::pt_R);
+    fastjet::contrib::EnergyCorrelator ECF2(2,1.0,fastjet::contrib::EnergyCorrelator::pt_R);
+    fastjet::contrib::EnergyCorrelator ECF3(3,1.0,fastjet::contrib::EnergyCorrelator::pt_R);
+    fastjet::contrib::Nsubjettiness tau2(2,fastjet::contrib::OnePass_WTA_KT_Axes(),fastjet::contrib::UnnormalizedMeasure(1.0));
+    fastjet::contrib::Nsubjettiness tau3(3,fastjet::contrib::OnePass_WTA_KT_Axes(),fastjet::contrib::UnnormalizedMeasure(1.0));
+    NsubjettinessCache nsubCache(3,1.0,nsubReuse);
+    if ((!stepNum || stepNum >= 5) && doClusterJets && useFastECF)
+        printf("Using fast energy correlators with the %s kernel\n",fastECF.isaName());
+
+    // All requested angular exponents are evaluated together from one pair-distance table per jet
+    // When beta=1 is among them, D2 is taken from the scan instead of from a second pass over the jet
+    ECFScan ecfScan(scanBetas);
+    const size_t scanBetaOne = std::find(scanBetas.begin(),scanBetas.end(),1.0)-scanBetas.begin();
+
+    // Primary Lund-plane emissions, reusing the C/A cluster sequence of jets groomed with SoftDrop
+    LundPlane lundPlane;
+
+    // Cross-check of the fast ECFs against fastjet::contrib
+    long long numECFChecked   = 0;
+    long long numECFFailed    = 0;
+    double maxECFRelativeDiff = 0;
+
+    // Cross-check of tau32 from the reused N-subjettiness axes against fastjet::contrib
+    long long numNsubChecked  = 0;
+    long long numNsubFailed   = 0;
+    double sumNsubDiff        = 0;
+    double maxNsubDiff        = 0;
+
+    // Truncation validation: validated jets and the time to calculate their substructure with and without truncation
+    long long numTruncValidated = 0;
+    TStopwatch timeTruncKept;
+    TStopwatch timeTruncFull;
+    timeTruncKept.Reset();
+    timeTruncFull.Reset();
+
+    // D2 of a jet with the chosen energy correlators, negative if it is not defined
+    // Only the calculations with crossCheck set count towards the ecfcheck cross-checks
+    // The fast beta=1 ECFs of the jet can be passed in when they were already calculated by the scan
+    auto computeD2 = [&](const fastjet::PseudoJet& jet, const bool crossCheck = true, const ECFScanValues* scanned = nullptr)
     {
-        // Print out the even number every 10k events and then load the event
-        if (iEvent%10000 == 0)
-            printf("Processing event %lld/%lld\n",iEvent,numEvents);
-	    printf(stepNum);
-        inTree->GetEntry(iEvent);
-
+        ECFValues ecfs = {0,0,0};
+        if (useFastECF)
+            ecfs = scanned ? ECFValues{scanned->ecf1,scanned->ecf2,scanned->ecf3} : fastECF(jet);
+        if (!useFastECF || (crossCheck && numECFChecked < ecfChecks))
+        {
+            const ECFValues ecfsContrib = {ECF1(jet),ECF2(jet),ECF3(jet)};
+            if (useFastECF)
+            {
+                const double diffs[3] = {fabs(ecfs.ecf1-ecfsContrib.ecf1)/ecfsContrib.ecf1,
+                                         ecfsContrib.ecf2 ? fabs(ecfs.ecf2-ecfsContrib.ecf2)/ecfsContrib.ecf2 : fabs(ecfs.ecf2),
+                                         ecfsContrib.ecf3 ? fabs(ecfs.ecf3-ecfsContrib.ecf3)/ecfsContrib.ecf3 : fabs(ecfs.ecf3)};
+                const double maxDiff = std::max(diffs[0],std::max(diffs[1],diffs[2]));
+                maxECFRelativeDiff = std::max(maxECFRelativeDiff,maxDiff);
+                if (maxDiff > 1.e-6) ++numECFFailed;
+                ++numECFChecked;
+            }
+            ecfs = ecfsContrib;
+        }
+        return ecfs.ecf2 > 0 ? FastECF::D2(ecfs) : -1.;
+    };
 
+    // tau32 of a jet with the chosen N-subjettiness implementation, negative if it is not defined
+    auto computeTau32 = [&](const fastjet::PseudoJet& jet)
+    {
+        double tau2val = 0;
+        double tau3val = 0;
+        if (useNsubCache)
+        {
+            const std::vector<double>& taus = nsubCache(jet);
+            tau2val = taus.at(1);
+            tau3val = taus.at(2);
 
-        // Step 1: event-level information
-        // Histograms to fill:
-        //  hist_mu:  mu distribution
-        //  hist_npv: npv distribution
-        if (!stepNum || stepNum >= 1)
+            // The reused seeds can lead to a different minimum, so the checked jets use the contrib values
+            if (nsubCache.lastReused() && numNsubChecked < nsubChecks)
+            {
+                const double tau2contrib = tau2(jet);
+                const double tau3contrib = tau3(jet);
+                const double diff = fabs((tau2val > 0 ? tau3val/tau2val : -1.) - (tau2contrib > 0 ? tau3contrib/tau2contrib : -1.));
+                sumNsubDiff += diff;
+                maxNsubDiff  = std::max(maxNsubDiff,diff);
+                if (diff > 1.e-3) ++numNsubFailed;
+                ++numNsubChecked;
+                tau2val = tau2contrib;
+                tau3val = tau3contrib;
+            }
+        }
+        else
         {
-		hist_mu.Fill(mu_average);
-		hist_npv.Fill(NPV);
+            tau2val = tau2(jet);
+            tau3val = tau3(jet);
         }
+        return tau2val > 0 ? tau3val/tau2val : -1.;
+    };
+    
 
+    // All-jets mode: groom and measure the collected jets of one level
+    // Each groomer is run over all jets of the batch before the next one, and the substructure of all
+    // jet types of one jet is calculated together so the N-subjettiness axes can be reused
+    // Like the event loop, it is instantiated for the highest enabled step.  The CPU time per jet
+    // is printed at the end, and allbatch=0 runs the same code on one jet at a time for comparison
+    const fastjet::Transformer* allJetsGroomers[numJetTypes] = {nullptr,trimmer,&pruner,&sd,&rsd,&busd,&busdt};
+    auto processJetBatch = [&](JetRecoLevel& level, auto maxStep)
+    {
+        constexpr int MaxStep = decltype(maxStep)::value;
+        constexpr size_t numTypes = MaxStep >= 4 ? numJetTypes : 1;
+        const size_t numJets = level.batchJets.size();
+        level.timeAllJets.Start(false);
+        level.numAllJets += numJets;
+        for (size_t iType = 0; iType < numJetTypes; ++iType)
+        {
+            std::vector<fastjet::PseudoJet>& groomed = level.batchGroomed[iType];
+            groomed.resize(numJets);
+            if (iType >= numTypes)
+                continue;
+            for (size_t iJet = 0; iJet < numJets; ++iJet)
+                groomed[iJet] = iType ? (*allJetsGroomers[iType])(level.batchJets[iJet].jet) : level.batchJets[iJet].jet;
+        }
 
-
-        // Step 2: Existing jets and the event weight
-        // Histograms to fill:
-        //  hist_ungroom_pt_nw: Leading ungroomed R=1.0 jet pT, without the event weight
-        //  hist_ungroom_pt:    Leading ungroomed R=1.0 jet pT, with the event weight
-        //  hist_trimmed_pt:    Leading trimmed R=1.0 jet pT, with the event weight
-        //  hist_ungroom_m:     Leading ungroomed R=1.0 jet mass, with the event weight
-        //  hist_trimmed_m:     Leading trimmed R=1.0 jet mass, with the event weight
-        if (!stepNum || stepNum >= 2)
+        for (size_t iJet = 0; iJet < numJets; ++iJet)
         {
-           if (jet_R10_ungroom_pt->size())
+            const JetRecoLevel::BatchJet& batchJet = level.batchJets[iJet];
+
+            fastjet::PseudoJet substructureJets[numJetTypes];
+            if constexpr (MaxStep >= 5)
             {
-                hist_ungroom_pt_nw.Fill(jet_R10_ungroom_pt->at(0));
-                hist_ungroom_pt.Fill(jet_R10_ungroom_pt->at(0),EventWeight);
-                hist_trimmed_pt.Fill(jet_R10_trimmed_pt->at(0),EventWeight);
-                
-                if (jet_R10_ungroom_pt->at(0) > 400.e3)
-                    hist_ungroom_m.Fill(jet_R10_ungroom_m->at(0),EventWeight);
-                if (jet_R10_trimmed_pt->at(0) > 400.e3)
-                    hist_trimmed_m.Fill(jet_R10_trimmed_m->at(0),EventWeight);
+                for (size_t iType = 0; iType < numTypes; ++iType)
+                    substructureJets[iType] = doTruncate ? truncateConstituents(level.batchGroomed[iType][iJet],truncFrac,truncTopK) : level.batchGroomed[iType][iJet];
+                if (useNsubCache)
+                    nsubCache.setReference(substructureJets[0]);
             }
-        }
 
-        // Step 3: Building our own R=1.0 jets from topoclusters
-        // Histograms to fill:
-        //  hist_myungroom_pt_nw: Leading rebuilt ungroomed R=1.0 jet pT, without the event weight
-        //  hist_myungroom_pt:    Leading rebuilt ungroomed R=1.0 jet pT, with the event weight
-        //  hist_mytrimmed_pt_nw: Leading rebuilt trimmed R=1.0 jet pT, without the event weight
-        //  hist_mytrimmed_pt:    Leading rebuilt trimmed R=1.0 jet pT, with the event weight
-        if (!stepNum || stepNum >= 3)
-        {
-            // TODO convert the input objects (clusters) to pseudojets, then use them to build R=1.0 ungroomed and trimmed jets, for comparison to the pre-built jets in step 2
-            // TODO convert the input objects (clusters) to pseudojets, then use them to build R=1.0 ungroomed and trimmed jets, for comparison to the pre-built jets in step 2
-            // Convert the clusters into FastJet's four-vector (PseudoJet)
-            std::vector<fastjet::PseudoJet> clusters;
-            clusters.reserve(cluster_pt->size());
-            for (size_t iClus = 0; iClus < cluster_pt->size(); ++iClus)
+            for (size_t iType = 0; iType < numJetTypes; ++iType)
             {
-                TLorentzVector cluster;
-                cluster.SetPtEtaPhiM(cluster_pt->at(iClus),cluster_eta->at(iClus),cluster_phi->at(iClus),cluster_m->at(iClus));
-                clusters.push_back(fastjet::PseudoJet(cluster.Px(),cluster.Py(),cluster.Pz(),cluster.E()));
-		printf(cluster_pt->at(iClus));
+                level.tree_pt[iType] = level.tree_m[iType] = level.tree_D2[iType] = level.tree_tau32[iType] = -1;
+                if (iType >= numTypes)
+                    continue;
+                const fastjet::PseudoJet& jet = level.batchGroomed[iType][iJet];
+                level.tree_pt[iType] = jet.pt();
+                level.tree_m[iType]  = jet.m();
+                level.hists_alljets_pt.at(iType)->Fill(jet.pt(),batchJet.weight);
+                level.hists_alljets_m.at(iType)->Fill(jet.m(),batchJet.weight);
+
+                if constexpr (MaxStep >= 5)
+                {
+                    level.tree_D2[iType]    = computeD2(substructureJets[iType]);
+                    level.tree_tau32[iType] = computeTau32(substructureJets[iType]);
+                    if (level.tree_D2[iType] >= 0)
+                        level.hists_alljets_D2.at(iType)->Fill(level.tree_D2[iType],batchJet.weight);
+                    if (level.tree_tau32[iType] >= 0)
+                        level.hists_alljets_tau32.at(iType)->Fill(level.tree_tau32[iType],batchJet.weight);
+                }
             }
 
-            // Use fastjet to build new jets
-            fastjet::ClusterSequence cs_a10_clusters(clusters,akt10);
-            std::vector<fastjet::PseudoJet> jets_a10_clusters = fastjet::sorted_by_pt(cs_a10_clusters.inclusive_jets());
-            
-            // Use these jets and compare to the original jets
-            if (jets_a10_clusters.size())
+            if (level.jetTree)
             {
-                // Trim the jet
-                const fastjet::PseudoJet& ungroomed = jets_a10_clusters.at(0);
-                fastjet::PseudoJet trimmed = (*trimmer)(ungroomed);
-		
-                // Jet pT distribution
-                hist_myungroom_pt_nw.Fill(ungroomed.pt());
-                hist_myungroom_pt.Fill(ungroomed.pt(),EventWeight);
-                hist_mytrimmed_pt_nw.Fill(trimmed.pt());
-                hist_mytrimmed_pt.Fill(trimmed.pt(),EventWeight);
+                level.tree_event  = batchJet.event;
+                level.tree_rank   = batchJet.rank;
+                level.tree_weight = batchJet.weight;
+                level.tree_mu     = batchJet.mu;
+                level.jetTree->Fill();
             }
+        }
 
+        // The groomed jets must go before the cluster sequences they may refer to
+        for (size_t iType = 0; iType < numJetTypes; ++iType)
+            level.batchGroomed[iType].clear();
+        level.batchJets.clear();
+        level.batchSequences.clear();
+        level.timeAllJets.Stop();
+    };
 
-            // Step 4: Building other types of R=1.0 jets from topoclusters
-            // Histograms to fill:
-            //  hist_mypruned_pt: Leading Pruned R=1.0 jet pT, with the event weight
-            //  hist_mypruned_m:  Leading Pruned R=1.0 jet mass, with the event weight
-            //  hist_mySD_pt:     Leading SoftDrop R=1.0 jet pT, with the event weight
-            //  hist_mySD_m:      Leading SoftDrop R=1.0 jet pT, with the event weight
-            //  hist_myRSD_pt:    Leading Recursive SoftDrop R=1.0 jet pT, with the event weight
-            //  hist_myRSD_m:     Leading Recursive SoftDrop R=1.0 jet mass, with the event weight
-            //  hist_myBUSD_pt:   Leading Bottom-Up SoftDrop R=1.0 jet pT, with the event weight
-            //  hist_myBUSD_m:    Leading Bottom-Up SoftDrop R=1.0 jet mass, with the event weight
-            //  hist_myBUSDT_pt:  Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet pT, with the event weight
-            //  hist_myBUSDT_m:   Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet mass, with the event weight
-            if (!stepNum || stepNum >= 4)
-            {
-                // TODO groom the rebuilt ungroomed R=1.0 jets in a variety of ways and store the pT and mass
-                // Only fill the mass histograms when jet pT > 400 GeV
+    // Step 6: pT, mass, D2 and tau32 of every jet type built from an ungroomed jet
+    auto computeResponseValues = [&](const fastjet::PseudoJet& ungroomed, double values[numJetTypes][numResponseVars])
+    {
+        const fastjet::PseudoJet jets[numJetTypes] = {ungroomed,(*trimmer)(ungroomed),pruner(ungroomed),sd(ungroomed),rsd(ungroomed),busd(ungroomed),busdt(ungroomed)};
+        if (useNsubCache)
+            nsubCache.setReference(ungroomed);
+        for (size_t iType = 0; iType < numJetTypes; ++iType)
+        {
+            values[iType][0] = jets[iType].pt();
+            values[iType][1] = jets[iType].m();
+            values[iType][2] = computeD2(jets[iType]);
+            values[iType][3] = computeTau32(jets[iType]);
+        }
+    };
+
+    // Step 6: truth jets are matched to the reco jets through an eta-phi grid of the reco jets
+    JetMatcher responseMatcher(matchDR);
+    std::vector<double> truthJetEta, truthJetPhi, recoJetEta, recoJetPhi;
+    std::vector<const fastjet::PseudoJet*> truthJets;
+
+    // Pre-clustering bookkeeping: summed number of inputs before and after the stages
+    long long numInputsTotal   = 0;
+    long long numInputsPreClus = 0;
 
 
 
-                // Step 5: Calculating substructure variables for R=1.0 jets
-                // Histograms to fill:
-                //  hist_ungroom_D2:    Leading rebuilt ungroomed R=1.0 jet D2, with the event weight
-                //  hist_ungroom_tau32: Leading rebuilt ungroomed R=1.0 jet tau32, with the event weight
-                //  hist_trimmed_D2:    Leading rebuilt trimmed R=1.0 jet D2, with the event weight
-                //  hist_trimmed_tau32: Leading rebuilt trimmed R=1.0 jet tau32, with the event weight
-                //  hist_pruned_D2:     Leading Pruned R=1.0 jet D2, with the event weight
-                //  hist_pruned_tau32:  Leading Pruned R=1.0 jet tau32, with the event weight
-                //  hist_mySD_D2:       Leading SoftDrop R=1.0 jet D2, with the event weight
-                //  hist_mySD_tau32:    Leading SoftDrop R=1.0 jet tau32, with the event weight
-                //  hist_myRSD_D2:      Leading Recursive SoftDrop R=1.0 jet D2, with the event weight
-                //  hist_myRSD_tau32:   Leading Recursive SoftDrop R=1.0 jet tau32, with the event weight
-                //  hist_myBUSD_D2:     Leading Bottom-Up SoftDrop R=1.0 jet D2, with the event weight
-                //  hist_myBUSD_tau32:  Leading Bottom-Up SoftDrop R=1.0 jet tau32, with the event weight
-                //  hist_myBUSDT_D2:    Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet D2, with the event weight
-                //  hist_myBUSDT_tau32: Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet tau32, with the event weight
-                if (!stepNum || stepNum >= 5)
-                {
-                    // TODO calculate substructure variables for all of the jet types
-                    // Only fill the histograms when jet pT > 400 GeV
-                    // Recall that D2 = ECF3 * ECF1^3 / ECF2^3
-                    // Recall that tau32 = tau3 / tau2
-                }
-            }
-        }
-    }
-    
     ////////////////////////////////////////////////////////////
-    // Save the results to the output file                    //
+    // Run over the events in the file and reconstruct jets   //
     ////////////////////////////////////////////////////////////
 
-    outFile->cd();
+    const long long int numEvents = inTree->GetEntries();
 
-    // Step 1: event-level information
-    if (!stepNum || stepNum >= 1)
+    // Truth jets are read from the cache if it exists for this input, otherwise they are recorded
+    // The key identifies the input file, the tree, the jet definition and the number of events
+    std::unique_ptr<TruthJetCache> truthCache;
+    bool recordTruthCache = false;
+    double truthCachePtMin = std::numeric_limits<double>::max();
+    if (!truthCacheDir.empty() && levelType != "reco" && (!stepNum || stepNum >= 3) && doClusterJets)
     {
-        hist_mu.Write();
-        hist_npv.Write();
+        char* path = realpath(inFileName.c_str(),nullptr);
+        std::string key = path ? path : inFileName;
+        free(path);
+        struct stat info;
+        if (!stat(inFileName.c_str(),&info))
+            key += Form(" size=%lld mtime=%lld",static_cast<long long>(info.st_size),static_cast<long long>(info.st_mtime));
+        key += " tree="+inTreeName+" jets="+akt10.description()+Form(" events=%lld",numEvents);
+
+        truthCache.reset(new TruthJetCache(truthCacheDir,key));
+        recordTruthCache = !truthCache->load();
+
+        // Jets which are groomed need a clustering history, so they are reclustered from the cache:
+        // the leading jet, and the jets of the all-jets mode and of the step 6 response
+        if (doAllJets)
+            truthCachePtMin = std::min(truthCachePtMin,allJetsPtMin);
+        if (doResponse)
+            truthCachePtMin = std::min(truthCachePtMin,responsePtBins.front());
+        printf("%s truth jets %s %s\n",recordTruthCache ? "Caching" : "Using cached",recordTruthCache ? "in" : "from",truthCache->fileName().c_str());
     }
 
-    // Step 2: Existing jets and the event weight
-    if (!stepNum || stepNum >= 2)
+    // The loop is instantiated for the highest enabled step, so the checks of the later steps
+    // are resolved at compile time, and the choice is made once below
+    auto eventLoop = [&](auto maxStep)
     {
-        hist_ungroom_pt_nw.Write();
-        hist_ungroom_pt.Write();
-        hist_trimmed_pt.Write();
+        constexpr int MaxStep = decltype(maxStep)::value;
+        for (long long iEvent = 0; iEvent < numEvents; ++iEvent)
+        {
+            // Print out the even number every 10k events and then load the event
+            if (iEvent%10000 == 0)
+                printf("Processing event %lld/%lld\n",iEvent,numEvents);
+            inTree->GetEntry(iEvent);
 
-        hist_ungroom_m.Write();
-        hist_trimmed_m.Write();
-    }
 
-    // Step 3: Building our own R=1.0 jets from topoclusters
-    if (!stepNum || stepNum >= 3)
-    {
-        hist_myungroom_pt_nw.Write();
-        hist_myungroom_pt.Write();
-        hist_mytrimmed_pt_nw.Write();
-        hist_mytrimmed_pt.Write();
-    }
 
-    // Step 4: Building other types of R=1.0 jets from topoclusters
-    if  (!stepNum || stepNum >= 4)
-    {
-        hist_mypruned_pt.Write();
-        hist_mypruned_m.Write();
+            // Step 1: event-level information
+            // Histograms to fill:
+            //  Step1_mu:  mu distribution
+            //  Step1_npv: npv distribution
+            // (the step 6 histograms have no fill expressions, they are filled below)
+            histograms.fill();
 
-        hist_mySD_pt.Write();
-        hist_mySD_m.Write();
 
-        hist_myRSD_pt.Write();
-        hist_myRSD_m.Write();
 
-        hist_myBUSD_pt.Write();
-        hist_myBUSD_m.Write();
+            // Steps 2 to 5 for each level, reco and/or truth
+            for (const std::unique_ptr<JetRecoLevel>& levelPtr : levels)
+            {
+                JetRecoLevel& level = *levelPtr;
+
+                // Pileup mitigation is only applied to the reco inputs
+                const bool levelAreaSub    = doAreaSub && !level.isTruth;
+                const bool levelPreClus    = doPreClus && !level.isTruth;
+                const bool levelPreClusRef = doPreClusRef && !level.isTruth;
+
+                // Step 2: Existing jets and the event weight
+                // Histograms to fill:
+                //  hist_ungroom_pt_nw: Leading ungroomed R=1.0 jet pT, without the event weight
+                //  hist_ungroom_pt:    Leading ungroomed R=1.0 jet pT, with the event weight
+                //  hist_trimmed_pt:    Leading trimmed R=1.0 jet pT, with the event weight
+                //  hist_ungroom_m:     Leading ungroomed R=1.0 jet mass, with the event weight
+                //  hist_trimmed_m:     Leading trimmed R=1.0 jet mass, with the event weight
+                if constexpr (MaxStep >= 2)
+                {
+                    if (level.jet_R10_ungroom_pt->size())
+                    {
+                        level.hist_ungroom_pt_nw->Fill(level.jet_R10_ungroom_pt->at(0));
+                        level.hist_ungroom_pt->Fill(level.jet_R10_ungroom_pt->at(0),EventWeight);
+                        level.hist_trimmed_pt->Fill(level.jet_R10_trimmed_pt->at(0),EventWeight);
+                
+                        if (level.jet_R10_ungroom_pt->at(0) > 400.e3)
+                            level.hist_ungroom_m->Fill(level.jet_R10_ungroom_m->at(0),EventWeight);
+                        if (level.jet_R10_trimmed_pt->at(0) > 400.e3)
+                            level.hist_trimmed_m->Fill(level.jet_R10_trimmed_m->at(0),EventWeight);
+                    }
+                }
+
+                // Step 3: Building our own R=1.0 jets from topoclusters
+                // Histograms to fill:
+                //  hist_myungroom_pt_nw: Leading rebuilt ungroomed R=1.0 jet pT, without the event weight
+                //  hist_myungroom_pt:    Leading rebuilt ungroomed R=1.0 jet pT, with the event weight
+                //  hist_mytrimmed_pt_nw: Leading rebuilt trimmed R=1.0 jet pT, without the event weight
+                //  hist_mytrimmed_pt:    Leading rebuilt trimmed R=1.0 jet pT, with the event weight
+                if constexpr (MaxStep >= 3)
+                {
+                    if (doClusterJets)
+                    {
+                        level.timeClusterJets.Start(false);
+
+                        // TODO convert the input objects (clusters) to pseudojets, then use them to build R=1.0 ungroomed and trimmed jets, for comparison to the pre-built jets in step 2
+                        // TODO convert the input objects (clusters) to pseudojets, then use them to build R=1.0 ungroomed and trimmed jets, for comparison to the pre-built jets in step 2
+                        // Convert the clusters into FastJet's four-vector (PseudoJet)
+                        std::vector<fastjet::PseudoJet> clusters;
+                        clusters.reserve(level.cluster_pt->size());
+                        for (size_t iClus = 0; iClus < level.cluster_pt->size(); ++iClus)
+                        {
+                            TLorentzVector cluster;
+                            cluster.SetPtEtaPhiM(level.cluster_pt->at(iClus),level.cluster_eta->at(iClus),level.cluster_phi->at(iClus),level.cluster_m->at(iClus));
+                            clusters.push_back(fastjet::PseudoJet(cluster.Px(),cluster.Py(),cluster.Pz(),cluster.E()));
+                            clusters.back().set_user_index(iClus);
+                        }
+
+                        // Optional pre-clustering stages, such as SoftKiller, applied to all inputs
+                        std::vector<fastjet::PseudoJet> rawClusters;
+                        if (levelPreClus)
+                        {
+                            numInputsTotal += clusters.size();
+                            level.hist_ninputs_mu->Fill(mu_average,clusters.size(),EventWeight);
+                            if (levelPreClusRef)
+                                rawClusters = clusters;
+                            for (const std::unique_ptr<PreClusteringStage>& stage : preClusteringStages)
+                                clusters = stage->process(clusters);
+                            numInputsPreClus += clusters.size();
+                            level.hist_ninputs_preclus_mu->Fill(mu_average,clusters.size(),EventWeight);
+                            if (softKiller)
+                            {
+                                level.hist_softkiller_ptcut->Fill(softKiller->threshold(),EventWeight);
+                                level.hist_softkiller_ptcut_mu->Fill(mu_average,softKiller->threshold(),EventWeight);
+                            }
+                            if (constSub)
+                            {
+                                level.hist_constsub_rho->Fill(constSub->rho(),EventWeight);
+                                level.hist_constsub_rho_mu->Fill(mu_average,constSub->rho(),EventWeight);
+                            }
+                        }
+
+                        // Use fastjet to build new jets, with areas if they are needed for pileup subtraction
+                        // Cached truth jets are rebuilt from their constituents instead, and the ones which
+                        // are groomed are reclustered
+                        std::shared_ptr<fastjet::ClusterSequence>& cs_a10_clusters = level.cs_a10_clusters;
+                        std::vector<fastjet::PseudoJet>& jets_a10_clusters = level.jets_a10_clusters;
+                        jets_a10_clusters.clear();
+                        cs_a10_clusters.reset();
+                        if (level.isTruth && truthCache && !recordTruthCache)
+                            jets_a10_clusters = truthCache->jets(iEvent,clusters,akt10,truthCachePtMin,cs_a10_clusters);
+                        else
+                        {
+                            if (levelAreaSub)
+                                cs_a10_clusters.reset(new fastjet::ClusterSequenceArea(clusters,akt10,areaDef));
+                            else
+                                cs_a10_clusters.reset(new fastjet::ClusterSequence(clusters,akt10));
+                            jets_a10_clusters = fastjet::sorted_by_pt(cs_a10_clusters->inclusive_jets());
+                            if (level.isTruth && recordTruthCache)
+                                truthCache->record(jets_a10_clusters);
+                        }
+                        level.timeClusterJets.Stop();
+
+                        // All-jets mode: collect the jets above the threshold to be processed with the batch
+                        if (doAllJets)
+                        {
+                            // Without batches each jet is groomed and measured as soon as it is found, for comparison
+                            int numAllJets = 0;
+                            for (size_t iJet = 0; iJet < jets_a10_clusters.size() && jets_a10_clusters.at(iJet).pt() >= allJetsPtMin; ++iJet, ++numAllJets)
+                            {
+                                level.batchJets.push_back(JetRecoLevel::BatchJet{jets_a10_clusters.at(iJet),iEvent,static_cast<int>(iJet),EventWeight,mu_average});
+                                if (!allJetsBatch)
+                                    processJetBatch(level,maxStep);
+                            }
+                            if (numAllJets && cs_a10_clusters && allJetsBatch)
+                                level.batchSequences.push_back(cs_a10_clusters);
+                            level.hist_alljets_num->Fill(numAllJets,EventWeight);
+                        }
+
+                        // Variable-R jets from the same inputs
+                        if (doVarR)
+                        {
+                            fastjet::ClusterSequence cs_varr_clusters(clusters,varRDef);
+                            std::vector<fastjet::PseudoJet> jets_varr_clusters = fastjet::sorted_by_pt(cs_varr_clusters.inclusive_jets());
+                            if (jets_varr_clusters.size())
+                            {
+                                const fastjet::PseudoJet& varRJet = jets_varr_clusters.at(0);
+                                level.hist_myvarr_pt_nw->Fill(varRJet.pt());
+                                level.hist_myvarr_pt->Fill(varRJet.pt(),EventWeight);
+                                level.hist_myvarr_reff->Fill(std::min(varRMax,std::max(varRMin,varRRho/varRJet.pt())),EventWeight);
+                                if (varRJet.pt() > 400.e3)
+                                    level.hist_myvarr_m->Fill(varRJet.m(),EventWeight);
+                            }
+                        }
+
+                        // The same jets without the pre-clustering stages, for comparison
+                        std::vector<fastjet::PseudoJet> jets_a10_ref;
+                        if (levelPreClusRef)
+                        {
+                            fastjet::ClusterSequence cs_a10_ref(rawClusters,akt10);
+                            jets_a10_ref = fastjet::sorted_by_pt(cs_a10_ref.inclusive_jets());
+                            if (jets_a10_ref.size())
+                            {
+                                const fastjet::PseudoJet& ref = jets_a10_ref.at(0);
+                                level.hist_myungroom_pt_ref->Fill(ref.pt(),EventWeight);
+                                if (ref.pt() > 400.e3)
+                                {
+                                    level.hist_myungroom_m_ref->Fill(ref.m(),EventWeight);
+                                    level.hist_myungroom_m_ref_mu->Fill(mu_average,ref.m(),EventWeight);
+                                }
+
+                                // Bias of the pre-clustered leading jet, e.g. from the tower granularity
+                                if (jets_a10_clusters.size())
+                                {
+                                    const fastjet::PseudoJet& jet = jets_a10_clusters.at(0);
+                                    level.hist_myungroom_pt_ratio->Fill(jet.pt()/ref.pt(),EventWeight);
+                                    level.hist_myungroom_pt_ratio_mu->Fill(mu_average,jet.pt()/ref.pt(),EventWeight);
+                                    if (ref.pt() > 400.e3 && ref.m() > 0)
+                                    {
+                                        level.hist_myungroom_m_ratio->Fill(jet.m()/ref.m(),EventWeight);
+                                        level.hist_myungroom_m_ratio_mu->Fill(mu_average,jet.m()/ref.m(),EventWeight);
+                                    }
+                                }
+                            }
+                        }
+
+                        // Event pT density from the same inputs
+                        if (levelAreaSub)
+                        {
+                            rhoEstimator.set_particles(clusters);
+                            level.hist_rho->Fill(rhoEstimator.rho(),EventWeight);
+                            level.hist_rho_mu->Fill(mu_average,rhoEstimator.rho(),EventWeight);
+                        }
+            
+                        // Use these jets and compare to the original jets
+                        if (jets_a10_clusters.size())
+                        {
+                            // Trim the jet
+                            const fastjet::PseudoJet& ungroomed = jets_a10_clusters.at(0);
+                            fastjet::PseudoJet trimmed = (*trimmer)(ungroomed);
+
+                            // Jet pT distribution
+                            level.hist_myungroom_pt_nw->Fill(ungroomed.pt());
+                            level.hist_myungroom_pt->Fill(ungroomed.pt(),EventWeight);
+                            level.hist_mytrimmed_pt_nw->Fill(trimmed.pt());
+                            level.hist_mytrimmed_pt->Fill(trimmed.pt(),EventWeight);
+
+                            // Jet mass, for comparison to the pileup-mitigated jets
+                            if ((levelAreaSub || levelPreClus) && ungroomed.pt() > 400.e3)
+                            {
+                                level.hist_myungroom_m->Fill(ungroomed.m(),EventWeight);
+                                level.hist_myungroom_m_mu->Fill(mu_average,ungroomed.m(),EventWeight);
+                            }
+
+                            // Jet area and rho*A subtracted kinematics
+                            if (levelAreaSub)
+                            {
+                                const fastjet::PseudoJet subtracted = rhoSubtractor(ungroomed);
+                                level.hist_myungroom_area->Fill(ungroomed.area(),EventWeight);
+                                level.hist_myungroom_pt_sub->Fill(subtracted.pt(),EventWeight);
+                                if (subtracted.pt() > 400.e3)
+                                {
+                                    level.hist_myungroom_m_sub->Fill(subtracted.m(),EventWeight);
+                                    level.hist_myungroom_m_sub_mu->Fill(mu_average,subtracted.m(),EventWeight);
+                                }
+                            }
+
+
+                            // Step 4: Building other types of R=1.0 jets from topoclusters
+                            // Histograms to fill:
+                            //  hist_mypruned_pt: Leading Pruned R=1.0 jet pT, with the event weight
+                            //  hist_mypruned_m:  Leading Pruned R=1.0 jet mass, with the event weight
+                            //  hist_mySD_pt:     Leading SoftDrop R=1.0 jet pT, with the event weight
+                            //  hist_mySD_m:      Leading SoftDrop R=1.0 jet pT, with the event weight
+                            //  hist_myRSD_pt:    Leading Recursive SoftDrop R=1.0 jet pT, with the event weight
+                            //  hist_myRSD_m:     Leading Recursive SoftDrop R=1.0 jet mass, with the event weight
+                            //  hist_myBUSD_pt:   Leading Bottom-Up SoftDrop R=1.0 jet pT, with the event weight
+                            //  hist_myBUSD_m:    Leading Bottom-Up SoftDrop R=1.0 jet mass, with the event weight
+                            //  hist_myBUSDT_pt:  Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet pT, with the event weight
+                            //  hist_myBUSDT_m:   Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet mass, with the event weight
+                            if constexpr (MaxStep >= 4)
+                            {
+                                // Groom the leading ungroomed jet in a variety of ways
+                                // Only fill the mass histograms when jet pT > 400 GeV
+                                fastjet::PseudoJet pruned = pruner(ungroomed);
+                                level.hist_mypruned_pt->Fill(pruned.pt(),EventWeight);
+                                if (pruned.pt() > 400.e3)
+                                    level.hist_mypruned_m->Fill(pruned.m(),EventWeight);
+
+                                fastjet::PseudoJet groomedSD = sd(ungroomed);
+                                level.hist_mySD_pt->Fill(groomedSD.pt(),EventWeight);
+                                if (groomedSD.pt() > 400.e3)
+                                    level.hist_mySD_m->Fill(groomedSD.m(),EventWeight);
+
+                                fastjet::PseudoJet groomedRSD = rsd(ungroomed);
+                                level.hist_myRSD_pt->Fill(groomedRSD.pt(),EventWeight);
+                                if (groomedRSD.pt() > 400.e3)
+                                    level.hist_myRSD_m->Fill(groomedRSD.m(),EventWeight);
+
+                                fastjet::PseudoJet groomedBUSD = busd(ungroomed);
+                                level.hist_myBUSD_pt->Fill(groomedBUSD.pt(),EventWeight);
+                                if (groomedBUSD.pt() > 400.e3)
+                                    level.hist_myBUSD_m->Fill(groomedBUSD.m(),EventWeight);
+
+                                fastjet::PseudoJet groomedBUSDT = busdt(ungroomed);
+                                level.hist_myBUSDT_pt->Fill(groomedBUSDT.pt(),EventWeight);
+                                if (groomedBUSDT.pt() > 400.e3)
+                                    level.hist_myBUSDT_m->Fill(groomedBUSDT.m(),EventWeight);
+
+
+
+                                // Step 5: Calculating substructure variables for R=1.0 jets
+                                // Histograms to fill:
+                                //  hist_ungroom_D2:    Leading rebuilt ungroomed R=1.0 jet D2, with the event weight
+                                //  hist_ungroom_tau32: Leading rebuilt ungroomed R=1.0 jet tau32, with the event weight
+                                //  hist_trimmed_D2:    Leading rebuilt trimmed R=1.0 jet D2, with the event weight
+                                //  hist_trimmed_tau32: Leading rebuilt trimmed R=1.0 jet tau32, with the event weight
+                                //  hist_pruned_D2:     Leading Pruned R=1.0 jet D2, with the event weight
+                                //  hist_pruned_tau32:  Leading Pruned R=1.0 jet tau32, with the event weight
+                                //  hist_mySD_D2:       Leading SoftDrop R=1.0 jet D2, with the event weight
+                                //  hist_mySD_tau32:    Leading SoftDrop R=1.0 jet tau32, with the event weight
+                                //  hist_myRSD_D2:      Leading Recursive SoftDrop R=1.0 jet D2, with the event weight
+                                //  hist_myRSD_tau32:   Leading Recursive SoftDrop R=1.0 jet tau32, with the event weight
+                                //  hist_myBUSD_D2:     Leading Bottom-Up SoftDrop R=1.0 jet D2, with the event weight
+                                //  hist_myBUSD_tau32:  Leading Bottom-Up SoftDrop R=1.0 jet tau32, with the event weight
+                                //  hist_myBUSDT_D2:    Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet D2, with the event weight
+                                //  hist_myBUSDT_tau32: Leading Tighter-variant of Bottom-Up SoftDrop R=1.0 jet tau32, with the event weight
+                                if constexpr (MaxStep >= 5)
+                                {
+                                    // Only fill the histograms when jet pT > 400 GeV
+                                    // Recall that D2 = ECF3 * ECF1^3 / ECF2^3
+                                    // Recall that tau32 = tau3 / tau2
+                                    const fastjet::PseudoJet* jets[numJetTypes] = {&ungroomed,&trimmed,&pruned,&groomedSD,&groomedRSD,&groomedBUSD,&groomedBUSDT};
+
+                                    // Optionally drop the softest constituents before calculating substructure, only for the jets passing the cut
+                                    fastjet::PseudoJet substructureJets[numJetTypes];
+
+                                    // Lund-plane mu bin of the event, or -1 outside of the bins
+                                    int lundMuBin = -1;
+                                    if (doLund && mu_average >= lundMuBins.front() && mu_average < lundMuBins.back())
+                                        lundMuBin = std::upper_bound(lundMuBins.begin(),lundMuBins.end(),mu_average) - lundMuBins.begin() - 1;
+
+                                    // The N-subjettiness axes of the ungroomed jet are only built once a jet passes the cut
+                                    bool nsubReferenceSet = false;
+                                    for (size_t iType = 0; iType < numJetTypes; ++iType)
+                                    {
+                                        if (jets[iType]->pt() < 400.e3)
+                                            continue;
+                                        substructureJets[iType] = doTruncate ? truncateConstituents(*jets[iType],truncFrac,truncTopK) : *jets[iType];
+                                        const fastjet::PseudoJet& jet = substructureJets[iType];
+                                        if (useNsubCache && !nsubReferenceSet)
+                                        {
+                                            if (iType)
+                                                substructureJets[0] = doTruncate ? truncateConstituents(ungroomed,truncFrac,truncTopK) : ungroomed;
+                                            nsubCache.setReference(substructureJets[0]);
+                                            nsubReferenceSet = true;
+                                        }
+
+                                        // The Lund plane uses all constituents of the jet
+                                        if (lundMuBin >= 0)
+                                        {
+                                            FastHist2D<TH2F>* hist_lund = level.hists_lund.at(iType*(lundMuBins.size()-1)+lundMuBin);
+                                            for (const LundEmission& emission : lundPlane(*jets[iType]))
+                                                hist_lund->Fill(emission.lnInvDeltaR,emission.lnKt,EventWeight);
+                                            level.hists_lund_jets.at(iType)->Fill(mu_average,EventWeight);
+                                        }
+
+                                        const std::vector<ECFScanValues>* scan = scanBetas.size() ? &ecfScan(jet) : nullptr;
+                                        const double D2val = computeD2(jet,true,scanBetaOne < scanBetas.size() ? &scan->at(scanBetaOne) : nullptr);
+                                        if (D2val >= 0)
+                                            level.hists_D2[iType]->Fill(D2val,EventWeight);
+
+                                        const double tau32val = computeTau32(jet);
+                                        if (tau32val >= 0)
+                                            level.hists_tau32[iType]->Fill(tau32val,EventWeight);
+
+                                        // Measure the truncation bias and time against the full calculation
+                                        // Both are timed without the ECF cross-check, the truncated one including the truncation
+                                        if (doTruncate && numTruncValidated < truncValidate)
+                                        {
+                                            timeTruncKept.Start(false);
+                                            const fastjet::PseudoJet timedJet = truncateConstituents(*jets[iType],truncFrac,truncTopK);
+                                            computeD2(timedJet,false);
+                                            computeTau32(timedJet);
+                                            timeTruncKept.Stop();
+
+                                            timeTruncFull.Start(false);
+                                            const double D2full    = computeD2(*jets[iType],false);
+                                            const double tau32full = computeTau32(*jets[iType]);
+                                            timeTruncFull.Stop();
+
+                                            if (D2val >= 0 && D2full >= 0)
+                                                level.hist_trunc_D2_bias->Fill(D2val-D2full,EventWeight);
+                                            if (tau32val >= 0 && tau32full >= 0)
+                                                level.hist_trunc_tau32_bias->Fill(tau32val-tau32full,EventWeight);
+                                            level.hist_trunc_kept->Fill(jet.constituents().size()/double(jets[iType]->constituents().size()),EventWeight);
+                                            ++numTruncValidated;
+                                        }
+
+                                        if (scan)
+                                        {
+                                            for (size_t iBeta = 0; iBeta < scan->size(); ++iBeta)
+                                            {
+                                                if (scan->at(iBeta).ecf2 <= 0)
+                                                    continue;
+                                                level.hists_scan_D2.at(iType*scanBetas.size()+iBeta)->Fill(scan->at(iBeta).D2(),EventWeight);
+                                                level.hists_scan_N2.at(iType*scanBetas.size()+iBeta)->Fill(scan->at(iBeta).N2(),EventWeight);
+                                                level.hists_scan_M2.at(iType*scanBetas.size()+iBeta)->Fill(scan->at(iBeta).M2(),EventWeight);
+                                            }
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // Step 3 and 4, reclustering: R=1.0 jets built from the existing R=0.4 jets instead of clusters
+                // Histograms to fill:
+                //  hist_myreclus_*:        Leading reclustered ungroomed and trimmed R=1.0 jet, as in step 3
+                //  hists_reclus_groomed_*: Leading reclustered groomed R=1.0 jets, as in step 4
+                if constexpr (MaxStep >= 3)
+                {
+                    if (doRecluster)
+                    {
+                        level.timeReclusJets.Start(false);
+                        std::vector<fastjet::PseudoJet> smallJets;
+                        for (size_t iJet = 0; iJet < level.jet_R4_pt->size(); ++iJet)
+                        {
+                            if (level.jet_R4_pt->at(iJet) < reclusPtMin)
+                                continue;
+                            TLorentzVector smallJet;
+                            smallJet.SetPtEtaPhiM(level.jet_R4_pt->at(iJet),level.jet_R4_eta->at(iJet),level.jet_R4_phi->at(iJet),level.jet_R4_m->at(iJet));
+                            smallJets.push_back(fastjet::PseudoJet(smallJet.Px(),smallJet.Py(),smallJet.Pz(),smallJet.E()));
+                            smallJets.back().set_user_index(iJet);
+                        }
+                        fastjet::ClusterSequence cs_a10_reclus(smallJets,akt10);
+                        std::vector<fastjet::PseudoJet> jets_a10_reclus = fastjet::sorted_by_pt(cs_a10_reclus.inclusive_jets());
+                        level.timeReclusJets.Stop();
+
+                        if (jets_a10_reclus.size())
+                        {
+                            const fastjet::PseudoJet& ungroomed = jets_a10_reclus.at(0);
+                            fastjet::PseudoJet trimmed = (*trimmer)(ungroomed);
+
+                            level.hist_myreclus_pt_nw->Fill(ungroomed.pt());
+                            level.hist_myreclus_pt->Fill(ungroomed.pt(),EventWeight);
+                            level.hist_myreclustrim_pt_nw->Fill(trimmed.pt());
+                            level.hist_myreclustrim_pt->Fill(trimmed.pt(),EventWeight);
+                            level.hist_myreclus_nsub->Fill(ungroomed.constituents().size(),EventWeight);
+                            if (ungroomed.pt() > 400.e3)
+                                level.hist_myreclus_m->Fill(ungroomed.m(),EventWeight);
+
+                            // Only fill the mass histograms when jet pT > 400 GeV
+                            if constexpr (MaxStep >= 4)
+                            {
+                                for (size_t iGroomer = 0; iGroomer < numReclusGroomers; ++iGroomer)
+                                {
+                                    const fastjet::PseudoJet groomed = (*reclusGroomers[iGroomer])(ungroomed);
+                                    level.hists_reclus_groomed_pt[iGroomer]->Fill(groomed.pt(),EventWeight);
+                                    if (groomed.pt() > 400.e3)
+                                        level.hists_reclus_groomed_m[iGroomer]->Fill(groomed.m(),EventWeight);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
 
-        hist_myBUSDT_pt.Write();
-        hist_myBUSDT_m.Write();
-    }
 
-    // Step 5: Calculating substructure variables for R=1.0 jets
-    if (!stepNum || stepNum >= 5)
-    {
-        hist_ungroom_D2.Write();
-        hist_ungroom_tau32.Write();
 
-        hist_trimmed_D2.Write();
-        hist_trimmed_tau32.Write();
+            // All-jets mode: groom and measure the jets of the batch once it is complete
+            if constexpr (MaxStep >= 3)
+            {
+                if (doAllJets && allJetsBatch && ((iEvent+1)%allJetsBatch == 0 || iEvent+1 == numEvents))
+                    for (const std::unique_ptr<JetRecoLevel>& level : levels)
+                        processJetBatch(*level,maxStep);
+            }
 
-        hist_pruned_D2.Write();
-        hist_pruned_tau32.Write();
+            // Step 6: Truth-reco response of matched R=1.0 jets
+            // Histograms to fill:
+            //  hists_response: reco / truth pT, mass, D2 and tau32 of matched jets, per jet type and truth pT bin
+            //  hist_match_dR:  distance between the matched jets
+            //  hist_match_eff: fraction of truth jets with a matched reco jet
+            if constexpr (MaxStep >= 6)
+            {
+                if (doResponse)
+                {
+                    const JetRecoLevel& reco  = *levels.front();
+                    const JetRecoLevel& truth = *levels.back();
+
+                    truthJets.clear();
+                    truthJetEta.clear();
+                    truthJetPhi.clear();
+                    for (const fastjet::PseudoJet& jet : truth.jets_a10_clusters)
+                    {
+                        if (jet.pt() < responsePtBins.front() || jet.pt() >= responsePtBins.back())
+                            continue;
+                        truthJets.push_back(&jet);
+                        truthJetEta.push_back(jet.eta());
+                        truthJetPhi.push_back(jet.phi());
+                    }
+                    recoJetEta.clear();
+                    recoJetPhi.clear();
+                    for (const fastjet::PseudoJet& jet : reco.jets_a10_clusters)
+                    {
+                        recoJetEta.push_back(jet.eta());
+                        recoJetPhi.push_back(jet.phi());
+                    }
+
+                    // Truth jets are in decreasing pT order, so the hardest truth jets are matched first
+                    const std::vector<int>& matches = responseMatcher.match(truthJetEta,truthJetPhi,recoJetEta,recoJetPhi);
+                    for (size_t iTruth = 0; iTruth < truthJets.size(); ++iTruth)
+                    {
+                        const fastjet::PseudoJet& truthJet = *truthJets.at(iTruth);
+                        hist_match_eff->Fill(truthJet.pt(),matches.at(iTruth) >= 0,EventWeight);
+                        if (matches.at(iTruth) < 0)
+                            continue;
+                        const fastjet::PseudoJet& recoJet = reco.jets_a10_clusters.at(matches.at(iTruth));
+                        hist_match_dR->Fill(recoJet.delta_R(truthJet),EventWeight);
+
+                        double truthValues[numJetTypes][numResponseVars];
+                        double recoValues[numJetTypes][numResponseVars];
+                        computeResponseValues(truthJet,truthValues);
+                        computeResponseValues(recoJet,recoValues);
+
+                        const size_t iBin = std::upper_bound(responsePtBins.begin(),responsePtBins.end(),truthJet.pt()) - responsePtBins.begin() - 1;
+                        for (size_t iType = 0; iType < numJetTypes; ++iType)
+                            for (size_t iVar = 0; iVar < numResponseVars; ++iVar)
+                            {
+                                // D2 and tau32 are negative when they are not defined
+                                if (truthValues[iType][iVar] <= 0 || recoValues[iType][iVar] < 0)
+                                    continue;
+                                hists_response.at((iType*(responsePtBins.size()-1)+iBin)*numResponseVars+iVar)->Fill(recoValues[iType][iVar]/truthValues[iType][iVar],EventWeight);
+                            }
+                    }
+                }
+            }
+        }
+    };
 
-        hist_SD_D2.Write();
-        hist_SD_tau32.Write();
+    TStopwatch timeEventLoop;
+    timeEventLoop.Start();
+    switch (stepNum)
+    {
+        case 1:  eventLoop(std::integral_constant<int,1>()); break;
+        case 2:  eventLoop(std::integral_constant<int,2>()); break;
+        case 3:  eventLoop(std::integral_constant<int,3>()); break;
+        case 4:  eventLoop(std::integral_constant<int,4>()); break;
+        case 5:  eventLoop(std::integral_constant<int,5>()); break;
+        default: eventLoop(std::integral_constant<int,6>()); break;
+    }
+    timeEventLoop.Stop();
+    printf("Event loop up to step %d: CPU time per event %.1f us\n",stepNum ? stepNum : 6,numEvents ? 1.e6*timeEventLoop.CpuTime()/numEvents : 0.);
+    
+    if (recordTruthCache)
+    {
+        if (truthCache->save())
+            printf("Cached the truth jets of %lld events in %s\n",truthCache->numRecorded(),truthCache->fileName().c_str());
+        else
+            printf("Failed to write the truth jet cache: %s\n",truthCache->fileName().c_str());
+    }
+    if ((!stepNum || stepNum >= 3) && doRecluster)
+    {
+        for (const std::unique_ptr<JetRecoLevel>& level : levels)
+        {
+            printf("%s jet building CPU time per event: %.1f us from R=0.4 jets",level->name.c_str(),numEvents ? 1.e6*level->timeReclusJets.CpuTime()/numEvents : 0.);
+            if (doClusterJets)
+                printf(", %.1f us from %s",numEvents ? 1.e6*level->timeClusterJets.CpuTime()/numEvents : 0.,level->inputTypeString.c_str());
+            printf("\n");
+        }
+    }
+    if (doAllJets)
+    {
+        for (const std::unique_ptr<JetRecoLevel>& level : levels)
+            printf("%s all-jets mode CPU time per jet: %.1f us %s\n",level->name.c_str(),level->numAllJets ? 1.e6*level->timeAllJets.CpuTime()/level->numAllJets : 0.,
+                    allJetsBatch ? Form("with batches of %lld events",allJetsBatch) : "with each jet on its own");
+    }
+    if ((!stepNum || stepNum >= 3) && doClusterJets && doPreClus)
+    {
+        std::string chain;
+        for (const std::unique_ptr<PreClusteringStage>& stage : preClusteringStages)
+            chain += (chain.empty() ? "" : " -> ")+stage->name();
+        printf("Pre-clustering (%s): average number of inputs reduced from %.1f to %.1f\n",chain.c_str(),numEvents ? numInputsTotal/double(numEvents) : 0.,numEvents ? numInputsPreClus/double(numEvents) : 0.);
+    }
+    if (ecfChecks > 0 && useFastECF)
+    {
+        printf("Fast ECF cross-check: %lld jets checked, %lld differ from fastjet::contrib by more than 1e-6, maximum relative difference %g\n",numECFChecked,numECFFailed,maxECFRelativeDiff);
+    }
+    if ((!stepNum || stepNum >= 5) && doTruncate)
+    {
+        if (numTruncValidated)
+            printf("Constituent truncation: D2 and tau32 CPU time per validated jet %.1f us truncated, %.1f us full\n",1.e6*timeTruncKept.CpuTime()/numTruncValidated,1.e6*timeTruncFull.CpuTime()/numTruncValidated);
+        for (const std::unique_ptr<JetRecoLevel>& level : levels)
+        {
+            if (!level->hist_trunc_kept || !level->hist_trunc_kept->GetEntries())
+                continue;
+            printf("%s constituent truncation bias from %.0f jets: D2 %.4f +- %.4f (RMS), tau32 %.4f +- %.4f (RMS)\n",level->name.c_str(),level->hist_trunc_kept->GetEntries(),
+                    level->hist_trunc_D2_bias->GetMean(),level->hist_trunc_D2_bias->GetRMS(),level->hist_trunc_tau32_bias->GetMean(),level->hist_trunc_tau32_bias->GetRMS());
+        }
+    }
+    if ((!stepNum || stepNum >= 5) && doClusterJets && useNsubCache)
+    {
+        printf("N-subjettiness axes: reused for %lld jets, recomputed for %lld jets\n",nsubCache.numReused(),nsubCache.numRecomputed());
+        if (numNsubChecked)
+            printf("N-subjettiness cross-check: %lld jets with reused axes checked, %lld differ from fastjet::contrib by more than 1e-3 in tau32, mean difference %g, maximum %g\n",
+                    numNsubChecked,numNsubFailed,sumNsubDiff/numNsubChecked,maxNsubDiff);
+    }
+    if (doLund)
+    {
+        printf("Lund plane: C/A sequence reused for %lld jets, reclustered for %lld jets\n",lundPlane.numReused(),lundPlane.numReclustered());
+    }
 
-        hist_RSD_D2.Write();
-        hist_RSD_tau32.Write();
+    ////////////////////////////////////////////////////////////
+    // Save the results to the output file                    //
+    ////////////////////////////////////////////////////////////
 
-        hist_BUSD_D2.Write();
-        hist_BUSD_tau32.Write();
+    // Steps 1 and 6: event-level information and the truth-reco response
+    outFile->cd();
+    histograms.write();
 
-        hist_BUSDT_D2.Write();
-        hist_BUSDT_tau32.Write();
+    // Steps 2 to 5 for each level, with the truth histograms in their own directory if both levels are run
+    for (const std::unique_ptr<JetRecoLevel>& level : levels)
+    {
+        level->outDir->cd();
+        level->histograms.write();
+        if (level->jetTree)
+            level->jetTree->Write();
     }
 
 
@@ -0,0 +1,155 @@
+////////////////////////////////////////
+// Check of the StreamingStats.h accumulators
+////////////////////////////////////////
+
+// Compile with (for example):
+// g++ -O2 streamingStatsCheck.cpp -o streamingStatsCheck
+//
+// Adds the same random weighted values, shaped like the jet pT response, to the accumulators and
+// compares the mean, RMS and quantiles to the exact ones.  The quantiles are compared by rank: the
+// exact fraction of the weight below the t-digest quantile q should be close to q.  The results must
+// not depend on the normalisation of the weights: scaling all of them by a power of two leaves every
+// rounding unchanged, so the quantiles must be identical, while other factors can change which
+// centroids are merged and only the ranks are compared.  The same holds when the values are split
+// between accumulators which are merged afterwards, also when the accumulators are first rebuilt from
+// their state, as when it is read back from several files.  Returns 1 if any check fails.
+
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "StreamingStats.h"
+
+// Fraction of the weight of the sorted values below x
+double exactRank(const std::vector< std::pair<double,double> >& sorted, const double sumw, const double x)
+{
+    double below = 0;
+    for (const std::pair<double,double>& value : sorted)
+    {
+        if (!(value.first < x))
+            break;
+        below += value.second;
+    }
+    return below/sumw;
+}
+
+int main (int argc, char* argv[])
+{
+    const long long numValues = argc > 1 ? atoll(argv[1]) : 100000;
+    if (numValues <= 0)
+    {
+        printf("USAGE: %s [number of values]\n",argv[0]);
+        return 1;
+    }
+
+    // Response-like values with a low tail, and event weights spanning a few orders of magnitude
+    std::mt19937 random(1234);
+    std::normal_distribution<double> core(1.0,0.1);
+    std::exponential_distribution<double> tail(5);
+    std::uniform_real_distribution<double> uniform(0,1);
+    std::vector< std::pair<double,double> > values(numValues);
+    for (std::pair<double,double>& value : values)
+    {
+        value.first  = uniform(random) < 0.9 ? core(random) : 1-tail(random);
+        value.second = std::pow(10.,3*uniform(random)-1);
+    }
+
+    // Exact mean, RMS and sorted values for the ranks
+    double sumw = 0, sumwx = 0, maxw = 0;
+    for (const std::pair<double,double>& value : values)
+    {
+        sumw  += value.second;
+        sumwx += value.second*value.first;
+        maxw   = std::max(maxw,value.second);
+    }
+    const double mean = sumwx/sumw;
+    double sumwDev2 = 0;
+    for (const std::pair<double,double>& value : values)
+        sumwDev2 += value.second*(value.first-mean)*(value.first-mean);
+    const double rms = std::sqrt(sumwDev2/sumw);
+    std::vector< std::pair<double,double> > sorted(values);
+    std::sort(sorted.begin(),sorted.end());
+
+    // One accumulator with all values, the same with scaled weights, and three merged ones
+    const int numScales = 3;
+    const double scales[numScales] = {std::ldexp(1.,-20),std::ldexp(1.,20),1.e3};
+    StreamingStats all, scaled[numScales], parts[3];
+    for (long long iValue = 0; iValue < numValues; ++iValue)
+    {
+        const double x = values[iValue].first;
+        const double w = values[iValue].second;
+        all.add(x,w);
+        for (int iScale = 0; iScale < numScales; ++iScale)
+            scaled[iScale].add(x,w*scales[iScale]);
+        parts[iValue%3].add(x,w);
+    }
+
+    // The same parts rebuilt from their state, before they are merged
+    StreamingStats restored;
+    for (StreamingStats& part : parts)
+    {
+        std::vector<double> means, weights;
+        part.quantiles().getCentroids(means,weights);
+        const WelfordAccumulator moments(part.moments().sumOfWeights(),part.moments().sumOfSquaredWeights(),
+                                         part.moments().mean(),part.moments().sumOfSquaredDeviations());
+        const TDigest quantiles(part.quantiles().compression(),means,weights,part.quantiles().min(),part.quantiles().max());
+        restored.merge(StreamingStats(moments,quantiles,part.numSkipped(),part.skippedWeight()));
+    }
+
+    parts[0].merge(parts[1]);
+    parts[0].merge(parts[2]);
+    StreamingStats& merged = parts[0];
+
+    bool passed = true;
+    auto check = [&passed](const char* name, const double diff, const double tolerance)
+    {
+        const bool ok = diff <= tolerance;
+        printf("\t%-50s %9.2e (tolerance %.0e) %s\n",name,diff,tolerance,ok ? "ok" : "FAILED");
+        passed = passed && ok;
+    };
+
+    printf("Checks for %lld weighted values:\n",numValues);
+    check("Mean vs exact",std::fabs(all.moments().mean()-mean)/rms,1.e-12);
+    check("RMS vs exact",std::fabs(all.moments().rms()-rms)/rms,1.e-9);
+    check("Merged mean vs exact",std::fabs(merged.moments().mean()-mean)/rms,1.e-12);
+    check("Merged RMS vs exact",std::fabs(merged.moments().rms()-rms)/rms,1.e-9);
+    check("Restored mean vs exact",std::fabs(restored.moments().mean()-mean)/rms,1.e-12);
+    check("Restored RMS vs exact",std::fabs(restored.moments().rms()-rms)/rms,1.e-9);
+    char name[64];
+    for (int iScale = 0; iScale < numScales; ++iScale)
+    {
+        snprintf(name,sizeof(name),"Mean with weights scaled by %g",scales[iScale]);
+        check(name,std::fabs(scaled[iScale].moments().mean()-all.moments().mean())/rms,1.e-12);
+        snprintf(name,sizeof(name),"RMS with weights scaled by %g",scales[iScale]);
+        check(name,std::fabs(scaled[iScale].moments().rms()-all.moments().rms())/rms,1.e-9);
+    }
+
+    // Ranks are compared with a tolerance which shrinks towards the tails, as the digest resolution does,
+    // but not below the fraction of the weight carried by the largest single value
+    for (const double q : {0.,1.e-5,0.001,0.01,0.1,0.25,0.5,0.75,0.9,0.99,0.999,1.})
+    {
+        const double tolerance = std::max(2.e-4,0.02*std::sqrt(q*(1-q))) + maxw/sumw;
+        snprintf(name,sizeof(name),"Rank of quantile %g vs exact",q);
+        check(name,std::fabs(exactRank(sorted,sumw,all.quantiles().quantile(q))-q),tolerance);
+        snprintf(name,sizeof(name),"Rank of merged quantile %g vs exact",q);
+        check(name,std::fabs(exactRank(sorted,sumw,merged.quantiles().quantile(q))-q),tolerance);
+        snprintf(name,sizeof(name),"Rank of restored quantile %g vs exact",q);
+        check(name,std::fabs(exactRank(sorted,sumw,restored.quantiles().quantile(q))-q),tolerance);
+        for (int iScale = 0; iScale < numScales; ++iScale)
+        {
+            snprintf(name,sizeof(name),"Rank of quantile %g, weights scaled by %g",q,scales[iScale]);
+            check(name,std::fabs(exactRank(sorted,sumw,scaled[iScale].quantiles().quantile(q))-q),tolerance);
+            if (scales[iScale] != std::ldexp(1.,std::ilogb(scales[iScale])))
+                continue;
+            snprintf(name,sizeof(name),"Quantile %g, weights scaled by %g",q,scales[iScale]);
+            check(name,std::fabs(scaled[iScale].quantiles().quantile(q)-all.quantiles().quantile(q)),0);
+        }
+    }
+
+    printf("%s\n",passed ? "All checks passed" : "Some checks FAILED");
+    return passed ? 0 : 1;
+}